@@ -0,0 +1,638 @@
+// Copyright Nezametdinov E. Ildus 2021.
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// https://www.boost.org/LICENSE_1_0.txt)
+//
+// Map benchmark. Usage:
+//
+//   bench [max_keys [csv_file]]
+//
+// For every key order (sequential, random, Zipf-skewed) and every map size from
+// 1K up to {max_keys} (10M by default) this program measures insert, find,
+// lower_bound, full iteration (with iterators and with a cursor), freezing (and
+// find, lower_bound and iteration in the frozen copy), remove, clear, loading
+// from the frozen copy, hinted insertion, union with a smaller map and range
+// removal.
+// Human-readable results are printed to stdout, machine-readable results are
+// written to {csv_file} ("build/bench.csv" by default).
+//
+// Every run is executed in a separate child process, so that peak RSS and
+// memory usage reported for a run are not affected by other runs. All random
+// sequences are generated with fixed seeds, so results are reproducible.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdalign.h>
+#include <stdbool.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/map.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Map's key and element types.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef uint64_t map_key;
+
+typedef struct {
+    map_key k;
+    uint64_t v;
+} map_element;
+
+////////////////////////////////////////////////////////////////////////////////
+// Map key setter/getter/comparison functions.
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+map_key_set(ucs_map_key k, char* mem) {
+    memcpy(&(((map_element*)(mem))->k), k, sizeof(map_key));
+}
+
+static ucs_map_key
+map_key_get(char* mem) {
+    return &(((map_element*)(mem))->k);
+}
+
+static int
+map_key_cmp(ucs_map_key k0, ucs_map_key k1) {
+#define key_(k) (*((map_key*)(k)))
+
+    return (key_(k0) > key_(k1)) - (key_(k0) < key_(k1));
+
+#undef key_
+}
+
+// Keys fit in 64 bits, so the prefix is the key itself.
+static uint64_t
+map_key_prefix(ucs_map_key k) {
+    return *((map_key*)(k));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Type-specialized map.
+////////////////////////////////////////////////////////////////////////////////
+
+UCS_MAP_DEFINE(typed_map, map_element, map_key, k, UCS_MAP_SCALAR_CMP)
+
+////////////////////////////////////////////////////////////////////////////////
+// Random number generation.
+////////////////////////////////////////////////////////////////////////////////
+
+// Deterministic xorshift64* generator.
+static uint64_t
+rng_next(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * UINT64_C(2685821657736338717);
+}
+
+// Returns uniformly distributed number from [0, 1).
+static double
+rng_next_double(uint64_t* state) {
+    return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void
+shuffle(map_key* keys, size_t n, uint64_t* state) {
+    for(size_t i = n; i > 1; --i) {
+        size_t j = (size_t)(rng_next(state) % i);
+
+        map_key x = keys[i - 1];
+        keys[i - 1] = keys[j];
+        keys[j] = x;
+    }
+}
+
+// Zipf distribution over [0, n) with skew {theta}, see J. Gray et al. "Quickly
+// generating billion-record synthetic databases".
+typedef struct {
+    double theta, alpha, eta, zeta_n, half_pow_theta;
+    size_t n;
+} zipf_distribution;
+
+static zipf_distribution
+zipf_distribution_make(size_t n, double theta) {
+    double zeta_2 = 1.0 + pow(0.5, theta), zeta_n = 0.0;
+    for(size_t i = 1; i <= n; ++i) {
+        zeta_n += 1.0 / pow((double)(i), theta);
+    }
+
+    return (zipf_distribution){
+        .theta = theta,
+        .alpha = 1.0 / (1.0 - theta),
+        .eta = (1.0 - pow(2.0 / (double)(n), 1.0 - theta)) /
+               (1.0 - zeta_2 / zeta_n),
+        .zeta_n = zeta_n,
+        .half_pow_theta = pow(0.5, theta),
+        .n = n};
+}
+
+static size_t
+zipf_next(zipf_distribution const* d, uint64_t* state) {
+    double u = rng_next_double(state), uz = u * d->zeta_n;
+
+    if(uz < 1.0) {
+        return 0;
+    }
+
+    if(uz < (1.0 + d->half_pow_theta)) {
+        return 1;
+    }
+
+    size_t r =
+        (size_t)((double)(d->n) * pow(d->eta * u - d->eta + 1.0, d->alpha));
+    return ((r < d->n) ? r : (d->n - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Key orders.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef enum {
+    key_order_sequential,
+    key_order_random,
+    key_order_zipf
+} key_order;
+
+static char const* const key_order_names[] = {"sequential", "random", "zipf"};
+
+// Fills the given array with {n} keys in the given order. All keys are even, so
+// that odd keys can be used to test lower bounds of non-existing keys. The
+// {scratch} array must have space for {n} keys.
+static void
+key_sequence_generate(map_key* keys, map_key* scratch, size_t n,
+                      key_order order) {
+    uint64_t state = UINT64_C(0x9E3779B97F4A7C15) ^ (uint64_t)(n);
+
+    for(size_t i = 0; i != n; ++i) {
+        keys[i] = (map_key)(i) * 2;
+    }
+
+    if(order == key_order_sequential) {
+        return;
+    }
+
+    shuffle(keys, n, &state);
+
+    if(order == key_order_zipf) {
+        // Popular keys are scattered over the key space: rank r maps to the
+        // key from the r-th position of a random permutation.
+        memcpy(scratch, keys, n * sizeof(map_key));
+
+        zipf_distribution d = zipf_distribution_make(n, 0.99);
+        for(size_t i = 0; i != n; ++i) {
+            keys[i] = scratch[zipf_next(&d, &state)];
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map variants.
+////////////////////////////////////////////////////////////////////////////////
+
+// avl-prefix and btree-prefix variants cache keys in the nodes using a key
+// prefix function.
+typedef enum {
+    bench_variant_avl,
+    bench_variant_avl_typed,
+    bench_variant_avl_prefix,
+    bench_variant_btree,
+    bench_variant_btree_prefix
+} bench_variant;
+
+static char const* const bench_variant_names[] = {
+    "avl", "avl-typed", "avl-prefix", "btree", "btree-prefix"};
+
+////////////////////////////////////////////////////////////////////////////////
+// Measurement utilities.
+////////////////////////////////////////////////////////////////////////////////
+
+static double
+time_now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (double)(t.tv_sec) * 1e9 + (double)(t.tv_nsec);
+}
+
+// Returns peak resident set size of the calling process in KiB.
+static long
+peak_rss_kib(void) {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+
+    return usage.ru_maxrss;
+}
+
+// Returns current resident set size of the calling process in KiB. Falls back
+// to peak resident set size on systems without procfs.
+static long
+current_rss_kib(void) {
+    long pages_total = 0, pages_resident = 0;
+
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f != NULL) {
+        if(fscanf(f, "%ld %ld", &pages_total, &pages_resident) != 2) {
+            pages_resident = 0;
+        }
+
+        fclose(f);
+    }
+
+    if(pages_resident == 0) {
+        return peak_rss_kib();
+    }
+
+    return pages_resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmark results.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    bench_variant variant;
+    key_order order;
+    size_t n;
+    double bytes_per_element;
+    FILE* csv;
+} bench_run;
+
+static void
+bench_report(bench_run const* run, char const* operation, size_t op_count,
+             double elapsed_ns) {
+    double ns_per_op =
+        ((op_count != 0) ? (elapsed_ns / (double)(op_count)) : 0.0);
+    long rss = peak_rss_kib();
+
+    printf("%-10s %-10s %9zu  %-18s %10.2f ns/op %10ld KiB %8.2f B/elem\n",
+           bench_variant_names[run->variant], key_order_names[run->order],
+           run->n, operation, ns_per_op, rss, run->bytes_per_element);
+
+    fprintf(run->csv, "%s,%s,%zu,%s,%zu,%.3f,%ld,%.3f\n",
+            bench_variant_names[run->variant],
+            key_order_names[run->order], run->n, operation, op_count,
+            ns_per_op, rss, run->bytes_per_element);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarks.
+////////////////////////////////////////////////////////////////////////////////
+
+// Prevents the compiler from removing lookups whose results are not used.
+static volatile uint64_t bench_sink;
+
+static bool
+bench_map(bench_run* run, map_key const* keys) {
+    size_t const n = run->n;
+    bool const typed = (run->variant == bench_variant_avl_typed);
+
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    if(typed) {
+        cfg = typed_map_config();
+    }
+
+    if((run->variant == bench_variant_avl_prefix) ||
+       (run->variant == bench_variant_btree_prefix)) {
+        cfg.key_prefix_fn = map_key_prefix;
+    }
+
+    if((run->variant == bench_variant_btree) ||
+       (run->variant == bench_variant_btree_prefix)) {
+        cfg.flags |= ucs_map_flag_btree;
+    }
+
+    ucs_map_object_storage map_storage;
+    ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+    if(map == NULL) {
+        return false;
+    }
+
+    bool result = true;
+    uint64_t sink = 0;
+    double t = 0.0;
+
+    // Insert.
+    long rss_before = current_rss_kib();
+    size_t map_size = 0;
+
+    t = time_now_ns();
+    for(size_t i = 0; i != n; ++i) {
+        ucs_map_iterator j = (typed ? typed_map_insert(map, keys[i])
+                                    : ucs_map_insert(map, &keys[i]));
+        if(j == NULL) {
+            result = false;
+            goto cleanup;
+        }
+
+        ((map_element*)(ucs_map_iterator_mem(j)))->v = i;
+    }
+    t = time_now_ns() - t;
+
+    for(ucs_map_iterator i = ucs_map_lower(map); i != NULL;
+        i = ucs_map_iterator_next(i)) {
+        ++map_size;
+    }
+
+    run->bytes_per_element =
+        (double)(current_rss_kib() - rss_before) * 1024.0 / (double)(map_size);
+    bench_report(run, "insert", n, t);
+
+    // Find.
+    t = time_now_ns();
+    for(size_t i = 0; i != n; ++i) {
+        ucs_map_iterator j = (typed ? typed_map_find(map, keys[i])
+                                    : ucs_map_find(map, &keys[i]));
+        sink += ((map_element*)(ucs_map_iterator_mem(j)))->v;
+    }
+    t = time_now_ns() - t;
+    bench_report(run, "find", n, t);
+
+    // Lower bound (keys which are not in the map).
+    t = time_now_ns();
+    for(size_t i = 0; i != n; ++i) {
+        map_key k = keys[i] + 1;
+        sink += (uintptr_t)(typed ? typed_map_lower_bound(map, k)
+                                  : ucs_map_lower_bound(map, &k));
+    }
+    t = time_now_ns() - t;
+    bench_report(run, "lower_bound", n, t);
+
+    // Iteration.
+    t = time_now_ns();
+    for(ucs_map_iterator i = ucs_map_lower(map); i != NULL;
+        i = ucs_map_iterator_next(i)) {
+        sink += ((map_element*)(ucs_map_iterator_mem(i)))->v;
+    }
+    t = time_now_ns() - t;
+    bench_report(run, "iterate", map_size, t);
+
+    // Cursor reads in batches of element pointers.
+    if(true) {
+        enum { batch_size = 256 };
+        char* elements[batch_size];
+        ucs_map_cursor c = ucs_map_cursor_from_iterator(ucs_map_lower(map));
+
+        t = time_now_ns();
+        for(size_t n = batch_size; n == batch_size;) {
+            n = ucs_map_cursor_read_ptrs(map, &c, elements, batch_size);
+
+            for(size_t i = 0; i != n; ++i) {
+                sink += ((map_element*)(elements[i]))->v;
+            }
+        }
+        t = time_now_ns() - t;
+        bench_report(run, "cursor", map_size, t);
+    }
+
+    // Frozen copy of the map.
+    t = time_now_ns();
+    ucs_map_frozen frozen = ucs_map_freeze(map);
+    t = time_now_ns() - t;
+
+    if(frozen == NULL) {
+        result = false;
+        goto cleanup;
+    }
+
+    bench_report(run, "freeze", map_size, t);
+
+    t = time_now_ns();
+    for(size_t i = 0; i != n; ++i) {
+        ucs_map_frozen_iterator j = ucs_map_frozen_find(frozen, &keys[i]);
+        sink += ((map_element const*)(ucs_map_frozen_mem(frozen, j)))->v;
+    }
+    t = time_now_ns() - t;
+    bench_report(run, "frozen_find", n, t);
+
+    t = time_now_ns();
+    for(size_t i = 0; i != n; ++i) {
+        map_key k = keys[i] + 1;
+        sink += ucs_map_frozen_lower_bound(frozen, &k);
+    }
+    t = time_now_ns() - t;
+    bench_report(run, "frozen_lower_bound", n, t);
+
+    t = time_now_ns();
+    for(ucs_map_frozen_iterator i = ucs_map_frozen_lower(frozen); i != 0;
+        i = ucs_map_frozen_next(frozen, i)) {
+        sink += ((map_element const*)(ucs_map_frozen_mem(frozen, i)))->v;
+    }
+    t = time_now_ns() - t;
+    bench_report(run, "frozen_iterate", map_size, t);
+
+    // Remove (first half of the key sequence).
+    t = time_now_ns();
+    for(size_t i = 0; i != (n / 2); ++i) {
+        map_size -= (typed ? typed_map_remove(map, keys[i])
+                           : ucs_map_remove(map, &keys[i]));
+    }
+    t = time_now_ns() - t;
+    bench_report(run, "remove", n / 2, t);
+
+    // Clear.
+    t = time_now_ns();
+    ucs_map_clear(map);
+    t = time_now_ns() - t;
+    bench_report(run, "clear", map_size, t);
+
+    // Load the frozen copy.
+    t = time_now_ns();
+    result = ucs_map_thaw(map, frozen);
+    t = time_now_ns() - t;
+
+    ucs_map_frozen_destroy(frozen);
+
+    if(!result) {
+        goto cleanup;
+    }
+
+    bench_report(run, "thaw", ucs_map_size(map), t);
+    ucs_map_clear(map);
+
+    // Insert using the previously inserted element as a hint.
+    ucs_map_iterator hint = NULL;
+
+    t = time_now_ns();
+    for(size_t i = 0; i != n; ++i) {
+        if((hint = ucs_map_insert_hint(map, hint, &keys[i])) == NULL) {
+            result = false;
+            goto cleanup;
+        }
+    }
+    t = time_now_ns() - t;
+    bench_report(run, "insert_hint", n, t);
+
+    // Union with a map which is 16 times smaller.
+    if(true) {
+        ucs_map_object_storage other_storage;
+        ucs_map other = ucs_map_create_in_place(cfg, other_storage.mem);
+
+        if(other == NULL) {
+            result = false;
+            goto cleanup;
+        }
+
+        for(size_t i = 0; i != (n / 16); ++i) {
+            map_key k = keys[i] + 1;
+            if(ucs_map_insert(other, &k) == NULL) {
+                ucs_map_destroy_in_place(other);
+                result = false;
+                goto cleanup;
+            }
+        }
+
+        t = time_now_ns();
+        result = ucs_map_union(map, other, 1);
+        t = time_now_ns() - t;
+
+        ucs_map_destroy_in_place(other);
+
+        if(!result) {
+            goto cleanup;
+        }
+
+        bench_report(run, "union", n / 16, t);
+    }
+
+    // Remove the first quarter of the key range.
+    if(ucs_map_size(map) != 0) {
+        ucs_map_iterator first = ucs_map_lower(map), last = ucs_map_upper(map);
+        map_key lo = ((map_element*)(ucs_map_iterator_mem(first)))->k;
+        map_key hi = ((map_element*)(ucs_map_iterator_mem(last)))->k;
+
+        hi = lo + (hi - lo) / 4;
+
+        t = time_now_ns();
+        size_t removed = ucs_map_remove_range(map, &lo, &hi);
+        t = time_now_ns() - t;
+        bench_report(run, "remove_range", removed, t);
+    }
+
+cleanup:
+    bench_sink = sink;
+    ucs_map_destroy_in_place(map);
+
+    return result;
+}
+
+static bool
+bench_execute(bench_run* run) {
+    // Both arrays are released only after the benchmark, so that the map can
+    // not reuse their memory and distort memory usage measurements.
+    map_key* keys = malloc(run->n * sizeof(map_key));
+    map_key* scratch = malloc(run->n * sizeof(map_key));
+    bool result = false;
+
+    if((keys != NULL) && (scratch != NULL)) {
+        key_sequence_generate(keys, scratch, run->n, run->order);
+        result = bench_map(run, keys);
+    }
+
+    free(scratch);
+    free(keys);
+    return result;
+}
+
+// Executes the given run in a child process.
+static bool
+bench_execute_isolated(bench_run* run) {
+    fflush(stdout);
+    fflush(run->csv);
+
+    pid_t pid = fork();
+    if(pid < 0) {
+        return false;
+    }
+
+    if(pid == 0) {
+        bool result = bench_execute(run);
+
+        fflush(stdout);
+        fflush(run->csv);
+        _exit(result ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status = 0;
+    if(waitpid(pid, &status, 0) != pid) {
+        return false;
+    }
+
+    return WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Program entry point.
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char* argv[]) {
+    size_t max_keys = 10000000;
+    char const* csv_path = "build/bench.csv";
+
+    if(argc > 1) {
+        max_keys = strtoull(argv[1], NULL, 10);
+    }
+
+    if(argc > 2) {
+        csv_path = argv[2];
+    }
+
+    FILE* csv = fopen(csv_path, "w");
+    if(csv == NULL) {
+        printf("error: failed to open %s\n", csv_path);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(csv, "variant,order,keys,operation,ops,ns_per_op,peak_rss_kib,"
+                 "bytes_per_element\n");
+
+    int result = EXIT_SUCCESS;
+    for(int variant = bench_variant_avl;
+        variant <= bench_variant_btree_prefix; ++variant) {
+        for(int order = key_order_sequential; order <= key_order_zipf;
+            ++order) {
+            for(size_t n = 1000; n <= max_keys; n *= 10) {
+                bench_run run = {.variant = (bench_variant)(variant),
+                                 .order = (key_order)(order),
+                                 .n = n,
+                                 .csv = csv};
+
+                if(!bench_execute_isolated(&run)) {
+                    printf("error: %s benchmark with %zu %s keys failed\n",
+                           bench_variant_names[variant], n,
+                           key_order_names[order]);
+
+                    result = EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    fclose(csv);
+    return result;
+}
@@ -3,10 +3,19 @@
 // (See accompanying file LICENSE_1_0.txt or copy at
 // https://www.boost.org/LICENSE_1_0.txt)
 //
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
+#endif
+
 #include "alloc.h"
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <threads.h>
 #include <assert.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -16,15 +25,120 @@
 typedef struct ucs_allocated_block {
     struct ucs_allocated_block* prev;
     struct ucs_allocated_block* next;
+
+    // Blocks which have free slots are also linked into a separate list.
+    struct ucs_allocated_block* free_prev;
+    struct ucs_allocated_block* free_next;
+
+    // Children in the index of blocks (a treap ordered by blocks' addresses).
+    struct ucs_allocated_block* children[2];
+
+    // Number of slots in the block, and the number of its allocated slots.
+    size_t size, live;
+
+    // The end of block's slots. Intrusive mode: the list of block's free slots,
+    // and the first slot which was never used.
+    char* end;
+    void* free_slot;
+    char* bump;
+
+    // Free slots of the block are stored in the range [live, size) of this
+    // array. Note: this array is empty in intrusive mode.
     void* free_ptrs[];
 } ucs_allocated_block;
 
+// Thread-safe allocators only. Magazine is a list of free slots, linked
+// through their first words.
+typedef struct ucs_allocator_magazine {
+    void* head;
+    size_t size;
+} ucs_allocator_magazine;
+
+enum {
+    ucs_allocator_cache_line_size = 64,
+
+    // Number of slots in a full magazine.
+    ucs_allocator_magazine_size = 32,
+
+    // Number of attempts to take a busy lock before yielding.
+    ucs_allocator_spin_count = 64
+};
+
+typedef struct ucs_allocator_cache {
+    // Slots are taken from and returned to the loaded magazine. The previous
+    // magazine is either empty or full, so that a thread which alternates
+    // allocations and deallocations does not access the depot. Note: only the
+    // owner of the cache accesses the magazines, so they need no lock.
+    alignas(ucs_allocator_cache_line_size) ucs_allocator_magazine loaded;
+    ucs_allocator_magazine previous;
+
+    // Statistics of the threads which used the cache. Written only by the
+    // owner, and read without locking (see ucs_allocator_stats).
+    atomic_size_t alloc_count, free_count;
+
+    // Caches are never freed before their allocator. A cache whose thread has
+    // exited is reused by the next new thread.
+    struct ucs_allocator_cache* next;
+    struct ucs_allocator* allocator;
+    bool is_used;
+} ucs_allocator_cache;
+
+typedef struct ucs_allocator_shared {
+    // Protects the depot, and the rest of allocator's data.
+    alignas(ucs_allocator_cache_line_size) atomic_bool lock;
+
+    // Full magazines, linked through the second words of their first slots.
+    // Note: slots in the depot are not counted as allocated.
+    void* depot;
+
+    // Threads' caches. New caches are added to the head of the list (with the
+    // shared data locked).
+    _Atomic(ucs_allocator_cache*) caches;
+    tss_t cache_key;
+
+    // Deallocations which were not counted in threads' caches.
+    size_t free_count;
+} ucs_allocator_shared;
+
 struct ucs_allocator {
-    size_t block_size, element_size, element_mem_offset;
-    size_t alignment, allocation_size, free_idx;
-    ucs_allocated_block *head, *tail, *free_list_head;
+    // Number of slots in the first block, in the next block, and its limit.
+    size_t min_block_size, block_size, max_block_size;
+
+    size_t element_size, alignment;
+    ucs_allocated_block *head, *tail;
+
+    // Blocks which have free slots. Non-empty blocks precede empty ones, so
+    // that empty blocks are released from the tail of the list.
+    ucs_allocated_block *free_head, *free_tail;
+
+    // The root of the index of blocks, and the block of the last deallocated
+    // slot (deallocations tend to come in runs from the same block).
+    ucs_allocated_block *index, *free_block;
+
+    ucs_allocator_upstream upstream;
+
+    // Number of allocated and total slots.
+    size_t live, capacity;
+
+    size_t trim_high_watermark, trim_low_watermark;
+
+    unsigned flags;
+
+    // Thread-safe allocators only.
+    ucs_allocator_shared* shared;
+
+    // Statistics (see ucs_allocator_stats).
+    size_t block_count, reserved_size, peak_live, alloc_count, free_count;
 };
 
+#define is_intrusive_(allocator) \
+    (((allocator)->flags & ucs_allocator_flag_intrusive) != 0)
+
+#define is_huge_(allocator) \
+    (((allocator)->flags & ucs_allocator_flag_huge_pages) != 0)
+
+enum { ucs_allocator_huge_page_size = 2 * 1024 * 1024 };
+
 static_assert(alignof(struct ucs_allocator) <= ucs_allocator_object_alignment,
               "");
 static_assert(sizeof(struct ucs_allocator) <= ucs_allocator_object_size, "");
@@ -33,15 +147,374 @@ static_assert(sizeof(struct ucs_allocator) <= ucs_allocator_object_size, "");
 // Helper functions.
 ////////////////////////////////////////////////////////////////////////////////
 
+// Computes the layout of a block with {n} slots. Returns block's allocation
+// size (without rounding to huge pages), or zero if it overflows.
+static size_t
+ucs_allocator_layout(size_t n, size_t element_size, size_t alignment,
+                     unsigned flags, size_t* element_mem_offset_ptr) {
+    bool is_intrusive = ((flags & ucs_allocator_flag_intrusive) != 0);
+
+    size_t free_ptrs_array_size = (is_intrusive ? 0 : (n * sizeof(void*)));
+    if(!is_intrusive && ((free_ptrs_array_size / n) != sizeof(void*))) {
+        return 0;
+    }
+
+    size_t elements_array_size = n * element_size;
+    if((elements_array_size / n) != element_size) {
+        return 0;
+    }
+
+#define pad_(size, aignment)                                        \
+    if(true) {                                                      \
+        size_t d = (size) % (alignment);                            \
+        if((d != 0) && (((size) += (alignment)-d) < (alignment))) { \
+            return 0;                                               \
+        }                                                           \
+    }
+
+#define add_(x, y)           \
+    if(((x) += (y)) < (y)) { \
+        return 0;            \
+    }
+
+    size_t allocation_size = sizeof(ucs_allocated_block);
+    add_(allocation_size, free_ptrs_array_size);
+    pad_(allocation_size, alignment);
+
+    size_t element_mem_offset = allocation_size;
+
+    add_(allocation_size, elements_array_size);
+    pad_(allocation_size, alignment);
+
+#undef add_
+#undef pad_
+
+    *element_mem_offset_ptr = element_mem_offset;
+    return allocation_size;
+}
+
+// Computes the layout of the blocks of an allocator with the given
+// configuration. Returns the allocation size of the largest block, or zero if
+// the configuration is invalid.
+static size_t
+ucs_allocator_compute_layout(ucs_allocator_config cfg, size_t* alignment_ptr) {
+    bool is_intrusive = ((cfg.flags & ucs_allocator_flag_intrusive) != 0);
+
+    if((cfg.block_size == 0) || (cfg.element_size == 0) ||
+       (is_intrusive && (cfg.element_size < sizeof(void*)))) {
+        return 0;
+    }
+
+    // Magazines of thread-safe allocators are linked through their slots.
+    if(((cfg.flags & ucs_allocator_flag_thread_safe) != 0) &&
+       (!is_intrusive || (cfg.element_size < 2 * sizeof(void*)))) {
+        return 0;
+    }
+
+#define max_(x, y) (((x) > (y)) ? (x) : (y))
+#define is_pot_(x) (((x) & ((x)-1)) == 0)
+
+    size_t alignment =
+        max_(cfg.element_alignment, alignof(ucs_allocated_block));
+
+    if(!is_pot_(alignment)) {
+        return 0;
+    }
+
+    size_t element_mem_offset = 0;
+    size_t allocation_size = ucs_allocator_layout(
+        max_(cfg.block_size, cfg.max_block_size), cfg.element_size, alignment,
+        cfg.flags, &element_mem_offset);
+
+#undef is_pot_
+#undef max_
+
+    // Leave room for rounding to (and aligning by) huge pages.
+    if(allocation_size > (SIZE_MAX - 2 * ucs_allocator_huge_page_size)) {
+        return 0;
+    }
+
+    *alignment_ptr = alignment;
+    return allocation_size;
+}
+
+// Returns the allocation size of a block with {n} slots.
+static size_t
+ucs_allocator_block_mem_size(ucs_allocator allocator, size_t n) {
+    size_t element_mem_offset = 0;
+    size_t size = ucs_allocator_layout(n, allocator->element_size,
+                                       allocator->alignment, allocator->flags,
+                                       &element_mem_offset);
+
+    if(is_huge_(allocator)) {
+        size_t d = size % ucs_allocator_huge_page_size;
+        size += ((d != 0) ? (ucs_allocator_huge_page_size - d) : 0);
+    }
+
+    return size;
+}
+
+// Returns the memory of the first element of the given block.
+static char*
+ucs_allocator_block_elements(ucs_allocator allocator,
+                             ucs_allocated_block* block) {
+    size_t element_mem_offset = 0;
+    ucs_allocator_layout(block->size, allocator->element_size,
+                         allocator->alignment, allocator->flags,
+                         &element_mem_offset);
+
+    return ((char*)(block)) + element_mem_offset;
+}
+
+static char*
+ucs_allocator_map_huge_pages(size_t size) {
+#ifdef __linux__
+    // Map an extra huge page, and unmap the unaligned parts.
+    size_t const huge_page_size = ucs_allocator_huge_page_size;
+
+    char* mem = mmap(NULL, size + huge_page_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(mem == MAP_FAILED) {
+        return NULL;
+    }
+
+    size_t head = (huge_page_size - ((uintptr_t)(mem) % huge_page_size)) %
+                  huge_page_size;
+
+    if(head != 0) {
+        munmap(mem, head);
+    }
+
+    if(head != huge_page_size) {
+        munmap(mem + head + size, huge_page_size - head);
+    }
+
+    mem += head;
+    madvise(mem, size, MADV_HUGEPAGE);
+
+    return mem;
+#else
+    (void)(size);
+    return NULL;
+#endif
+}
+
+// The index of blocks finds the block which contains a slot. Priorities of
+// blocks in the treap are derived from their addresses.
+static uint64_t
+ucs_allocator_index_priority(ucs_allocated_block* block) {
+    return (uint64_t)((uintptr_t)(block)) * UINT64_C(0x9E3779B97F4A7C15);
+}
+
+// Requires: blocks of {x} precede blocks of {y}.
+static ucs_allocated_block*
+ucs_allocator_index_merge(ucs_allocated_block* x, ucs_allocated_block* y) {
+    if((x == NULL) || (y == NULL)) {
+        return ((x != NULL) ? x : y);
+    }
+
+    if(ucs_allocator_index_priority(x) > ucs_allocator_index_priority(y)) {
+        x->children[1] = ucs_allocator_index_merge(x->children[1], y);
+        return x;
+    }
+
+    y->children[0] = ucs_allocator_index_merge(x, y->children[0]);
+    return y;
+}
+
+// Splits the given treap into blocks which precede {block}, and the rest.
+static void
+ucs_allocator_index_split(ucs_allocated_block* t, ucs_allocated_block* block,
+                          ucs_allocated_block* parts[2]) {
+    if(t == NULL) {
+        parts[0] = parts[1] = NULL;
+    } else if((uintptr_t)(t) < (uintptr_t)(block)) {
+        ucs_allocator_index_split(t->children[1], block, parts);
+        t->children[1] = parts[0];
+        parts[0] = t;
+    } else {
+        ucs_allocator_index_split(t->children[0], block, parts);
+        t->children[0] = parts[1];
+        parts[1] = t;
+    }
+}
+
+static void
+ucs_allocator_index_insert(ucs_allocator allocator,
+                           ucs_allocated_block* block) {
+    ucs_allocated_block* parts[2] = {};
+    ucs_allocator_index_split(allocator->index, block, parts);
+
+    block->children[0] = block->children[1] = NULL;
+    allocator->index = ucs_allocator_index_merge(
+        ucs_allocator_index_merge(parts[0], block), parts[1]);
+}
+
+static void
+ucs_allocator_index_remove(ucs_allocator allocator,
+                           ucs_allocated_block* block) {
+    ucs_allocated_block** link = &allocator->index;
+    while(*link != block) {
+        link = &(*link)->children[(uintptr_t)(*link) < (uintptr_t)(block)];
+    }
+
+    *link = ucs_allocator_index_merge(block->children[0], block->children[1]);
+}
+
+// Returns the block which contains the given slot. Runs in O(log n), where n
+// is the number of blocks.
+static ucs_allocated_block*
+ucs_allocator_index_find(ucs_allocator allocator, void* mem) {
+    ucs_allocated_block* block = NULL;
+    for(ucs_allocated_block* t = allocator->index; t != NULL;) {
+        bool is_before = ((uintptr_t)(t) <= (uintptr_t)(mem));
+        block = (is_before ? t : block);
+        t = t->children[is_before];
+    }
+
+    return block;
+}
+
+// Links the given block into the list of blocks with free slots: at the tail,
+// if the block is empty, or at the head otherwise.
+static void
+ucs_allocator_free_list_link(ucs_allocator allocator,
+                             ucs_allocated_block* block, bool is_empty) {
+    if(is_empty) {
+        block->free_prev = allocator->free_tail;
+        block->free_next = NULL;
+    } else {
+        block->free_prev = NULL;
+        block->free_next = allocator->free_head;
+    }
+
+    if(block->free_prev != NULL) {
+        block->free_prev->free_next = block;
+    } else {
+        allocator->free_head = block;
+    }
+
+    if(block->free_next != NULL) {
+        block->free_next->free_prev = block;
+    } else {
+        allocator->free_tail = block;
+    }
+}
+
+static void
+ucs_allocator_free_list_unlink(ucs_allocator allocator,
+                               ucs_allocated_block* block) {
+    if(block->free_prev != NULL) {
+        block->free_prev->free_next = block->free_next;
+    } else {
+        allocator->free_head = block->free_next;
+    }
+
+    if(block->free_next != NULL) {
+        block->free_next->free_prev = block->free_prev;
+    } else {
+        allocator->free_tail = block->free_prev;
+    }
+}
+
+static void
+ucs_allocator_release_block(ucs_allocator allocator,
+                            ucs_allocated_block* block) {
+    size_t const size = ucs_allocator_block_mem_size(allocator, block->size);
+
+    allocator->block_count--;
+    allocator->reserved_size -= size;
+
+    if(allocator->upstream.region_fn != NULL) {
+        ucs_allocator_upstream_free(allocator->upstream, block, size);
+        return;
+    }
+
+#ifdef __linux__
+    if(is_huge_(allocator)) {
+        munmap(block, size);
+        return;
+    }
+#endif
+
+    free(block);
+}
+
+// Unlinks and releases the given empty block. Returns the number of released
+// bytes.
+static size_t
+ucs_allocator_remove_block(ucs_allocator allocator,
+                           ucs_allocated_block* block) {
+    if(block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        allocator->head = block->next;
+    }
+
+    if(block->next != NULL) {
+        block->next->prev = block->prev;
+    } else {
+        allocator->tail = block->prev;
+    }
+
+    ucs_allocator_free_list_unlink(allocator, block);
+    ucs_allocator_index_remove(allocator, block);
+
+    if(allocator->free_block == block) {
+        allocator->free_block = NULL;
+    }
+
+    allocator->capacity -= block->size;
+
+    size_t size = ucs_allocator_block_mem_size(allocator, block->size);
+    ucs_allocator_release_block(allocator, block);
+
+    return size;
+}
+
+// Appends a block with at least {n} slots.
 static ucs_allocated_block*
-ucs_allocator_append_block(ucs_allocator allocator) {
-    char* mem = aligned_alloc(allocator->alignment, allocator->allocation_size);
+ucs_allocator_append_block(ucs_allocator allocator, size_t n) {
+    size_t element_mem_offset = 0;
+    size_t size =
+        ucs_allocator_layout(n, allocator->element_size, allocator->alignment,
+                             allocator->flags, &element_mem_offset);
+
+    if(size == 0) {
+        return NULL;
+    }
+
+    char* mem = NULL;
+    if(allocator->upstream.region_fn != NULL) {
+        mem = ucs_allocator_upstream_alloc(
+            allocator->upstream, size, allocator->alignment);
+    } else if(is_huge_(allocator)) {
+        // Use the memory which is left after rounding for additional slots.
+        size_t rounded = ucs_allocator_block_mem_size(allocator, n);
+        size_t slot_size = allocator->element_size +
+                           (is_intrusive_(allocator) ? 0 : sizeof(void*));
+
+        for(n += (rounded - size) / slot_size;
+            ucs_allocator_layout(n, allocator->element_size,
+                                 allocator->alignment, allocator->flags,
+                                 &element_mem_offset) > rounded;
+            --n) {
+        }
+
+        mem = ucs_allocator_map_huge_pages(rounded);
+    } else {
+        mem = aligned_alloc(allocator->alignment, size);
+    }
+
     ucs_allocated_block* block = (ucs_allocated_block*)(mem);
 
     if(block != NULL) {
-        mem += allocator->element_mem_offset;
+        mem += element_mem_offset;
+        *block = (ucs_allocated_block){
+            .size = n, .end = mem + n * allocator->element_size, .bump = mem};
 
-        for(size_t i = 0; i != allocator->block_size;
+        for(size_t i = 0; !is_intrusive_(allocator) && (i != n);
             ++i, mem += allocator->element_size) {
             block->free_ptrs[i] = mem;
         }
@@ -52,77 +525,460 @@ ucs_allocator_append_block(ucs_allocator allocator) {
         if(block->prev != NULL) {
             block->prev->next = block;
         }
+
+        allocator->tail = block;
+        if(allocator->head == NULL) {
+            allocator->head = block;
+        }
+
+        ucs_allocator_index_insert(allocator, block);
+        ucs_allocator_free_list_link(allocator, block, true);
+
+        allocator->capacity += n;
+        allocator->block_count++;
+        allocator->reserved_size += ucs_allocator_block_mem_size(allocator, n);
+
+        // Grow the next block.
+        if(allocator->block_size < allocator->max_block_size) {
+            allocator->block_size =
+                (((allocator->max_block_size / 2) < allocator->block_size)
+                     ? allocator->max_block_size
+                     : (2 * allocator->block_size));
+        }
     }
 
     return block;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Allocator creation/destruction interface implementation.
-////////////////////////////////////////////////////////////////////////////////
+static void
+ucs_allocator_count_alloc(ucs_allocator allocator, size_t n) {
+    allocator->live += n;
+    allocator->alloc_count += n;
 
-ucs_allocator
-ucs_allocator_create_in_place(ucs_allocator_config cfg, char* mem) {
-    if((cfg.block_size == 0) || (cfg.element_size == 0)) {
+    if(allocator->live > allocator->peak_live) {
+        allocator->peak_live = allocator->live;
+    }
+}
+
+// Allocates a slot from the first block which has free slots. Requires: shared
+// data of a thread-safe allocator is locked.
+static void*
+ucs_allocator_block_alloc(ucs_allocator allocator) {
+    ucs_allocated_block* block = allocator->free_head;
+    if((block == NULL) &&
+       ((block = ucs_allocator_append_block(
+             allocator, allocator->block_size)) == NULL)) {
         return NULL;
     }
 
-#define max_(x, y) (((x) > (y)) ? (x) : (y))
-#define is_pot_(x) (((x) & ((x)-1)) == 0)
+    char* mem = NULL;
+    if(!is_intrusive_(allocator)) {
+        mem = block->free_ptrs[block->live];
+    } else if((mem = block->free_slot) != NULL) {
+        memcpy(&block->free_slot, mem, sizeof(void*));
+    } else {
+        mem = block->bump;
+        block->bump += allocator->element_size;
+    }
 
-    size_t alignment =
-        max_(cfg.element_alignment, alignof(ucs_allocated_block));
+    if(++block->live == block->size) {
+        ucs_allocator_free_list_unlink(allocator, block);
+    }
 
-    if(!is_pot_(alignment)) {
-        return NULL;
+    ucs_allocator_count_alloc(allocator, 1);
+    return mem;
+}
+
+static bool
+ucs_allocator_block_contains(ucs_allocated_block* block, void* mem) {
+    return (block != NULL) && ((char*)(mem) >= (char*)(block)) &&
+           ((char*)(mem) < block->end);
+}
+
+// Returns the given slot to its block. Requires: shared data of a thread-safe
+// allocator is locked.
+static void
+ucs_allocator_block_free(ucs_allocator allocator, void* mem) {
+    // Slots are often freed soon after their allocation, or next to the slot
+    // freed before them, so the first block with free slots and the block of
+    // the last deallocated slot are checked before the index.
+    ucs_allocated_block* block = allocator->free_head;
+    if(!ucs_allocator_block_contains(block, mem)) {
+        block = allocator->free_block;
+        if(!ucs_allocator_block_contains(block, mem)) {
+            block = ucs_allocator_index_find(allocator, mem);
+        }
     }
 
-#undef is_pot_
-#undef max_
+    allocator->free_block = block;
 
-    size_t free_ptrs_array_size = cfg.block_size * sizeof(void*);
-    if((free_ptrs_array_size / cfg.block_size) != sizeof(void*)) {
-        return NULL;
+    if(block->live == block->size) {
+        ucs_allocator_free_list_link(allocator, block, false);
+    }
+
+    if(is_intrusive_(allocator)) {
+        memcpy(mem, &block->free_slot, sizeof(void*));
+        block->free_slot = mem;
+        --block->live;
+    } else {
+        block->free_ptrs[--block->live] = mem;
     }
 
-    size_t elements_array_size = cfg.block_size * cfg.element_size;
-    if((elements_array_size / cfg.block_size) != cfg.element_size) {
+    if((block->live == 0) && (block != allocator->free_tail)) {
+        ucs_allocator_free_list_unlink(allocator, block);
+        ucs_allocator_free_list_link(allocator, block, true);
+    }
+}
+
+// Returns slots from the depot of a thread-safe allocator to their blocks.
+// Requires: shared data is locked.
+static void
+ucs_allocator_drain_depot(ucs_allocator allocator) {
+    for(char* head = ((allocator->shared != NULL) ? allocator->shared->depot
+                                                  : NULL);
+        head != NULL;) {
+        char* next = NULL;
+        memcpy(&next, head + sizeof(void*), sizeof(void*));
+
+        for(char* mem = head; mem != NULL;) {
+            char* x = mem;
+            memcpy(&mem, mem, sizeof(void*));
+            ucs_allocator_block_free(allocator, x);
+        }
+
+        head = next;
+    }
+
+    if(allocator->shared != NULL) {
+        allocator->shared->depot = NULL;
+    }
+}
+
+// Implements ucs_allocator_shrink. Slots in the depot are returned to their
+// blocks first only if {drain_depot} is set. Requires: shared data of a
+// thread-safe allocator is locked.
+static size_t
+ucs_allocator_shrink_locked(ucs_allocator allocator, size_t reserve,
+                            bool drain_depot) {
+    if((allocator->upstream.region_fn != NULL) &&
+       (allocator->upstream.deallocate_fn == NULL)) {
+        return 0;
+    }
+
+    if(drain_depot) {
+        ucs_allocator_drain_depot(allocator);
+    }
+
+    // Empty blocks are at the tail of the list of blocks with free slots.
+    size_t released_mem_size = 0;
+    for(ucs_allocated_block* block = allocator->free_tail;
+        (block != NULL) && (block->live == 0) &&
+        ((allocator->capacity - allocator->live - block->size) >= reserve);
+        block = allocator->free_tail) {
+        released_mem_size += ucs_allocator_remove_block(allocator, block);
+    }
+
+    return released_mem_size;
+}
+
+// Runs in O(1), unless the number of free slots exceeds the high watermark.
+// Note: the depot is kept, since its magazines are reused by threads' caches.
+static void
+ucs_allocator_trim(ucs_allocator allocator) {
+    if((allocator->trim_high_watermark != 0) &&
+       ((allocator->capacity - allocator->live) >
+        allocator->trim_high_watermark)) {
+        ucs_allocator_shrink_locked(
+            allocator, allocator->trim_low_watermark, false);
+    }
+}
+
+// Thread-safe allocation. Each thread uses its own cache (kept in
+// thread-specific storage), and locks the shared data (allocator's blocks and
+// the depot) only when a magazine must be refilled or flushed.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define cpu_relax_() __builtin_ia32_pause()
+#else
+#define cpu_relax_() ((void)(0))
+#endif
+
+static void
+ucs_allocator_lock(atomic_bool* lock) {
+    for(unsigned n = 0;
+        atomic_exchange_explicit(lock, true, memory_order_acquire);) {
+        while(atomic_load_explicit(lock, memory_order_relaxed)) {
+            if(++n < ucs_allocator_spin_count) {
+                cpu_relax_();
+            } else {
+                thrd_yield();
+                n = 0;
+            }
+        }
+    }
+}
+
+#undef cpu_relax_
+
+static void
+ucs_allocator_unlock(atomic_bool* lock) {
+    atomic_store_explicit(lock, false, memory_order_release);
+}
+
+// Adds to a counter of a cache. Requires: the calling thread owns the cache.
+static void
+ucs_allocator_counter_add(atomic_size_t* counter, size_t n) {
+    // A single writer needs no read-modify-write operation.
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+static void*
+ucs_allocator_magazine_pop(ucs_allocator_magazine* m) {
+    void* mem = m->head;
+    memcpy(&m->head, mem, sizeof(void*));
+    --m->size;
+
+    return mem;
+}
+
+static void
+ucs_allocator_magazine_push(ucs_allocator_magazine* m, void* mem) {
+    memcpy(mem, &m->head, sizeof(void*));
+    m->head = mem;
+    ++m->size;
+}
+
+// Returns the slots of the given magazine to their blocks. Requires: shared
+// data is locked.
+static void
+ucs_allocator_magazine_drain(ucs_allocator allocator,
+                             ucs_allocator_magazine* m) {
+    allocator->live -= m->size;
+    allocator->free_count += m->size;
+
+    while(m->size != 0) {
+        ucs_allocator_block_free(allocator, ucs_allocator_magazine_pop(m));
+    }
+}
+
+// Thread-specific storage destructor. Returns the slots of exiting thread's
+// cache to their blocks, and makes the cache available for reuse.
+static void
+ucs_allocator_cache_release(void* context) {
+    ucs_allocator_cache* cache = context;
+    ucs_allocator allocator = cache->allocator;
+
+    ucs_allocator_lock(&allocator->shared->lock);
+
+    ucs_allocator_magazine_drain(allocator, &cache->loaded);
+    ucs_allocator_magazine_drain(allocator, &cache->previous);
+    cache->loaded = cache->previous = (ucs_allocator_magazine){.head = NULL};
+    cache->is_used = false;
+
+    ucs_allocator_trim(allocator);
+    ucs_allocator_unlock(&allocator->shared->lock);
+}
+
+// Returns the cache of the calling thread, or NULL if it can not be created.
+static ucs_allocator_cache*
+ucs_allocator_thread_cache(ucs_allocator allocator) {
+    ucs_allocator_shared* shared = allocator->shared;
+
+    ucs_allocator_cache* cache = tss_get(shared->cache_key);
+    if(cache != NULL) {
+        return cache;
+    }
+
+    ucs_allocator_lock(&shared->lock);
+
+    cache = atomic_load_explicit(&shared->caches, memory_order_relaxed);
+    while((cache != NULL) && cache->is_used) {
+        cache = cache->next;
+    }
+
+    if(cache == NULL) {
+        cache = ucs_allocator_upstream_alloc(allocator->upstream,
+                                             sizeof(ucs_allocator_cache),
+                                             alignof(ucs_allocator_cache));
+
+        if(cache != NULL) {
+            *cache = (ucs_allocator_cache){
+                .next = atomic_load_explicit(
+                    &shared->caches, memory_order_relaxed),
+                .allocator = allocator};
+
+            atomic_init(&cache->alloc_count, 0);
+            atomic_init(&cache->free_count, 0);
+            atomic_store_explicit(
+                &shared->caches, cache, memory_order_release);
+        }
+    }
+
+    if(cache != NULL) {
+        cache->is_used = (tss_set(shared->cache_key, cache) == thrd_success);
+        cache = (cache->is_used ? cache : NULL);
+    }
+
+    ucs_allocator_unlock(&shared->lock);
+    return cache;
+}
+
+// Fills the given empty magazine with a full one from the depot, or with new
+// slots. The magazine stays empty if memory allocation fails.
+static void
+ucs_allocator_refill(ucs_allocator allocator, ucs_allocator_magazine* m) {
+    ucs_allocator_shared* shared = allocator->shared;
+    ucs_allocator_lock(&shared->lock);
+
+    if(shared->depot != NULL) {
+        *m = (ucs_allocator_magazine){
+            .head = shared->depot, .size = ucs_allocator_magazine_size};
+
+        memcpy(&shared->depot, ((char*)(m->head)) + sizeof(void*),
+               sizeof(void*));
+        ucs_allocator_count_alloc(allocator, ucs_allocator_magazine_size);
+    } else {
+        for(void* mem = NULL;
+            (m->size != ucs_allocator_magazine_size) &&
+            ((mem = ucs_allocator_block_alloc(allocator)) != NULL);) {
+            ucs_allocator_magazine_push(m, mem);
+        }
+    }
+
+    ucs_allocator_unlock(&shared->lock);
+}
+
+// Moves the given full magazine to the depot.
+static void
+ucs_allocator_flush(ucs_allocator allocator, ucs_allocator_magazine* m) {
+    ucs_allocator_shared* shared = allocator->shared;
+    ucs_allocator_lock(&shared->lock);
+
+    memcpy(((char*)(m->head)) + sizeof(void*), &shared->depot, sizeof(void*));
+    shared->depot = m->head;
+    allocator->live -= m->size;
+    allocator->free_count += m->size;
+    *m = (ucs_allocator_magazine){.head = NULL};
+
+    ucs_allocator_trim(allocator);
+    ucs_allocator_unlock(&shared->lock);
+}
+
+static void*
+ucs_allocator_shared_alloc(ucs_allocator allocator) {
+    ucs_allocator_cache* cache = ucs_allocator_thread_cache(allocator);
+    if(cache == NULL) {
         return NULL;
     }
 
-#define pad_(size, aignment)                                        \
-    if(true) {                                                      \
-        size_t d = (size) % (alignment);                            \
-        if((d != 0) && (((size) += (alignment)-d) < (alignment))) { \
-            return NULL;                                            \
-        }                                                           \
+    if(cache->loaded.size == 0) {
+        if(cache->previous.size != 0) {
+            cache->loaded = cache->previous;
+            cache->previous = (ucs_allocator_magazine){.head = NULL};
+        } else {
+            ucs_allocator_refill(allocator, &cache->loaded);
+        }
     }
 
-#define add_(x, y)           \
-    if(((x) += (y)) < (y)) { \
-        return NULL;         \
+    void* mem = NULL;
+    if(cache->loaded.size != 0) {
+        mem = ucs_allocator_magazine_pop(&cache->loaded);
+        ucs_allocator_counter_add(&cache->alloc_count, 1);
     }
 
-    size_t allocation_size = sizeof(ucs_allocated_block);
-    add_(allocation_size, free_ptrs_array_size);
-    pad_(allocation_size, alignment);
+    return mem;
+}
 
-    size_t element_mem_offset = allocation_size;
+static void
+ucs_allocator_shared_free(ucs_allocator allocator, void* mem) {
+    ucs_allocator_cache* cache = ucs_allocator_thread_cache(allocator);
+    if(cache == NULL) {
+        // Return the slot to its block directly.
+        ucs_allocator_magazine m = {.head = NULL};
+        ucs_allocator_magazine_push(&m, mem);
 
-    add_(allocation_size, elements_array_size);
-    pad_(allocation_size, alignment);
+        ucs_allocator_lock(&allocator->shared->lock);
+        ucs_allocator_magazine_drain(allocator, &m);
+        allocator->shared->free_count++;
+        ucs_allocator_unlock(&allocator->shared->lock);
 
-#undef add_
-#undef pad_
+        return;
+    }
+
+    if(cache->loaded.size == ucs_allocator_magazine_size) {
+        if(cache->previous.size != 0) {
+            ucs_allocator_flush(allocator, &cache->previous);
+        }
+
+        cache->previous = cache->loaded;
+        cache->loaded = (ucs_allocator_magazine){.head = NULL};
+    }
+
+    ucs_allocator_magazine_push(&cache->loaded, mem);
+    ucs_allocator_counter_add(&cache->free_count, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocator creation/destruction interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+ucs_allocator
+ucs_allocator_create_in_place(ucs_allocator_config cfg, char* mem) {
+    size_t alignment = 0;
+    if(ucs_allocator_compute_layout(cfg, &alignment) == 0) {
+        return NULL;
+    }
+
+#ifdef __linux__
+    if(cfg.region_fn != NULL) {
+        cfg.flags &= ~(unsigned)(ucs_allocator_flag_huge_pages);
+    }
+#else
+    cfg.flags &= ~(unsigned)(ucs_allocator_flag_huge_pages);
+#endif
 
     ucs_allocator allocator = (ucs_allocator)(mem);
     if(allocator != NULL) {
-        *allocator =
-            (struct ucs_allocator){.block_size = cfg.block_size,
-                                   .element_size = cfg.element_size,
-                                   .element_mem_offset = element_mem_offset,
-                                   .alignment = alignment,
-                                   .allocation_size = allocation_size};
+        ucs_allocator_upstream upstream = {.region_fn = cfg.region_fn,
+                                           .deallocate_fn = cfg.deallocate_fn,
+                                           .context = cfg.region_context};
+
+        ucs_allocator_shared* shared = NULL;
+        if((cfg.flags & ucs_allocator_flag_thread_safe) != 0) {
+            shared = ucs_allocator_upstream_alloc(
+                upstream, sizeof(ucs_allocator_shared),
+                alignof(ucs_allocator_shared));
+
+            if(shared == NULL) {
+                return NULL;
+            }
+
+            if(tss_create(&shared->cache_key, ucs_allocator_cache_release) !=
+               thrd_success) {
+                ucs_allocator_upstream_free(
+                    upstream, shared, sizeof(ucs_allocator_shared));
+                return NULL;
+            }
+
+            atomic_init(&shared->lock, false);
+            atomic_init(&shared->caches, NULL);
+            shared->depot = NULL;
+            shared->free_count = 0;
+        }
+
+        *allocator = (struct ucs_allocator){
+            .min_block_size = cfg.block_size,
+            .block_size = cfg.block_size,
+            .max_block_size = cfg.max_block_size,
+            .element_size = cfg.element_size,
+            .alignment = alignment,
+            .upstream = upstream,
+            .trim_high_watermark = cfg.trim_high_watermark,
+            .trim_low_watermark = cfg.trim_low_watermark,
+            .flags = cfg.flags,
+            .shared = shared};
     }
 
     return allocator;
@@ -130,11 +986,15 @@ ucs_allocator_create_in_place(ucs_allocator_config cfg, char* mem) {
 
 ucs_allocator
 ucs_allocator_create(ucs_allocator_config cfg) {
-    char* mem = aligned_alloc(
-        ucs_allocator_object_alignment, ucs_allocator_object_size);
+    ucs_allocator_upstream upstream = {.region_fn = cfg.region_fn,
+                                       .deallocate_fn = cfg.deallocate_fn,
+                                       .context = cfg.region_context};
+
+    char* mem = ucs_allocator_upstream_alloc(
+        upstream, ucs_allocator_object_size, ucs_allocator_object_alignment);
 
     if(ucs_allocator_create_in_place(cfg, mem) == NULL) {
-        free(mem);
+        ucs_allocator_upstream_free(upstream, mem, ucs_allocator_object_size);
         mem = NULL;
     }
 
@@ -150,48 +1010,124 @@ ucs_allocator_destroy_in_place(ucs_allocator allocator) {
     for(ucs_allocated_block* block = allocator->head; block != NULL;) {
         ucs_allocated_block* x = block;
         block = block->next;
-        free(x);
+        ucs_allocator_release_block(allocator, x);
+    }
+
+    ucs_allocator_shared* shared = allocator->shared;
+    if(shared == NULL) {
+        return;
+    }
+
+    // Note: destructors are not called for deleted keys.
+    tss_delete(shared->cache_key);
+
+    for(ucs_allocator_cache* cache =
+            atomic_load_explicit(&shared->caches, memory_order_relaxed);
+        cache != NULL;) {
+        ucs_allocator_cache* x = cache;
+        cache = cache->next;
+        ucs_allocator_upstream_free(
+            allocator->upstream, x, sizeof(ucs_allocator_cache));
     }
+
+    ucs_allocator_upstream_free(
+        allocator->upstream, shared, sizeof(ucs_allocator_shared));
 }
 
 void
 ucs_allocator_destroy(ucs_allocator allocator) {
+    if(allocator == NULL) {
+        return;
+    }
+
+    ucs_allocator_upstream upstream = allocator->upstream;
+
     ucs_allocator_destroy_in_place(allocator);
-    free(allocator);
+    ucs_allocator_upstream_free(
+        upstream, allocator, ucs_allocator_object_size);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Allocator memory management interface implementation.
+// Upstream memory interface implementation.
 ////////////////////////////////////////////////////////////////////////////////
 
 void*
-ucs_allocator_alloc(ucs_allocator allocator) {
-    if(allocator->head == NULL) {
-        allocator->tail = allocator->free_list_head = allocator->head =
-            ucs_allocator_append_block(allocator);
+ucs_allocator_upstream_alloc(
+    ucs_allocator_upstream upstream, size_t size, size_t alignment) {
+    if(upstream.region_fn != NULL) {
+        return upstream.region_fn(upstream.context, size, alignment);
+    }
 
-        if(allocator->head == NULL) {
-            return NULL;
-        }
+    // Note: size must be a multiple of alignment.
+    size_t d = size % alignment;
+    if((d != 0) && ((size += alignment - d) < alignment)) {
+        return NULL;
     }
 
-    if(allocator->free_idx == allocator->block_size) {
-        if(allocator->free_list_head->next != NULL) {
-            allocator->free_list_head = allocator->free_list_head->next;
-            allocator->free_idx = 0;
-        } else {
-            ucs_allocated_block* block = ucs_allocator_append_block(allocator);
+    return aligned_alloc(alignment, size);
+}
 
-            if(block == NULL) {
-                return NULL;
-            }
+void
+ucs_allocator_upstream_free(
+    ucs_allocator_upstream upstream, void* mem, size_t size) {
+    if(mem == NULL) {
+        return;
+    }
 
-            allocator->tail = allocator->free_list_head = block;
-            allocator->free_idx = 0;
-        }
+    if(upstream.region_fn == NULL) {
+        free(mem);
+    } else if(upstream.deallocate_fn != NULL) {
+        upstream.deallocate_fn(upstream.context, mem, size);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Fixed memory region implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+void*
+ucs_allocator_region_carve(void* context, size_t size, size_t alignment) {
+    ucs_allocator_region* region = context;
+
+    uintptr_t begin = (uintptr_t)(region->begin);
+    uintptr_t padding = (alignment - (begin % alignment)) % alignment;
+
+    if(((uintptr_t)(region->end) - begin) < padding) {
+        return NULL;
     }
 
-    return allocator->free_list_head->free_ptrs[allocator->free_idx++];
+    if(((uintptr_t)(region->end) - begin - padding) < size) {
+        return NULL;
+    }
+
+    char* mem = region->begin + padding;
+    region->begin = mem + size;
+
+    return mem;
+}
+
+size_t
+ucs_allocator_block_allocation_size(ucs_allocator_config cfg) {
+    size_t alignment = 0, element_mem_offset = 0;
+    if(ucs_allocator_compute_layout(cfg, &alignment) == 0) {
+        return 0;
+    }
+
+    return ucs_allocator_layout(cfg.block_size, cfg.element_size, alignment,
+                                cfg.flags, &element_mem_offset);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocator memory management interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+void*
+ucs_allocator_alloc(ucs_allocator allocator) {
+    if(allocator->shared != NULL) {
+        return ucs_allocator_shared_alloc(allocator);
+    }
+
+    return ucs_allocator_block_alloc(allocator);
 }
 
 void
@@ -200,27 +1136,154 @@ ucs_allocator_free(ucs_allocator allocator, void* mem) {
         return;
     }
 
-    if(allocator->free_idx == 0) {
-        allocator->free_list_head = allocator->free_list_head->prev;
-        allocator->free_idx = allocator->block_size;
+    if(allocator->shared != NULL) {
+        ucs_allocator_shared_free(allocator, mem);
+        return;
     }
 
-    allocator->free_list_head->free_ptrs[--allocator->free_idx] = mem;
+    ucs_allocator_block_free(allocator, mem);
+    --allocator->live;
+    ++allocator->free_count;
+
+    ucs_allocator_trim(allocator);
 }
 
 void
 ucs_allocator_free_all(ucs_allocator allocator) {
-    allocator->free_idx = 0;
-    allocator->free_list_head = allocator->head;
+    allocator->free_count += allocator->live;
+    allocator->live = 0;
 
-    for(ucs_allocated_block* block = allocator->head; block != NULL;) {
-        char* mem = ((char*)(block)) + allocator->element_mem_offset;
+    if(allocator->shared != NULL) {
+        ucs_allocator_cache* caches = atomic_load_explicit(
+            &allocator->shared->caches, memory_order_relaxed);
+
+        allocator->shared->depot = NULL;
+
+        // Count the freed slots as deallocations which bypassed the caches,
+        // so that each allocation is matched by a deallocation.
+        size_t alloc_count = 0, free_count = 0;
+        for(ucs_allocator_cache* cache = caches; cache != NULL;
+            cache = cache->next) {
+            cache->loaded = cache->previous =
+                (ucs_allocator_magazine){.head = NULL};
+
+            alloc_count += atomic_load_explicit(
+                &cache->alloc_count, memory_order_relaxed);
+            free_count +=
+                atomic_load_explicit(&cache->free_count, memory_order_relaxed);
+        }
+
+        allocator->shared->free_count = alloc_count - free_count;
+    }
 
-        for(size_t i = 0; i != allocator->block_size;
+    allocator->free_head = allocator->free_tail = NULL;
+
+    for(ucs_allocated_block* block = allocator->head; block != NULL;
+        block = block->next) {
+        char* mem = ucs_allocator_block_elements(allocator, block);
+
+        block->live = 0;
+        block->free_slot = NULL;
+        block->bump = mem;
+
+        for(size_t i = 0; !is_intrusive_(allocator) && (i != block->size);
             ++i, mem += allocator->element_size) {
             block->free_ptrs[i] = mem;
         }
 
-        block = block->next;
+        ucs_allocator_free_list_link(allocator, block, true);
+    }
+
+    ucs_allocator_trim(allocator);
+}
+
+bool
+ucs_allocator_reserve(ucs_allocator allocator, size_t n) {
+    if(allocator->shared != NULL) {
+        ucs_allocator_lock(&allocator->shared->lock);
+    }
+
+    bool result = true;
+    while(result && ((allocator->capacity - allocator->live) < n)) {
+        // Use a single block for the remaining slots, if possible.
+        size_t k = n - (allocator->capacity - allocator->live);
+        k = ((k < allocator->max_block_size) ? k : allocator->max_block_size);
+        k = ((k > allocator->block_size) ? k : allocator->block_size);
+
+        result = (ucs_allocator_append_block(allocator, k) != NULL);
+    }
+
+    if(allocator->shared != NULL) {
+        ucs_allocator_unlock(&allocator->shared->lock);
+    }
+
+    return result;
+}
+
+size_t
+ucs_allocator_shrink(ucs_allocator allocator, size_t reserve) {
+    if(allocator->shared == NULL) {
+        return ucs_allocator_shrink_locked(allocator, reserve, true);
+    }
+
+    ucs_allocator_lock(&allocator->shared->lock);
+    size_t result = ucs_allocator_shrink_locked(allocator, reserve, true);
+    ucs_allocator_unlock(&allocator->shared->lock);
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocator statistics interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+ucs_allocator_statistics
+ucs_allocator_stats(ucs_allocator allocator) {
+    ucs_allocator_shared* shared = allocator->shared;
+    if(shared == NULL) {
+        return (ucs_allocator_statistics){
+            .block_count = allocator->block_count,
+            .reserved_size = allocator->reserved_size,
+            .live_slot_count = allocator->live,
+            .free_slot_count = allocator->capacity - allocator->live,
+            .peak_live_slot_count = allocator->peak_live,
+            .alloc_count = allocator->alloc_count,
+            .free_count = allocator->free_count};
     }
+
+    // Threads count their operations in their caches. The counters are read
+    // without locking the caches, so operations which run concurrently may be
+    // counted partially.
+    size_t alloc_count = 0, free_count = 0;
+    for(ucs_allocator_cache* cache =
+            atomic_load_explicit(&shared->caches, memory_order_acquire);
+        cache != NULL; cache = cache->next) {
+        alloc_count +=
+            atomic_load_explicit(&cache->alloc_count, memory_order_relaxed);
+        free_count +=
+            atomic_load_explicit(&cache->free_count, memory_order_relaxed);
+    }
+
+    ucs_allocator_lock(&shared->lock);
+
+    free_count += shared->free_count;
+    ucs_allocator_statistics stats = {
+        .block_count = allocator->block_count,
+        .reserved_size = allocator->reserved_size,
+        .peak_live_slot_count = allocator->peak_live,
+        .alloc_count = alloc_count,
+        .free_count = free_count};
+
+    size_t const capacity = allocator->capacity;
+    ucs_allocator_unlock(&shared->lock);
+
+    // A deallocation can be counted without its allocation.
+    stats.live_slot_count =
+        ((alloc_count > free_count) ? (alloc_count - free_count) : 0);
+    stats.live_slot_count = ((stats.live_slot_count < capacity)
+                                 ? stats.live_slot_count
+                                 : capacity);
+    stats.free_slot_count = capacity - stats.live_slot_count;
+
+    return stats;
 }
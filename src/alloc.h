@@ -7,6 +7,7 @@
 #define H_F17DB8136C8748449DEFB0C8DC3633BD
 
 #include <stdalign.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -17,8 +18,15 @@ struct ucs_allocator;
 typedef struct ucs_allocator* ucs_allocator;
 
 struct ucs_allocator_private {
-    size_t m00_, m01_, m02_, m03_, m04_, m05_;
-    void *m06_, *m07_, *m08_;
+    size_t m00_, m01_, m02_, m03_, m04_;
+    void *m05_, *m06_, *m07_, *m08_, *m09_, *m10_;
+    void* (*m11_)(void*, size_t, size_t);
+    void (*m12_)(void*, void*, size_t);
+    void* m13_;
+    size_t m14_, m15_, m16_, m17_;
+    unsigned m18_;
+    void* m19_;
+    size_t m20_, m21_, m22_, m23_, m24_;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -42,10 +50,127 @@ typedef struct ucs_allocator_object_storage {
 // Allocator configuration.
 ////////////////////////////////////////////////////////////////////////////////
 
+// Region function. Returns {size} bytes of memory aligned to {alignment}, or
+// NULL if no more memory is available. Unless a deallocation function is
+// given, the memory must remain valid until the allocator is destroyed (the
+// allocator never frees it).
+typedef void* (*ucs_allocator_region_fn)(
+    void* context, size_t size, size_t alignment);
+
+// Deallocation function. Frees memory which was obtained from the region
+// function. {size} is equal to the size which was requested.
+typedef void (*ucs_allocator_deallocate_fn)(
+    void* context, void* mem, size_t size);
+
+// Allocator flags.
+enum {
+    // Free slots are linked into a list through their own memory (the first
+    // pointer-sized bytes of a freed element are overwritten), and slots which
+    // were never used are handed out in address order. This removes one
+    // pointer per slot of bookkeeping, makes ucs_allocator_free_all run in
+    // O(b), where b is the number of blocks, and makes allocation and
+    // deallocation touch only the slot itself and the header of its block.
+    // Requires: {element_size} is not less than the size of a pointer.
+    ucs_allocator_flag_intrusive = 0x01,
+
+    // Blocks are mapped directly from the system (mmap), aligned to 2 MiB, and
+    // advised to be backed by transparent huge pages. Their sizes are rounded
+    // up to a multiple of 2 MiB, and the extra memory is used for additional
+    // slots. Ignored if {region_fn} is set, or if the system does not support
+    // huge pages.
+    ucs_allocator_flag_huge_pages = 0x02,
+
+    // Allocation and deallocation can be done by any number of threads at the
+    // same time. Each thread works with its own cache of free slots, which
+    // holds up to two magazines (batches of slots). Caches exchange full
+    // magazines with a shared depot, which is locked once per batch. A slot
+    // can be freed by any thread. When a thread exits, the slots in its cache
+    // are returned to their blocks. Note: each thread-safe allocator uses a
+    // key of thread-specific storage (tss_t), and its creation fails if no
+    // key is available. Requires: {ucs_allocator_flag_intrusive} is also set,
+    // and {element_size} is not less than the size of two pointers.
+    ucs_allocator_flag_thread_safe = 0x04
+};
+
 typedef struct ucs_allocator_config {
-    size_t block_size, element_alignment, element_size;
+    // Number of slots in the first block. If {max_block_size} is greater than
+    // {block_size}, then each next block has twice as many slots as the
+    // previous one, up to {max_block_size} slots.
+    size_t block_size, max_block_size;
+
+    size_t element_alignment, element_size;
+    unsigned flags;
+
+    // Optional. If set, then blocks (and the allocator object, if it is created
+    // with ucs_allocator_create) are obtained from this function instead of
+    // the system allocator, and ucs_allocator_alloc returns NULL when the
+    // function does so. If {deallocate_fn} is also set, then the memory is
+    // returned to it; otherwise the memory is never freed. The functions
+    // receive {region_context}.
+    ucs_allocator_region_fn region_fn;
+    ucs_allocator_deallocate_fn deallocate_fn;
+    void* region_context;
+
+    // Optional. If {trim_high_watermark} is not zero, then the allocator
+    // shrinks itself (see ucs_allocator_shrink) when the number of its free
+    // slots exceeds {trim_high_watermark}, keeping at least
+    // {trim_low_watermark} free slots. Blocks are released as soon as they
+    // become empty, so that trimming does not stall deallocations. Note:
+    // trimming keeps the depot of a thread-safe allocator (full magazines
+    // which threads' caches reuse); only ucs_allocator_shrink releases it.
+    size_t trim_high_watermark, trim_low_watermark;
 } ucs_allocator_config;
 
+////////////////////////////////////////////////////////////////////////////////
+// Upstream memory interface.
+//
+// Note: these functions are used by the library for all its memory, so that
+// it can be redirected to custom allocators (e.g. arenas, or tenant-specific
+// accounting).
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct ucs_allocator_upstream {
+    ucs_allocator_region_fn region_fn;
+    ucs_allocator_deallocate_fn deallocate_fn;
+    void* context;
+} ucs_allocator_upstream;
+
+// Allocates memory with the upstream's region function, or with the system
+// allocator if the function is not set. Returns NULL if allocation fails.
+void*
+ucs_allocator_upstream_alloc(
+    ucs_allocator_upstream upstream, size_t size, size_t alignment);
+
+// Frees memory which was allocated with ucs_allocator_upstream_alloc. Does
+// nothing if the region function is set, and the deallocation function is
+// not.
+void
+ucs_allocator_upstream_free(
+    ucs_allocator_upstream upstream, void* mem, size_t size);
+
+////////////////////////////////////////////////////////////////////////////////
+// Fixed memory region.
+//
+// Note: a region can back any number of allocators (and maps): pass
+// ucs_allocator_region_carve as {region_fn}, and a pointer to the region as
+// {region_context}. Carving is not thread-safe.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct ucs_allocator_region {
+    char *begin, *end;
+} ucs_allocator_region;
+
+// Carves the next {size} bytes aligned to {alignment} from the given region
+// (pointed to by {context}). Returns NULL if the region is exhausted.
+void*
+ucs_allocator_region_carve(void* context, size_t size, size_t alignment);
+
+// Returns the size of the first block which the allocator with the given
+// configuration obtains from its region function (not counting alignment
+// padding), or zero if the configuration is invalid.
+size_t
+ucs_allocator_block_allocation_size(ucs_allocator_config cfg);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Allocator creation/destruction interface.
 ////////////////////////////////////////////////////////////////////////////////
@@ -66,6 +191,16 @@ ucs_allocator_destroy(ucs_allocator allocator);
 
 ////////////////////////////////////////////////////////////////////////////////
 // Allocator memory management interface.
+//
+// Note: if the allocator was created with {ucs_allocator_flag_thread_safe},
+// then ucs_allocator_alloc, ucs_allocator_free, ucs_allocator_reserve,
+// ucs_allocator_shrink and ucs_allocator_stats can be called concurrently, and
+// slots held in threads' caches are considered used by ucs_allocator_shrink.
+// Other functions require exclusive access.
+//
+// Note: ucs_allocator_free finds the block of the slot in O(1) if it is the
+// first block with free slots or the block of the previously freed slot, and in
+// O(log b) otherwise, where b is the number of blocks.
 ////////////////////////////////////////////////////////////////////////////////
 
 void*
@@ -77,4 +212,43 @@ ucs_allocator_free(ucs_allocator allocator, void* mem);
 void
 ucs_allocator_free_all(ucs_allocator allocator);
 
+// Ensures that the next {n} allocations succeed without obtaining new memory.
+// Returns false if memory allocation fails.
+bool
+ucs_allocator_reserve(ucs_allocator allocator, size_t n);
+
+// Releases blocks whose slots are all free, keeping at least {reserve} free
+// slots. Returns the number of released bytes. Runs in O(b), where b is the
+// number of blocks (slots in the depot of a thread-safe allocator are returned
+// to their blocks first, in O(log b) each). Note: blocks obtained from
+// {region_fn} are released only if {deallocate_fn} is set.
+size_t
+ucs_allocator_shrink(ucs_allocator allocator, size_t reserve);
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocator statistics interface.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct ucs_allocator_statistics {
+    // Number of blocks, and their total size in bytes.
+    size_t block_count, reserved_size;
+
+    // Number of allocated and free slots, and the largest number of allocated
+    // slots since the creation of the allocator. Note: in thread-safe
+    // allocators the largest number also counts slots held in threads' caches.
+    size_t live_slot_count, free_slot_count, peak_live_slot_count;
+
+    // Cumulative numbers of allocations and deallocations. Note:
+    // ucs_allocator_free_all counts as deallocation of each allocated slot.
+    size_t alloc_count, free_count;
+} ucs_allocator_statistics;
+
+// Runs in O(1), or in O(t) if the allocator is thread-safe, where t is the
+// number of threads which have used it. Counters of threads are read without
+// locking (only the shared data is locked briefly), so operations which run
+// concurrently may be counted partially. Note: unless the allocator is
+// thread-safe, the call must be synchronized with other uses of the allocator.
+ucs_allocator_statistics
+ucs_allocator_stats(ucs_allocator allocator);
+
 #endif // H_F17DB8136C8748449DEFB0C8DC3633BD
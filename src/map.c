@@ -6,53 +6,242 @@
 #include "map.h"
 
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef __STDC_NO_THREADS__
+#include <threads.h>
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // Helper macros.
 ////////////////////////////////////////////////////////////////////////////////
 
-#define key_eq_(k, node) \
-    (map->key_cmp_fn((k), map->key_get_fn((node)->mem)) == 0)
+#define key_cmp_(sk, node) (ucs_map_key_cmp(map, (sk), (node)))
+
+// Links between nodes, and map's root and bounds, are read by concurrent
+// readers while the writer changes them, so they are loaded and stored with
+// relaxed atomic operations (readers are ordered by map's version, see
+// Concurrency). Readers load each link once.
+typedef _Atomic(ucs_map_node*) ucs_map_link;
+typedef _Atomic(uintptr_t) ucs_map_link_word;
+
+static_assert((sizeof(ucs_map_link) == sizeof(ucs_map_node*)) &&
+                  (alignof(ucs_map_link) == alignof(ucs_map_node*)) &&
+                  (sizeof(ucs_map_link_word) == sizeof(uintptr_t)) &&
+                  (alignof(ucs_map_link_word) == alignof(uintptr_t)),
+              "atomic links must have the layout of plain links");
+
+#define link_(x) \
+    atomic_load_explicit((ucs_map_link*)(&(x)), memory_order_relaxed)
+
+#define set_link_(x, p) \
+    atomic_store_explicit((ucs_map_link*)(&(x)), (p), memory_order_relaxed)
+
+#define child_(node, i) link_((node)->children[i])
+
+// Node's parent and balance factor. In compact layout they share the same
+// word: balance factor (in range [-2, 2]) is stored with an offset of 2 in the
+// three low bits of parent's address.
+#ifdef UCS_MAP_COMPACT_NODES
+
+#define balance_mask_ ((uintptr_t)(7))
+
+#define parent_balance_(node)                                            \
+    atomic_load_explicit((ucs_map_link_word*)(&(node)->parent_balance), \
+                         memory_order_relaxed)
+
+#define set_parent_balance_(node, x)                                      \
+    atomic_store_explicit((ucs_map_link_word*)(&(node)->parent_balance), \
+                          (x), memory_order_relaxed)
+
+#define parent_(node) ((ucs_map_node*)(parent_balance_(node) & ~balance_mask_))
+
+#define balance_(node) ((int)(parent_balance_(node) & balance_mask_) - 2)
+
+#define set_parent_(node, p) \
+    set_parent_balance_(     \
+        node, ((uintptr_t)(p) | (parent_balance_(node) & balance_mask_)))
+
+#define set_balance_(node, b)                                              \
+    set_parent_balance_(node, ((parent_balance_(node) & ~balance_mask_) | \
+                               (uintptr_t)((b) + 2)))
+
+#else
+
+#define parent_(node) link_((node)->parent)
+#define balance_(node) ((int)((node)->balance))
 
-#define key_lt_(k, node) \
-    (map->key_cmp_fn((k), map->key_get_fn((node)->mem)) < 0)
+#define set_parent_(node, p) set_link_((node)->parent, (p))
+#define set_balance_(node, b) ((node)->balance = (signed char)(b))
 
-#define key_gt_(k, node) \
-    (map->key_cmp_fn((k), map->key_get_fn((node)->mem)) > 0)
+#endif
 
-#define child_idx_(node)                                                   \
-    ((((node)->parent == NULL) || ((node)->parent->children[0] == (node))) \
-         ? 0                                                               \
-         : 1)
+// Element is stored right after the node.
+#define node_mem_(node) (((char*)(node)) + sizeof(ucs_map_node))
+
+#define has_counts_(map) (((map)->flags & ucs_map_flag_order_statistics) != 0)
+
+// Subtree size is stored right before the node (only in maps which maintain
+// order statistics).
+#define node_count_(node) (((size_t*)(node))[-1])
+
+#define count_(node) (((node) == NULL) ? (size_t)(0) : node_count_(node))
+
+#define has_prefixes_(map) ((map)->key_prefix_fn != NULL)
+
+// Key prefix is stored at the beginning of node's memory (only in maps which
+// have a key prefix function).
+#define node_prefix_(map, node) \
+    (*((uint64_t*)(((char*)(node)) - (map)->node_offset)))
+
+#define is_btree_(map) (((map)->flags & ucs_map_flag_btree) != 0)
+#define is_concurrent_(map) ((map)->concurrent != NULL)
+
+// Map's allocator is shared with other maps (see ucs_map_config::allocator).
+#define has_shared_allocator_(map) \
+    ((map)->allocator != (ucs_allocator)((map)->allocator_storage.mem))
+
+// Evaluates the given expression which updates instrumentation counters (see
+// ucs_map_stats). Concurrent maps are not instrumented.
+#ifdef UCS_MAP_INSTRUMENTATION
+#define instrument_(map, expr) ((void)(is_concurrent_(map) || ((expr), true)))
+#else
+#define instrument_(map, expr) ((void)(0))
+#endif
+
+// In B-tree maps each element is stored in a separately allocated slot, which
+// starts with a pointer to the B-tree node which references the element.
+// Iterators of such maps point to the slots and are tagged with the lowest bit.
+#define is_btree_iterator_(i) ((((uintptr_t)(i)) & 1) != 0)
+#define iterator_slot_(i) (((char*)(i)) - 1)
+
+#define slot_node_(slot) (*((ucs_map_bnode**)(slot)))
+#define slot_mem_(slot) ((slot) + sizeof(ucs_map_bnode*))
+
+#define is_leaf_(bnode) ((bnode)->children[0] == NULL)
+
+#ifdef __GNUC__
+#define prefetch_(addr) __builtin_prefetch(addr)
+#else
+#define prefetch_(addr) ((void)(addr))
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 // Map data types.
 ////////////////////////////////////////////////////////////////////////////////
 
-typedef struct ucs_map_node {
-    char* mem;
-    struct ucs_map_node* parent;
-    struct ucs_map_node* children[2];
-    signed char balance;
-} ucs_map_node;
+enum { ucs_map_cache_line_size = 64 };
+
+enum {
+    // B-tree node's capacity: 15 items, 16 children. Non-root nodes contain at
+    // least 7 items.
+    ucs_map_bnode_max_size = 15,
+    ucs_map_bnode_min_size = ucs_map_bnode_max_size / 2,
+
+    // B-tree node's alignment: keys' prefixes occupy the first two cache lines
+    // of the node.
+    ucs_map_bnode_alignment = ucs_map_cache_line_size
+};
+
+typedef struct ucs_map_bnode {
+    alignas(ucs_map_bnode_alignment) uint64_t
+        prefixes[ucs_map_bnode_max_size];
+    unsigned n;
+
+    struct ucs_map_bnode* parent;
+    char* items[ucs_map_bnode_max_size];
+
+    // Leaf nodes have NULL as their first child.
+    struct ucs_map_bnode* children[ucs_map_bnode_max_size + 1];
+} ucs_map_bnode;
 
 struct ucs_map {
     ucs_allocator_object_storage allocator_storage;
     ucs_allocator allocator;
 
-    ucs_map_node* root;
-    size_t element_mem_offset;
+    ucs_map_node *root, *lower, *upper;
+    size_t size, node_offset, element_alignment, element_size;
+    unsigned flags;
 
     ucs_map_key_set_fn key_set_fn;
     ucs_map_key_get_fn key_get_fn;
     ucs_map_key_cmp_fn key_cmp_fn;
+    ucs_map_key_prefix_fn key_prefix_fn;
+
+    // B-tree maps only.
+    ucs_allocator_object_storage bnode_allocator_storage;
+    ucs_allocator bnode_allocator;
+    ucs_map_bnode* broot;
+
+    // Concurrent maps only.
+    struct ucs_map_concurrent_state* concurrent;
+
+    // Source of all map's memory.
+    ucs_allocator_upstream upstream;
+
+#ifdef UCS_MAP_INSTRUMENTATION
+    // Operation counters, and the number of nodes visited by the current
+    // descent.
+    ucs_map_statistics stats;
+    size_t depth;
+#endif
+};
+
+enum {
+    // Maximum height of an AVL tree is less than 1.45 * log2(n + 2), so this
+    // limit is never reached by a search in a consistent tree.
+    ucs_map_max_height = 128,
+
+    // Number of reader counters per epoch. Readers running on different
+    // threads use different counters (each in its own cache line) in order to
+    // avoid contention.
+    ucs_map_reader_stripe_count = 16,
+
+    // Writer tries to reclaim retired nodes each time this many nodes are
+    // retired in the current epoch.
+    ucs_map_reclaim_threshold = 128
 };
 
+// List of retired nodes which can not be freed until readers which could have
+// seen them finish.
+typedef struct ucs_map_limbo {
+    void** mem;
+    size_t size, capacity;
+} ucs_map_limbo;
+
+typedef struct ucs_map_reader_stripe {
+    alignas(ucs_map_cache_line_size) atomic_size_t count;
+} ucs_map_reader_stripe;
+
+typedef struct ucs_map_concurrent_state {
+    // Incremented before and after each modification, so it is odd while the
+    // map is being modified.
+    alignas(ucs_map_cache_line_size) atomic_size_t version;
+
+    // Readers register in one of two sets of counters, selected by the parity
+    // of the current epoch.
+    alignas(ucs_map_cache_line_size) atomic_size_t epoch;
+    ucs_map_reader_stripe readers[2][ucs_map_reader_stripe_count];
+
+    // Nodes retired in even and odd epochs (writer only).
+    ucs_map_limbo limbo[2];
+} ucs_map_concurrent_state;
+
+// Key which is being searched for, along with its prefix.
+typedef struct ucs_map_search_key {
+    ucs_map_key k;
+    uint64_t prefix;
+} ucs_map_search_key;
+
 static_assert(alignof(struct ucs_map) <= ucs_map_object_alignment, "");
 static_assert(sizeof(struct ucs_map) <= ucs_map_object_size, "");
 
+#ifdef UCS_MAP_COMPACT_NODES
+static_assert(alignof(ucs_map_node) > balance_mask_, "");
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // Utility functions.
 ////////////////////////////////////////////////////////////////////////////////
@@ -62,109 +251,362 @@ static_assert(sizeof(struct ucs_map) <= ucs_map_object_size, "");
 static ucs_map_node*
 ucs_map_node_alloc(ucs_map map) {
     char* mem = ucs_allocator_alloc(map->allocator);
+    ucs_map_node* node = NULL;
 
     if(mem != NULL) {
-        *((ucs_map_node*)(mem)) =
-            (ucs_map_node){.mem = (mem + map->element_mem_offset)};
+        node = (ucs_map_node*)(mem + map->node_offset);
+        *node = (ucs_map_node){.children = {NULL, NULL}};
+        set_balance_(node, 0);
+
+        if(has_counts_(map)) {
+            node_count_(node) = 1;
+        }
     }
 
-    return (ucs_map_node*)(mem);
+    return node;
 }
 
+static void
+ucs_map_retire(ucs_map map, void* mem);
+
 static void
 ucs_map_node_free(ucs_map map, ucs_map_node* node) {
-    ucs_allocator_free(map->allocator, node);
+    char* mem = ((char*)(node)) - map->node_offset;
+
+    if(is_concurrent_(map)) {
+        ucs_map_retire(map, mem);
+    } else {
+        ucs_allocator_free(map->allocator, mem);
+    }
+}
+
+// Concurrency. The map is modified by a single writer, and can be read by any
+// number of readers at the same time. Writer increments map's version before
+// and after each modification, readers retry their searches if the version
+// was odd or changed during the search (search loops are bounded, so that a
+// torn tree can not trap a reader). Removed nodes are retired instead of being
+// freed: writer frees them only when all readers which started before removal
+// have finished.
+
+static size_t
+ucs_map_reader_stripe_idx(void) {
+    // Threads have distinct addresses of thread-local objects.
+    static _Thread_local char marker;
+    uintptr_t x = (uintptr_t)(&marker) >> 4;
+
+    return (size_t)((x ^ (x >> 7) ^ (x >> 17)) % ucs_map_reader_stripe_count);
+}
+
+static bool
+ucs_map_readers_drained(ucs_map_concurrent_state* state, size_t parity) {
+    for(size_t i = 0; i != ucs_map_reader_stripe_count; ++i) {
+        if(atomic_load(&state->readers[parity][i].count) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+ucs_map_write_begin(ucs_map map) {
+    if(is_concurrent_(map)) {
+        atomic_store_explicit(
+            &map->concurrent->version,
+            atomic_load_explicit(&map->concurrent->version,
+                                 memory_order_relaxed) +
+                1,
+            memory_order_relaxed);
+
+        atomic_thread_fence(memory_order_release);
+    }
+}
+
+static void
+ucs_map_write_end(ucs_map map) {
+    if(is_concurrent_(map)) {
+        atomic_store_explicit(
+            &map->concurrent->version,
+            atomic_load_explicit(&map->concurrent->version,
+                                 memory_order_relaxed) +
+                1,
+            memory_order_release);
+    }
+}
+
+static void
+ucs_map_synchronize(ucs_map map) {
+    // Waits until all readers which are currently running finish, and frees all
+    // retired nodes.
+
+    for(int n = 0; n != 2;) {
+        n += (ucs_map_reclaim(map) ? 1 : 0);
+    }
+}
+
+static void
+ucs_map_retire(ucs_map map, void* mem) {
+    ucs_map_concurrent_state* state = map->concurrent;
+    ucs_map_limbo* limbo =
+        &state->limbo[atomic_load_explicit(&state->epoch, memory_order_relaxed) %
+                      2];
+
+    if(limbo->size == limbo->capacity) {
+        size_t capacity =
+            ((limbo->capacity != 0) ? (2 * limbo->capacity)
+                                    : (size_t)(ucs_map_reclaim_threshold));
+
+        void** limbo_mem = NULL;
+        if(capacity <= (SIZE_MAX / sizeof(void*))) {
+            limbo_mem = ucs_allocator_upstream_alloc(
+                map->upstream, capacity * sizeof(void*), alignof(void*));
+        }
+
+        if(limbo_mem == NULL) {
+            // Out of memory: wait for readers, then free the node directly.
+            ucs_map_synchronize(map);
+            ucs_allocator_free(map->allocator, mem);
+            return;
+        }
+
+        if(limbo->size != 0) {
+            memcpy(limbo_mem, limbo->mem, limbo->size * sizeof(void*));
+        }
+
+        ucs_allocator_upstream_free(
+            map->upstream, limbo->mem, limbo->capacity * sizeof(void*));
+
+        limbo->mem = limbo_mem;
+        limbo->capacity = capacity;
+    }
+
+    limbo->mem[limbo->size++] = mem;
+    if((limbo->size % ucs_map_reclaim_threshold) == 0) {
+        ucs_map_reclaim(map);
+    }
+}
+
+typedef ucs_map_node* (*ucs_map_search_fn)(ucs_map map,
+                                           ucs_map_search_key const* sk);
+
+static ucs_map_node*
+ucs_map_search(ucs_map map, ucs_map_search_fn fn,
+               ucs_map_search_key const* sk) {
+    // Runs the given search function. In concurrent maps retries the search
+    // until it runs without concurrent modifications.
+
+    if(!is_concurrent_(map)) {
+        return fn(map, sk);
+    }
+
+    ucs_map_concurrent_state* state = map->concurrent;
+
+    while(true) {
+        size_t version =
+            atomic_load_explicit(&state->version, memory_order_acquire);
+
+        if((version % 2) == 0) {
+            ucs_map_node* node = fn(map, sk);
+            atomic_thread_fence(memory_order_acquire);
+
+            if(atomic_load_explicit(&state->version, memory_order_relaxed) ==
+               version) {
+                return node;
+            }
+        }
+    }
+}
+
+// Key management.
+
+static ucs_map_search_key
+ucs_map_search_key_make(ucs_map map, ucs_map_key k) {
+    return (ucs_map_search_key){
+        .k = k, .prefix = (has_prefixes_(map) ? map->key_prefix_fn(k) : 0)};
+}
+
+static ucs_map_search_key
+ucs_map_node_search_key(ucs_map map, ucs_map_node* node) {
+    // Returns the key of the given node (which can belong to another map with
+    // the same configuration).
+
+    return (ucs_map_search_key){
+        .k = map->key_get_fn(node_mem_(node)),
+        .prefix = (has_prefixes_(map) ? node_prefix_(map, node) : 0)};
+}
+
+static void
+ucs_map_node_set_key(ucs_map map, ucs_map_node* node,
+                     ucs_map_search_key const* sk) {
+    map->key_set_fn(sk->k, node_mem_(node));
+
+    if(has_prefixes_(map)) {
+        node_prefix_(map, node) = sk->prefix;
+    }
+}
+
+static int
+ucs_map_key_cmp(ucs_map map, ucs_map_search_key const* sk,
+                ucs_map_node* node) {
+    // Compares cached prefixes first, the key comparison function is called
+    // only if they are equal.
+
+    instrument_(map, map->depth++);
+
+    if(has_prefixes_(map)) {
+        uint64_t prefix = node_prefix_(map, node);
+
+        if(sk->prefix != prefix) {
+            return ((sk->prefix < prefix) ? -1 : +1);
+        }
+    }
+
+    instrument_(map, map->stats.comparison_count++);
+    return map->key_cmp_fn(sk->k, map->key_get_fn(node_mem_(node)));
+}
+
+// Instrumentation.
+
+#ifdef UCS_MAP_INSTRUMENTATION
+
+static void
+ucs_map_record_descent(ucs_map map, ucs_map_descent_statistics* descent) {
+    size_t const n = ucs_map_depth_histogram_size - 1;
+
+    descent->count++;
+    descent->depth += map->depth;
+    map->stats.depth_histogram[(map->depth < n) ? map->depth : n]++;
+}
+
+#endif
+
+// Order statistics.
+
+static void
+ucs_map_node_count_add(ucs_map map, ucs_map_node* node, ptrdiff_t delta) {
+    // Adds {delta} to the subtree sizes of the given node and all its
+    // ancestors.
+
+    if(has_counts_(map)) {
+        for(; node != NULL; node = parent_(node)) {
+            node_count_(node) += (size_t)(delta);
+        }
+    }
 }
 
 // Node linking (parent to child).
 
+static inline ptrdiff_t
+ucs_map_node_child_idx(ucs_map_node* node, ucs_map_node* parent) {
+    // Returns the index of the given node in its parent (which is loaded by
+    // the caller, so that the link is loaded once).
+
+    return (((parent == NULL) || (child_(parent, 0) == node)) ? 0 : 1);
+}
+
 static void
 ucs_map_node_link(ucs_map_node* parent, ucs_map_node* child,
                   ptrdiff_t child_i) {
     if(child != NULL) {
-        child->parent = parent;
+        set_parent_(child, parent);
     }
 
     if(parent != NULL) {
-        parent->children[child_i] = child;
+        set_link_(parent->children[child_i], child);
     }
 }
 
 // Node rotation.
 
 static ucs_map_node*
-ucs_map_node_rotate(ucs_map_node* x) {
+ucs_map_node_rotate(ucs_map map, ucs_map_node* x) {
     // Precondition: (x != NULL) && (x->balance != 0).
 
-    ptrdiff_t const a_i = ((x->balance < 0) ? 0 : 1), b_i = ((a_i + 1) % 2),
-                    c_i = child_idx_(x);
+    ucs_map_node* parent = parent_(x);
+    ptrdiff_t const a_i = ((balance_(x) < 0) ? 0 : 1), b_i = ((a_i + 1) % 2),
+                    c_i = ucs_map_node_child_idx(x, parent);
 
     ucs_map_node* y = x->children[a_i];
     ucs_map_node* z = y->children[b_i];
 
-    ucs_map_node_link(x->parent, y, c_i);
+    instrument_(map, map->stats.rotation_count++);
+
+    ucs_map_node_link(parent, y, c_i);
     ucs_map_node_link(x, z, a_i);
     ucs_map_node_link(y, x, b_i);
 
+    if(has_counts_(map)) {
+        node_count_(y) = node_count_(x);
+        node_count_(x) = count_(x->children[0]) + count_(x->children[1]) + 1;
+    }
+
     return y;
 }
 
 // Node rebalancing.
 
 static ucs_map_node*
-ucs_map_node_rebalance(ucs_map_node* x) {
+ucs_map_node_rebalance(ucs_map map, ucs_map_node* x) {
     // Precondition: (x != NULL) && (|x->balance| > 1).
 
-    ucs_map_node* y = x->children[(x->balance < 0) ? 0 : 1];
-    bool need_double_rotation = ((x->balance < 0) && (y->balance > 0)) ||
-                                ((x->balance > 0) && (y->balance < 0));
+    int const x_balance = balance_(x);
+
+    ucs_map_node* y = x->children[(x_balance < 0) ? 0 : 1];
+    int const y_balance = balance_(y);
+
+    bool need_double_rotation = ((x_balance < 0) && (y_balance > 0)) ||
+                                ((x_balance > 0) && (y_balance < 0));
 
     if(need_double_rotation) {
-        ucs_map_node* z = ucs_map_node_rotate(y);
-        ucs_map_node_rotate(x);
+        ucs_map_node* z = ucs_map_node_rotate(map, y);
+        ucs_map_node_rotate(map, x);
 
-        switch(z->balance) {
+        switch(balance_(z)) {
             case 0:
-                x->balance = y->balance = 0;
+                set_balance_(x, 0);
+                set_balance_(y, 0);
                 break;
 
             case -1:
-                if(x->balance < 0) {
-                    y->balance = z->balance = 0;
-                    x->balance = +1;
+                set_balance_(z, 0);
+                if(x_balance < 0) {
+                    set_balance_(y, 0);
+                    set_balance_(x, +1);
                 } else {
-                    x->balance = z->balance = 0;
-                    y->balance = +1;
+                    set_balance_(x, 0);
+                    set_balance_(y, +1);
                 }
                 break;
 
             case +1:
-                if(x->balance < 0) {
-                    x->balance = z->balance = 0;
-                    y->balance = -1;
+                set_balance_(z, 0);
+                if(x_balance < 0) {
+                    set_balance_(x, 0);
+                    set_balance_(y, -1);
                 } else {
-                    y->balance = z->balance = 0;
-                    x->balance = -1;
+                    set_balance_(y, 0);
+                    set_balance_(x, -1);
                 }
                 break;
         }
 
         return z;
     } else {
-        switch(ucs_map_node_rotate(x)->balance) {
+        switch(balance_(ucs_map_node_rotate(map, x))) {
             case -1:
                 // fall-through
             case +1:
-                x->balance = y->balance = 0;
+                set_balance_(x, 0);
+                set_balance_(y, 0);
                 break;
 
             case 0:
-                if(x->balance < 0) {
-                    x->balance = -1;
-                    y->balance = +1;
+                if(x_balance < 0) {
+                    set_balance_(x, -1);
+                    set_balance_(y, +1);
                 } else {
-                    x->balance = +1;
-                    y->balance = -1;
+                    set_balance_(x, +1);
+                    set_balance_(y, -1);
                 }
                 break;
         }
@@ -180,370 +622,3696 @@ typedef enum {
     ucs_map_rebalance_remove
 } ucs_map_rebalance_type;
 
-static void
+static bool
 ucs_map_rebalance(ucs_map map, ucs_map_node* node, ptrdiff_t child_i,
                   ucs_map_rebalance_type type) {
+    // Restores the balance after the height of the given child of the given
+    // node has changed. Returns true if the height of the whole tree changed.
+
     ucs_map_node* moved_node = NULL;
 
     while(node != NULL) {
+        int balance = balance_(node);
+        instrument_(map, map->stats.rebalance_step_count++);
+
         if(type == ucs_map_rebalance_insert) {
-            node->balance += ((child_i == 0) ? -1 : +1);
-            if(node->balance == 0) {
+            set_balance_(node, balance += ((child_i == 0) ? -1 : +1));
+            if(balance == 0) {
                 break;
             }
         } else {
-            node->balance += ((child_i == 0) ? +1 : -1);
-            if((node->balance == -1) || (node->balance == +1)) {
+            set_balance_(node, balance += ((child_i == 0) ? +1 : -1));
+            if((balance == -1) || (balance == +1)) {
                 break;
             }
         }
 
-        if((node->balance > 1) || (node->balance < -1)) {
-            node = ucs_map_node_rebalance(moved_node = node);
+        if((balance > 1) || (balance < -1)) {
+            node = ucs_map_node_rebalance(map, moved_node = node);
 
             if(type == ucs_map_rebalance_insert) {
                 break;
             } else {
-                if(node->balance != 0) {
+                if(balance_(node) != 0) {
                     break;
                 }
             }
         }
 
-        child_i = child_idx_(node);
-        node = node->parent;
+        ucs_map_node* parent = parent_(node);
+        child_i = ucs_map_node_child_idx(node, parent);
+        node = parent;
     }
 
-    if(map->root == moved_node) {
-        map->root = map->root->parent;
+    if((moved_node != NULL) && (map->root == moved_node)) {
+        set_link_(map->root, parent_(moved_node));
     }
+
+    return (node == NULL);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Map creation/destruction interface implementation.
-////////////////////////////////////////////////////////////////////////////////
+// Map bounds.
 
-ucs_map
-ucs_map_create_in_place(ucs_map_config cfg, char* mem) {
-    if(cfg.element_size == 0) {
-        return NULL;
-    }
+static void
+ucs_map_bounds_reset(ucs_map map) {
+    // Recomputes the first and the last nodes of the map.
 
-#define max_(x, y) (((x) > (y)) ? (x) : (y))
-#define is_pot_(x) (((x) & ((x)-1)) == 0)
+    ucs_map_node *lower = map->root, *upper = map->root;
 
-    size_t alignment = max_(cfg.element_alignment, alignof(ucs_map_node));
-    if(!is_pot_(alignment)) {
-        return NULL;
+    if(map->root != NULL) {
+        for(; lower->children[0] != NULL; lower = lower->children[0]) {
+        }
+
+        for(; upper->children[1] != NULL; upper = upper->children[1]) {
+        }
     }
 
-#undef is_pot_
-#undef max_
+    set_link_(map->lower, lower);
+    set_link_(map->upper, upper);
+}
 
-#define pad_(size, aignment)                                        \
-    if(true) {                                                      \
-        size_t d = (size) % (alignment);                            \
-        if((d != 0) && (((size) += (alignment)-d) < (alignment))) { \
-            return NULL;                                            \
-        }                                                           \
-    }
+// Key search.
 
-#define add_(x, y)           \
-    if(((x) += (y)) < (y)) { \
-        return NULL;         \
-    }
+static ucs_map_node*
+ucs_map_node_locate(ucs_map map, ucs_map_node* node,
+                    ucs_map_search_key const* sk, int* cmp) {
+    // Descends from the given node (which must not be NULL) towards the given
+    // key. Returns the node which contains the key ({*cmp} is set to zero), or
+    // the node to which a new node with the given key would be linked ({*cmp}
+    // is set to the result of the last comparison).
 
-    size_t allocation_size = sizeof(ucs_map_node);
-    pad_(allocation_size, alignment);
+    while(true) {
+        if((*cmp = key_cmp_(sk, node)) == 0) {
+            break;
+        }
 
-    size_t element_mem_offset = allocation_size;
+        ucs_map_node* next = node->children[(*cmp > 0) ? 1 : 0];
+        if(next == NULL) {
+            break;
+        }
 
-    add_(allocation_size, cfg.element_size);
-    pad_(allocation_size, alignment);
+        node = next;
+    }
 
-#undef add_
-#undef pad_
+    return node;
+}
 
-    ucs_map m = (ucs_map)(mem);
-    if(m != NULL) {
-        *m = (struct ucs_map){.element_mem_offset = element_mem_offset,
-                              .key_set_fn = cfg.key_set_fn,
-                              .key_get_fn = cfg.key_get_fn,
-                              .key_cmp_fn = cfg.key_cmp_fn};
+static ucs_map_node*
+ucs_map_node_locate_from(ucs_map map, ucs_map_node* finger,
+                         ucs_map_search_key const* sk, int* cmp) {
+    // Same as ucs_map_node_locate, but starts the search from an arbitrary node
+    // (finger). Climbs up only until the key is known to belong to the subtree
+    // of the current node, so the search takes O(log d) steps, where d is the
+    // distance between the finger and the key in the sorted sequence.
+
+    if((*cmp = key_cmp_(sk, finger)) == 0) {
+        return finger;
+    }
 
-        ucs_allocator_config alloc_cfg = {.block_size = 128,
-                                          .element_alignment = alignment,
-                                          .element_size = allocation_size};
+    ptrdiff_t const dir = ((*cmp > 0) ? 1 : 0);
+    ucs_map_node* node = finger;
 
-        m->allocator =
-            ucs_allocator_create_in_place(alloc_cfg, m->allocator_storage.mem);
+    for(ucs_map_node* parent = parent_(node); parent != NULL;
+        node = parent, parent = parent_(node)) {
+        if(ucs_map_node_child_idx(node, parent) != dir) {
+            // Parent bounds the subtree of the current node in the direction
+            // of the search.
+            int c = key_cmp_(sk, parent);
 
-        if(m->allocator == NULL) {
-            m = NULL;
+            if(c == 0) {
+                *cmp = 0;
+                return parent;
+            }
+
+            if((c > 0) != (dir == 1)) {
+                break;
+            }
         }
     }
 
-    return m;
+    return ucs_map_node_locate(map, node, sk, cmp);
 }
 
-ucs_map
-ucs_map_create(ucs_map_config cfg) {
-    char* mem = aligned_alloc(ucs_map_object_alignment, ucs_map_object_size);
+// Node insertion.
 
-    if(ucs_map_create_in_place(cfg, mem) == NULL) {
-        free(mem);
-        mem = NULL;
+static ucs_map_node*
+ucs_map_node_insert(ucs_map map, ucs_map_node* parent, ptrdiff_t child_i,
+                    ucs_map_search_key const* sk) {
+    // Inserts a new node with the given key as a child of the given parent,
+    // or as a root if the parent is NULL.
+    // Precondition: (parent == NULL) || (parent->children[child_i] == NULL).
+
+    ucs_map_node* node = ucs_map_node_alloc(map);
+    if(node == NULL) {
+        return NULL;
     }
 
-    return (ucs_map)(mem);
-}
+    ucs_map_node_set_key(map, node, sk);
+    ucs_map_write_begin(map);
 
-void
-ucs_map_destroy_in_place(ucs_map map) {
-    if(map == NULL) {
-        return;
-    }
+    if(parent == NULL) {
+        set_link_(map->root, node);
+        set_link_(map->lower, node);
+        set_link_(map->upper, node);
+    } else {
+        if((parent == map->lower) && (child_i == 0)) {
+            set_link_(map->lower, node);
+        }
 
-    ucs_allocator_destroy_in_place(map->allocator);
-}
+        if((parent == map->upper) && (child_i == 1)) {
+            set_link_(map->upper, node);
+        }
 
-void
-ucs_map_destroy(ucs_map map) {
-    ucs_map_destroy_in_place(map);
-    free(map);
-}
+        ucs_map_node_link(parent, node, child_i);
+        ucs_map_node_count_add(map, parent, +1);
+        ucs_map_rebalance(map, parent, child_i, ucs_map_rebalance_insert);
+    }
 
-////////////////////////////////////////////////////////////////////////////////
-// Map update interface implementation.
-////////////////////////////////////////////////////////////////////////////////
+    map->size++;
 
-void
-ucs_map_clear(ucs_map map) {
-    ucs_allocator_free_all(map->allocator);
-    map->root = NULL;
+    ucs_map_write_end(map);
+    return node;
 }
 
-ucs_map_iterator
-ucs_map_insert(ucs_map map, ucs_map_key k) {
-    if(map->root == NULL) {
-        map->root = ucs_map_node_alloc(map);
+// Tree flattening.
 
-        if(map->root != NULL) {
-            map->key_set_fn(k, map->root->mem);
-            return map->root;
-        }
-    } else {
-        // Find the closest node.
-        ucs_map_node* node = map->root;
-        ptrdiff_t child_i = 0;
+static ucs_map_node*
+ucs_map_tree_to_vine(ucs_map_node* root) {
+    // Converts the given tree to a sorted list of nodes (vine) linked through
+    // {children[1]} using right rotations. Returns the head of the list. Other
+    // node links are left in unspecified state.
 
-        while(true) {
-            if(key_eq_(k, node)) {
-                return node;
-            }
+    ucs_map_node *head = NULL, *tail = NULL;
 
-            child_i = key_gt_(k, node);
-            if(node->children[child_i] == NULL) {
-                break;
+    while(root != NULL) {
+        ucs_map_node* left = root->children[0];
+
+        if(left != NULL) {
+            root->children[0] = left->children[1];
+            left->children[1] = root;
+            root = left;
+        } else {
+            if(tail == NULL) {
+                head = root;
+            } else {
+                tail->children[1] = root;
             }
 
-            node = node->children[child_i];
+            tail = root;
+            root = root->children[1];
         }
+    }
 
-        // Insert new node.
-        ucs_map_node* inserted_node = ucs_map_node_alloc(map);
-        if(inserted_node != NULL) {
-            map->key_set_fn(k, inserted_node->mem);
+    return head;
+}
+
+static size_t
+ucs_map_tree_free(ucs_map map, ucs_map_node* root) {
+    // Returns the nodes of the given tree to map's allocator. Returns the
+    // number of freed nodes.
+
+    size_t n = 0;
+    for(ucs_map_node* node = ucs_map_tree_to_vine(root); node != NULL; ++n) {
+        ucs_map_node* next = node->children[1];
+        ucs_allocator_free(map->allocator, ((char*)(node)) - map->node_offset);
+        node = next;
+    }
+
+    return n;
+}
+
+// Tree construction.
+
+typedef ucs_map_node* (*ucs_map_node_source_fn)(ucs_map map, void* context);
+
+static int
+ucs_map_perfect_tree_height(size_t n) {
+    int height = 0;
+    for(; n != 0; n /= 2) {
+        ++height;
+    }
+
+    return height;
+}
+
+static bool
+ucs_map_build(ucs_map map, size_t n, ucs_map_node_source_fn source,
+              void* context, ucs_map_node** root) {
+    // Builds perfectly balanced tree from {n} nodes obtained from the given
+    // source. Nodes are obtained in in-order sequence. No key comparisons are
+    // made. If the source fails, then the nodes obtained so far are freed.
+
+    *root = NULL;
+    if(n == 0) {
+        return true;
+    }
+
+    size_t n_left = (n - 1) / 2, n_right = n - 1 - n_left;
+    ucs_map_node *left = NULL, *right = NULL, *node = NULL;
+
+    if(!ucs_map_build(map, n_left, source, context, &left)) {
+        return false;
+    }
+
+    if((node = source(map, context)) == NULL) {
+        ucs_map_tree_free(map, left);
+        return false;
+    }
+
+    bool const result = ucs_map_build(map, n_right, source, context, &right);
+
+    set_parent_(node, NULL);
+    set_balance_(node, ucs_map_perfect_tree_height(n_right) -
+                           ucs_map_perfect_tree_height(n_left));
+
+    ucs_map_node_link(node, left, 0);
+    ucs_map_node_link(node, right, 1);
+
+    if(!result) {
+        ucs_map_tree_free(map, node);
+        return false;
+    }
+
+    if(has_counts_(map)) {
+        node_count_(node) = n;
+    }
+
+    *root = node;
+    return true;
+}
+
+static bool
+ucs_map_build_content(ucs_map map, size_t n, ucs_map_node_source_fn source,
+                      void* context) {
+    // Replaces the content of an empty map with a tree built from the given
+    // source. The tree is built off to the side, and is published at once.
+    // Returns false (leaving the map empty) if memory allocation fails.
+
+    ucs_map_node* root = NULL;
+
+    if(!ucs_map_build(map, n, source, context, &root)) {
+        ucs_map_clear(map);
+        return false;
+    }
+
+    ucs_map_write_begin(map);
+
+    set_link_(map->root, root);
+    map->size = n;
+    ucs_map_bounds_reset(map);
+
+    ucs_map_write_end(map);
+    return true;
+}
+
+typedef struct ucs_map_key_source {
+    ucs_map_key_next_fn next_fn;
+    void* context;
+} ucs_map_key_source;
+
+static ucs_map_node*
+ucs_map_node_source_keys(ucs_map map, void* context) {
+    ucs_map_key_source* source = context;
+    ucs_map_node* node = ucs_map_node_alloc(map);
+
+    if(node != NULL) {
+        ucs_map_search_key sk =
+            ucs_map_search_key_make(map, source->next_fn(source->context));
+
+        ucs_map_node_set_key(map, node, &sk);
+    }
+
+    return node;
+}
+
+typedef struct ucs_map_key_array {
+    char const* next;
+    size_t stride;
+} ucs_map_key_array;
+
+static ucs_map_key
+ucs_map_key_array_next(void* context) {
+    ucs_map_key_array* array = context;
+    ucs_map_key k = array->next;
+
+    array->next += array->stride;
+    return k;
+}
+
+static ucs_map_node*
+ucs_map_node_source_vine(ucs_map map, void* context) {
+    (void)(map);
+
+    ucs_map_node** vine = context;
+    ucs_map_node* node = *vine;
+
+    *vine = node->children[1];
+    return node;
+}
+
+// Batch application.
+
+typedef struct ucs_map_vine_builder {
+    ucs_map_node *head, *tail;
+    size_t size;
+} ucs_map_vine_builder;
+
+static void
+ucs_map_vine_append(ucs_map_vine_builder* vine, ucs_map_node* node) {
+    if(vine->tail == NULL) {
+        vine->head = node;
+    } else {
+        vine->tail->children[1] = node;
+    }
+
+    vine->tail = node;
+    vine->size++;
+}
+
+static bool
+ucs_map_apply_batch_merge(ucs_map map, ucs_map_batch_op* ops, size_t n) {
+    // Merges the batch with the sorted sequence of map's nodes and rebuilds
+    // the tree from the result. No rebalancing is done for individual
+    // operations.
+
+    ucs_map_node* vine = ucs_map_tree_to_vine(map->root);
+    ucs_map_vine_builder merged = {.head = NULL};
+
+    // The node with the greatest key processed so far. It is appended to the
+    // merged sequence once all operations with its key are applied.
+    ucs_map_node* pending = NULL;
+    bool result = true;
+
+    for(ucs_map_batch_op* op = ops; op != (ops + n); ++op) {
+        ucs_map_search_key sk = ucs_map_search_key_make(map, op->k);
+
+        if((pending == NULL) || (key_cmp_(&sk, pending) != 0)) {
+            if(pending != NULL) {
+                ucs_map_vine_append(&merged, pending);
+                pending = NULL;
+            }
+
+            while(vine != NULL) {
+                int cmp = key_cmp_(&sk, vine);
+
+                if(cmp < 0) {
+                    break;
+                }
+
+                ucs_map_node* node = vine;
+                vine = vine->children[1];
+
+                if(cmp == 0) {
+                    pending = node;
+                    break;
+                }
+
+                ucs_map_vine_append(&merged, node);
+            }
+        }
+
+        if(op->type == ucs_map_batch_insert) {
+            if(pending == NULL) {
+                if((pending = ucs_map_node_alloc(map)) != NULL) {
+                    ucs_map_node_set_key(map, pending, &sk);
+                } else {
+                    result = false;
+                }
+            }
+
+            op->i = pending;
+        } else {
+            if(pending != NULL) {
+                ucs_map_node_free(map, pending);
+                pending = NULL;
+            }
+
+            op->i = NULL;
+        }
+    }
+
+    if(pending != NULL) {
+        ucs_map_vine_append(&merged, pending);
+    }
+
+    for(; vine != NULL; vine = vine->children[1]) {
+        ucs_map_vine_append(&merged, vine);
+    }
+
+    if(merged.tail != NULL) {
+        merged.tail->children[1] = NULL;
+    }
+
+    ucs_map_build(map, merged.size, ucs_map_node_source_vine, &merged.head,
+                  &map->root);
+
+    map->size = merged.size;
+    ucs_map_bounds_reset(map);
+    return result;
+}
+
+static bool
+ucs_map_apply_batch_incremental(ucs_map map, ucs_map_batch_op* ops,
+                                size_t n) {
+    // Applies operations one by one, starting each search from the node
+    // touched by the previous operation.
+
+    ucs_map_node* finger = NULL;
+    bool result = true;
+
+    for(ucs_map_batch_op* op = ops; op != (ops + n); ++op) {
+        ucs_map_search_key sk = ucs_map_search_key_make(map, op->k);
+        op->i = NULL;
+
+        if(finger == NULL) {
+            finger = map->root;
+        }
+
+        int cmp = 0;
+        ucs_map_node* node = NULL;
+
+        if(finger != NULL) {
+            node = ucs_map_node_locate_from(map, finger, &sk, &cmp);
+        }
+
+        if(op->type == ucs_map_batch_insert) {
+            if((node == NULL) || (cmp != 0)) {
+                node =
+                    ucs_map_node_insert(map, node, ((cmp > 0) ? 1 : 0), &sk);
+            }
+
+            if((op->i = finger = node) == NULL) {
+                result = false;
+            }
+        } else {
+            if((node != NULL) && (cmp == 0)) {
+                finger = ucs_map_iterator_next(node);
+                if(finger == NULL) {
+                    finger = ucs_map_iterator_prev(node);
+                }
+
+                ucs_map_remove_by_iterator(map, node);
+            } else {
+                finger = node;
+            }
+        }
+    }
+
+    return result;
+}
+
+// Tree joining and splitting. Subtrees are detached from their parents, and
+// carry their heights (heights of their children are derived from balance
+// factors).
+
+typedef struct ucs_map_subtree {
+    ucs_map_node* root;
+    int height;
+} ucs_map_subtree;
+
+static int
+ucs_map_tree_height(ucs_map_node* node) {
+    // Follows the taller child of each node.
+
+    int height = 0;
+    for(; node != NULL; ++height) {
+        node = node->children[(balance_(node) > 0) ? 1 : 0];
+    }
+
+    return height;
+}
+
+static ucs_map_subtree
+ucs_map_subtree_child(ucs_map_subtree t, ptrdiff_t child_i) {
+    // Returns the given child of subtree's root. The child is not detached.
+    // Precondition: t.root != NULL.
+
+    int const balance = balance_(t.root);
+    bool const is_lower = ((child_i == 0) ? (balance > 0) : (balance < 0));
+
+    return (ucs_map_subtree){.root = t.root->children[child_i],
+                             .height = t.height - (is_lower ? 2 : 1)};
+}
+
+static ucs_map_subtree
+ucs_map_subtree_detach(ucs_map_subtree t) {
+    if(t.root != NULL) {
+        set_parent_(t.root, NULL);
+    }
+
+    return t;
+}
+
+static ucs_map_subtree
+ucs_map_tree_join(ucs_map map, ucs_map_subtree l, ucs_map_node* node,
+                  ucs_map_subtree r) {
+    // Joins the given subtrees using the given node as a separator. Runs in
+    // O(|l.height - r.height| + 1).
+    // Precondition: keys of {l} < key of {node} < keys of {r}.
+
+    ptrdiff_t const dir = ((l.height > r.height) ? 1 : 0);
+    ucs_map_subtree tall = ((dir == 1) ? l : r), low = ((dir == 1) ? r : l);
+
+    // Descend along the side of the taller subtree which faces the lower one,
+    // until a subtree which is at most one level taller than the lower one is
+    // found. The separator replaces it, and takes it as a child.
+    ucs_map_node *parent = NULL, *c = tall.root;
+    int height = tall.height;
+
+    while(height > (low.height + 1)) {
+        int const balance = balance_(c);
+        height -= (((dir == 1) ? (balance < 0) : (balance > 0)) ? 2 : 1);
+
+        parent = c;
+        c = c->children[dir];
+    }
+
+    ucs_map_node_link(node, c, 1 - dir);
+    ucs_map_node_link(node, low.root, dir);
+    set_balance_(node, ((dir == 1) ? (low.height - height)
+                                   : (height - low.height)));
+
+    if(has_counts_(map)) {
+        node_count_(node) = count_(c) + count_(low.root) + 1;
+    }
+
+    if(parent == NULL) {
+        set_parent_(node, NULL);
+        return (ucs_map_subtree){
+            .root = node,
+            .height = ((height > low.height) ? height : low.height) + 1};
+    }
+
+    // The subtree became one level taller.
+    ucs_map_node_link(parent, node, dir);
+    ucs_map_node_count_add(map, parent, (ptrdiff_t)(count_(node) - count_(c)));
+
+    if(ucs_map_rebalance(map, parent, dir, ucs_map_rebalance_insert)) {
+        tall.height++;
+    }
+
+    // The root could have been rotated down by one level.
+    if(parent_(tall.root) != NULL) {
+        tall.root = parent_(tall.root);
+    }
+
+    return tall;
+}
+
+static ucs_map_node*
+ucs_map_tree_split(ucs_map map, ucs_map_subtree t,
+                   ucs_map_search_key const* sk, ucs_map_subtree* l,
+                   ucs_map_subtree* r) {
+    // Splits the given subtree into subtrees with keys less than and greater
+    // than the given key. Returns the node with the given key (its links are
+    // left in unspecified state), or NULL if there is no such node. Runs in
+    // O(log n).
+
+    if(t.root == NULL) {
+        *l = *r = t;
+        return NULL;
+    }
+
+    ucs_map_subtree a = ucs_map_subtree_detach(ucs_map_subtree_child(t, 0));
+    ucs_map_subtree b = ucs_map_subtree_detach(ucs_map_subtree_child(t, 1));
+    ucs_map_subtree x = {.root = NULL};
+    ucs_map_node* node = NULL;
+
+    int const cmp = key_cmp_(sk, t.root);
+
+    if(cmp == 0) {
+        *l = a;
+        *r = b;
+        node = t.root;
+    } else if(cmp < 0) {
+        node = ucs_map_tree_split(map, a, sk, l, &x);
+        *r = ucs_map_tree_join(map, x, t.root, b);
+    } else {
+        node = ucs_map_tree_split(map, b, sk, &x, r);
+        *l = ucs_map_tree_join(map, a, t.root, x);
+    }
+
+    return node;
+}
+
+static ucs_map_subtree
+ucs_map_tree_split_last(ucs_map map, ucs_map_subtree t, ucs_map_node** last) {
+    // Detaches the node with the greatest key from the given subtree.
+    // Precondition: t.root != NULL.
+
+    ucs_map_subtree a = ucs_map_subtree_detach(ucs_map_subtree_child(t, 0));
+    ucs_map_subtree b = ucs_map_subtree_detach(ucs_map_subtree_child(t, 1));
+
+    if(b.root == NULL) {
+        *last = t.root;
+        return a;
+    }
+
+    return ucs_map_tree_join(
+        map, a, t.root, ucs_map_tree_split_last(map, b, last));
+}
+
+static ucs_map_subtree
+ucs_map_tree_join2(ucs_map map, ucs_map_subtree l, ucs_map_subtree r) {
+    // Same as ucs_map_tree_join, but without a separator.
+
+    if(l.root == NULL) {
+        return r;
+    }
+
+    if(r.root == NULL) {
+        return l;
+    }
+
+    ucs_map_node* last = NULL;
+    l = ucs_map_tree_split_last(map, l, &last);
+
+    return ucs_map_tree_join(map, l, last, r);
+}
+
+// Batch application by splitting and joining.
+
+static ucs_map_subtree
+ucs_map_apply_batch_tree(ucs_map map, ucs_map_subtree t, ucs_map_batch_op* ops,
+                         size_t n, ptrdiff_t* size_delta, bool* result) {
+    // Splits the given subtree at the key of the middle operations (all
+    // operations with that key are applied to the node which was split off),
+    // applies the rest of the operations to the parts recursively, and joins
+    // the parts back. Runs in O(n log(m/n + 1)), where m is the size of the
+    // subtree, and rebalances only at the joins.
+
+    if(n == 0) {
+        return t;
+    }
+
+    size_t i = n / 2, j = i + 1;
+    while((i != 0) && (map->key_cmp_fn(ops[i - 1].k, ops[i].k) == 0)) {
+        --i;
+    }
+
+    while((j != n) && (map->key_cmp_fn(ops[j].k, ops[i].k) == 0)) {
+        ++j;
+    }
+
+    ucs_map_search_key sk = ucs_map_search_key_make(map, ops[i].k);
+    ucs_map_subtree l, r;
+    ucs_map_node* node = ucs_map_tree_split(map, t, &sk, &l, &r);
+
+    for(ucs_map_batch_op* op = ops + i; op != (ops + j); ++op) {
+        if(op->type == ucs_map_batch_insert) {
+            if(node == NULL) {
+                if((node = ucs_map_node_alloc(map)) != NULL) {
+                    ucs_map_node_set_key(map, node, &sk);
+                    ++(*size_delta);
+                } else {
+                    *result = false;
+                }
+            }
+
+            op->i = node;
+        } else {
+            if(node != NULL) {
+                ucs_map_node_free(map, node);
+                node = NULL;
+                --(*size_delta);
+            }
+
+            op->i = NULL;
+        }
+    }
+
+    l = ucs_map_apply_batch_tree(map, l, ops, i, size_delta, result);
+    r = ucs_map_apply_batch_tree(map, r, ops + j, n - j, size_delta, result);
+
+    return ((node != NULL) ? ucs_map_tree_join(map, l, node, r)
+                           : ucs_map_tree_join2(map, l, r));
+}
+
+static bool
+ucs_map_apply_batch_split(ucs_map map, ucs_map_batch_op* ops, size_t n) {
+    ucs_map_subtree t = {.root = map->root,
+                         .height = ucs_map_tree_height(map->root)};
+
+    ptrdiff_t size_delta = 0;
+    bool result = true;
+
+    // The tree is detached, so that rebalancing never changes map's root.
+    map->root = NULL;
+    t = ucs_map_apply_batch_tree(map, t, ops, n, &size_delta, &result);
+
+    map->root = t.root;
+    map->size = (size_t)((ptrdiff_t)(map->size) + size_delta);
+    ucs_map_bounds_reset(map);
+
+    return result;
+}
+
+// Set operations. Map's tree is split at the keys of the other map's tree, the
+// parts are processed recursively (possibly by different threads), and joined
+// back. Nodes which leave the map are collected, and are freed at the end.
+
+typedef enum {
+    ucs_map_set_union,
+    ucs_map_set_intersection,
+    ucs_map_set_difference
+} ucs_map_set_op_type;
+
+enum {
+    // Minimal height of other map's subtree which is worth a separate thread.
+    ucs_map_set_task_min_height = 10
+};
+
+typedef struct ucs_map_set_task {
+    ucs_map map;
+    ucs_map_set_op_type type;
+    size_t thread_count;
+
+    // Subtrees of the map and of the other map. In unions the other map's
+    // subtree is consumed, otherwise it is not modified.
+    ucs_map_subtree a, b;
+    ucs_map_subtree result;
+
+    // Trees which must be freed, linked through their roots' parents.
+    ucs_map_node *garbage_head, *garbage_tail;
+} ucs_map_set_task;
+
+static void
+ucs_map_set_task_collect(ucs_map_set_task* task, ucs_map_node* head,
+                         ucs_map_node* tail) {
+    // Appends the given list of trees to task's garbage.
+
+    if(head == NULL) {
+        return;
+    }
+
+    if(task->garbage_tail == NULL) {
+        task->garbage_head = head;
+    } else {
+        set_parent_(task->garbage_tail, head);
+    }
+
+    task->garbage_tail = tail;
+}
+
+static void
+ucs_map_set_task_discard(ucs_map_set_task* task, ucs_map_node* root) {
+    if(root != NULL) {
+        set_parent_(root, NULL);
+        ucs_map_set_task_collect(task, root, root);
+    }
+}
+
+static void
+ucs_map_set_task_discard_node(ucs_map_set_task* task, ucs_map_node* node) {
+    node->children[0] = node->children[1] = NULL;
+    ucs_map_set_task_discard(task, node);
+}
+
+static void
+ucs_map_set_task_run(ucs_map_set_task* task);
+
+#ifndef __STDC_NO_THREADS__
+
+static int
+ucs_map_set_task_thread_fn(void* arg) {
+    ucs_map_set_task_run(arg);
+    return 0;
+}
+
+#endif
+
+static void
+ucs_map_set_task_run_parts(ucs_map_set_task* task, ucs_map_set_task* x,
+                           ucs_map_set_task* y) {
+    // Runs the given parts of the task, the first one in a new thread if that
+    // is worth it.
+
+#ifndef __STDC_NO_THREADS__
+    thrd_t thread;
+
+    if((task->thread_count > 1) &&
+       (x->b.height >= ucs_map_set_task_min_height) &&
+       (thrd_create(&thread, ucs_map_set_task_thread_fn, x) == thrd_success)) {
+        ucs_map_set_task_run(y);
+        thrd_join(thread, NULL);
+        return;
+    }
+#endif
+
+    ucs_map_set_task_run(x);
+    ucs_map_set_task_run(y);
+}
+
+static void
+ucs_map_set_task_run(ucs_map_set_task* task) {
+    ucs_map map = task->map;
+    ucs_map_subtree a = task->a, b = task->b;
+
+    if((a.root == NULL) || (b.root == NULL)) {
+        if((task->type == ucs_map_set_intersection) && (a.root != NULL)) {
+            ucs_map_set_task_discard(task, a.root);
+            a = (ucs_map_subtree){.root = NULL};
+        }
+
+        if((task->type == ucs_map_set_union) && (a.root == NULL)) {
+            a = ucs_map_subtree_detach(b);
+        }
+
+        task->result = a;
+        return;
+    }
+
+    ucs_map_node* separator = b.root;
+    ucs_map_search_key sk = ucs_map_node_search_key(map, separator);
+
+    if((task->type == ucs_map_set_union) && (b.height == 1)) {
+        // Insert the single node directly, which is cheaper than splitting.
+        int cmp = 0;
+        ucs_map_node* node = ucs_map_node_locate(map, a.root, &sk, &cmp);
+
+        if(cmp == 0) {
+            ucs_map_set_task_discard_node(task, separator);
+        } else {
+            ptrdiff_t const dir = ((cmp > 0) ? 1 : 0);
+
+            set_balance_(separator, 0);
+            if(has_counts_(map)) {
+                node_count_(separator) = 1;
+            }
+
+            ucs_map_node_link(node, separator, dir);
+            ucs_map_node_count_add(map, node, +1);
+
+            if(ucs_map_rebalance(map, node, dir, ucs_map_rebalance_insert)) {
+                a.height++;
+            }
+
+            if(parent_(a.root) != NULL) {
+                a.root = parent_(a.root);
+            }
+        }
+
+        task->result = a;
+        return;
+    }
+
+    // Process the parts of the map which are less than and greater than the
+    // key of other map's root.
+    ucs_map_set_task parts[2] = {
+        {.map = map,
+         .type = task->type,
+         .thread_count = task->thread_count / 2,
+         .b = ucs_map_subtree_child(b, 0)},
+        {.map = map,
+         .type = task->type,
+         .thread_count = task->thread_count - task->thread_count / 2,
+         .b = ucs_map_subtree_child(b, 1)}};
+
+    if(task->type == ucs_map_set_union) {
+        parts[0].b = ucs_map_subtree_detach(parts[0].b);
+        parts[1].b = ucs_map_subtree_detach(parts[1].b);
+    }
+
+    ucs_map_node* node =
+        ucs_map_tree_split(map, a, &sk, &parts[0].a, &parts[1].a);
+    ucs_map_set_task_run_parts(task, &parts[0], &parts[1]);
+
+    for(size_t i = 0; i != 2; ++i) {
+        ucs_map_set_task_collect(
+            task, parts[i].garbage_head, parts[i].garbage_tail);
+    }
+
+    switch(task->type) {
+        case ucs_map_set_union:
+            // Map's element takes precedence.
+            if(node != NULL) {
+                ucs_map_set_task_discard_node(task, separator);
+            } else {
+                node = separator;
+            }
+
+            break;
+
+        case ucs_map_set_intersection:
+            break;
+
+        case ucs_map_set_difference:
+            if(node != NULL) {
+                ucs_map_set_task_discard_node(task, node);
+                node = NULL;
+            }
+
+            break;
+    }
+
+    task->result =
+        ((node != NULL)
+             ? ucs_map_tree_join(map, parts[0].result, node, parts[1].result)
+             : ucs_map_tree_join2(map, parts[0].result, parts[1].result));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// B-tree engine.
+////////////////////////////////////////////////////////////////////////////////
+
+// Memory management.
+
+static ucs_map_bnode*
+ucs_map_bnode_alloc(ucs_map map) {
+    ucs_map_bnode* node = ucs_allocator_alloc(map->bnode_allocator);
+
+    if(node != NULL) {
+        node->n = 0;
+        node->parent = node->children[0] = NULL;
+    }
+
+    return node;
+}
+
+static void
+ucs_map_bnode_free(ucs_map map, ucs_map_bnode* node) {
+    ucs_allocator_free(map->bnode_allocator, node);
+}
+
+static char*
+ucs_map_slot_alloc(ucs_map map) {
+    char* mem = ucs_allocator_alloc(map->allocator);
+    return ((mem != NULL) ? (mem + map->node_offset) : NULL);
+}
+
+static void
+ucs_map_slot_free(ucs_map map, char* slot) {
+    ucs_allocator_free(map->allocator, slot - map->node_offset);
+}
+
+static ucs_map_iterator
+ucs_map_slot_iterator(char* slot) {
+    return ((slot != NULL) ? (slot + 1) : NULL);
+}
+
+// Node modification.
+
+static void
+ucs_map_bnode_set_item(ucs_map_bnode* node, unsigned i, char* slot,
+                       uint64_t prefix) {
+    node->items[i] = slot;
+    node->prefixes[i] = prefix;
+    slot_node_(slot) = node;
+}
+
+static void
+ucs_map_bnode_set_child(ucs_map_bnode* node, unsigned i,
+                        ucs_map_bnode* child) {
+    node->children[i] = child;
+    child->parent = node;
+}
+
+static void
+ucs_map_bnode_move(ucs_map_bnode* dst, unsigned dst_i, ucs_map_bnode* src,
+                   unsigned src_i, unsigned n) {
+    // Moves {n} items (and the children which follow them) between the given
+    // nodes, or within the same node (ranges may overlap).
+
+    if(dst == src) {
+        memmove(&dst->items[dst_i], &src->items[src_i], n * sizeof(char*));
+        memmove(&dst->prefixes[dst_i], &src->prefixes[src_i],
+                n * sizeof(uint64_t));
+
+        if(!is_leaf_(src)) {
+            memmove(&dst->children[dst_i + 1], &src->children[src_i + 1],
+                    n * sizeof(ucs_map_bnode*));
+        }
+
+        return;
+    }
+
+    for(unsigned j = 0; j != n; ++j) {
+        ucs_map_bnode_set_item(
+            dst, dst_i + j, src->items[src_i + j], src->prefixes[src_i + j]);
+
+        if(!is_leaf_(src)) {
+            ucs_map_bnode_set_child(
+                dst, dst_i + j + 1, src->children[src_i + j + 1]);
+        }
+    }
+}
+
+// Node search.
+
+static unsigned
+ucs_map_bnode_item_idx(ucs_map_bnode* node, char* slot) {
+    unsigned i = 0;
+    for(; node->items[i] != slot; ++i) {
+    }
+
+    return i;
+}
+
+static unsigned
+ucs_map_bnode_child_idx(ucs_map_bnode* node) {
+    unsigned i = 0;
+    for(; node->parent->children[i] != node; ++i) {
+    }
+
+    return i;
+}
+
+static unsigned
+ucs_map_bnode_search(ucs_map map, ucs_map_bnode* node,
+                     ucs_map_search_key const* sk, bool* found) {
+    // Returns the index of the first item whose key is not less than the given
+    // key. Prefixes are compared without branches. Items whose prefixes are
+    // equal to the key's prefix form the range [i, e) (all items, if the map
+    // has no prefix function), which is searched with binary search.
+
+    instrument_(map, map->depth++);
+
+    unsigned i = 0, e = 0;
+    for(unsigned j = 0; j != node->n; ++j) {
+        i += (node->prefixes[j] < sk->prefix);
+        e += (node->prefixes[j] <= sk->prefix);
+    }
+
+    // Loads of the items which binary search visits depend on each other, so
+    // all candidates are prefetched in advance.
+    for(unsigned j = i; ((e - i) > 1) && (j != e); ++j) {
+        prefetch_(slot_mem_(node->items[j]));
+    }
+
+    *found = false;
+    while(i != e) {
+        unsigned m = i + (e - i) / 2;
+
+        instrument_(map, map->stats.comparison_count++);
+        int cmp =
+            map->key_cmp_fn(sk->k, map->key_get_fn(slot_mem_(node->items[m])));
+
+        if(cmp == 0) {
+            *found = true;
+            return m;
+        }
+
+        if(cmp < 0) {
+            e = m;
+        } else {
+            i = m + 1;
+        }
+    }
+
+    return i;
+}
+
+// Insertion.
+
+static void
+ucs_map_bnode_insert(ucs_map map, ucs_map_bnode* node, unsigned i, char* slot,
+                     uint64_t prefix, ucs_map_bnode* right,
+                     ucs_map_bnode** spare_nodes) {
+    // Inserts the given item at position {i} of the given node, {right}
+    // becomes the child which follows the item (it must be NULL if the node is
+    // a leaf). Full nodes are split in two, and their middle item is inserted
+    // to the parent. New nodes are taken from the {spare_nodes} stack.
+
+    while(true) {
+        if(node->n != ucs_map_bnode_max_size) {
+            ucs_map_bnode_move(node, i + 1, node, i, node->n - i);
+            ucs_map_bnode_set_item(node, i, slot, prefix);
+
+            if(right != NULL) {
+                ucs_map_bnode_set_child(node, i + 1, right);
+            }
+
+            node->n++;
+            return;
+        }
+
+        // Split the node: left half stays in place, right half is moved to a
+        // new node. Note: the item being inserted can end up in either half or
+        // become the middle item.
+        unsigned const m = (ucs_map_bnode_max_size + 1) / 2;
+        ucs_map_bnode* sibling = *(spare_nodes++);
+
+        instrument_(map, map->stats.rebalance_step_count++);
+
+        char* middle_slot = NULL;
+        uint64_t middle_prefix = 0;
+
+        if(!is_leaf_(node)) {
+            // Mark the sibling as an internal node.
+            sibling->children[0] = node;
+        }
+
+        if(i < m) {
+            ucs_map_bnode_move(sibling, 0, node, m, node->n - m);
+
+            middle_slot = node->items[m - 1];
+            middle_prefix = node->prefixes[m - 1];
+
+            if(!is_leaf_(node)) {
+                ucs_map_bnode_set_child(sibling, 0, node->children[m]);
+            }
+
+            node->n = m - 1;
+            ucs_map_bnode_move(node, i + 1, node, i, node->n - i);
+            ucs_map_bnode_set_item(node, i, slot, prefix);
+
+            if(right != NULL) {
+                ucs_map_bnode_set_child(node, i + 1, right);
+            }
+
+            node->n++;
+        } else if(i == m) {
+            ucs_map_bnode_move(sibling, 0, node, m, node->n - m);
+
+            middle_slot = slot;
+            middle_prefix = prefix;
+
+            if(right != NULL) {
+                ucs_map_bnode_set_child(sibling, 0, right);
+            }
+
+            node->n = m;
+        } else {
+            ucs_map_bnode_move(sibling, 0, node, m + 1, i - m - 1);
+            ucs_map_bnode_set_item(sibling, i - m - 1, slot, prefix);
+
+            if(right != NULL) {
+                ucs_map_bnode_set_child(sibling, i - m, right);
+            }
+
+            ucs_map_bnode_move(sibling, i - m, node, i, node->n - i);
+
+            middle_slot = node->items[m];
+            middle_prefix = node->prefixes[m];
+
+            if(!is_leaf_(node)) {
+                ucs_map_bnode_set_child(sibling, 0, node->children[m + 1]);
+            }
+
+            node->n = m;
+        }
+
+        sibling->n = ucs_map_bnode_max_size - node->n;
+
+        // Insert the middle item to the parent.
+        if(node->parent == NULL) {
+            ucs_map_bnode* root = *(spare_nodes++);
+
+            ucs_map_bnode_set_child(root, 0, node);
+            ucs_map_bnode_set_child(root, 1, sibling);
+            ucs_map_bnode_set_item(root, 0, middle_slot, middle_prefix);
+
+            root->n = 1;
+            map->broot = root;
+            return;
+        }
+
+        i = ucs_map_bnode_child_idx(node);
+        node = node->parent;
+
+        slot = middle_slot;
+        prefix = middle_prefix;
+        right = sibling;
+    }
+}
+
+static ucs_map_iterator
+ucs_map_btree_insert(ucs_map map, ucs_map_key k) {
+    ucs_map_search_key sk = ucs_map_search_key_make(map, k);
+
+    if(map->broot == NULL) {
+        if((map->broot = ucs_map_bnode_alloc(map)) == NULL) {
+            return NULL;
+        }
+    }
+
+    // Find the leaf.
+    ucs_map_bnode* node = map->broot;
+    unsigned i = 0;
+
+    while(true) {
+        bool found = false;
+        i = ucs_map_bnode_search(map, node, &sk, &found);
+
+        if(found) {
+            return ucs_map_slot_iterator(node->items[i]);
+        }
+
+        if(is_leaf_(node)) {
+            break;
+        }
+
+        node = node->children[i];
+    }
+
+    // Allocate all the memory in advance: each full node on the path to the
+    // root is split in two, and a full root requires one more node.
+    ucs_map_bnode* spare_nodes[sizeof(size_t) * 8] = {NULL};
+    size_t spare_node_count = 0;
+
+    for(ucs_map_bnode* x = node;
+        (x != NULL) && (x->n == ucs_map_bnode_max_size); x = x->parent) {
+        spare_node_count += ((x->parent == NULL) ? 2 : 1);
+    }
+
+    char* slot = ucs_map_slot_alloc(map);
+    bool result = (slot != NULL);
+
+    for(size_t j = 0; result && (j != spare_node_count); ++j) {
+        result = ((spare_nodes[j] = ucs_map_bnode_alloc(map)) != NULL);
+    }
+
+    if(!result) {
+        for(size_t j = 0; j != spare_node_count; ++j) {
+            if(spare_nodes[j] != NULL) {
+                ucs_map_bnode_free(map, spare_nodes[j]);
+            }
+        }
+
+        if(slot != NULL) {
+            ucs_map_slot_free(map, slot);
+        }
+
+        if(map->size == 0) {
+            ucs_map_bnode_free(map, map->broot);
+            map->broot = NULL;
+        }
+
+        return NULL;
+    }
+
+    map->key_set_fn(k, slot_mem_(slot));
+    ucs_map_bnode_insert(map, node, i, slot, sk.prefix, NULL, spare_nodes);
+
+    map->size++;
+    return ucs_map_slot_iterator(slot);
+}
+
+// Removal.
+
+static void
+ucs_map_bnode_merge(ucs_map map, ucs_map_bnode* parent, unsigned i) {
+    // Merges children {i} and {i + 1} of the given node along with the item
+    // which separates them.
+
+    ucs_map_bnode* left = parent->children[i];
+    ucs_map_bnode* right = parent->children[i + 1];
+
+    ucs_map_bnode_set_item(
+        left, left->n, parent->items[i], parent->prefixes[i]);
+
+    if(!is_leaf_(right)) {
+        ucs_map_bnode_set_child(left, left->n + 1, right->children[0]);
+    }
+
+    ucs_map_bnode_move(left, left->n + 1, right, 0, right->n);
+    left->n += right->n + 1;
+
+    ucs_map_bnode_move(parent, i, parent, i + 1, parent->n - i - 1);
+    parent->n--;
+
+    ucs_map_bnode_free(map, right);
+}
+
+static void
+ucs_map_bnode_fix_underflow(ucs_map map, ucs_map_bnode* node) {
+    // Restores minimal node size on the path from the given node to the root
+    // by borrowing items from siblings or merging with them.
+
+    while(node->parent != NULL) {
+        if(node->n >= ucs_map_bnode_min_size) {
+            return;
+        }
+
+        ucs_map_bnode* parent = node->parent;
+        unsigned i = ucs_map_bnode_child_idx(node);
+
+        ucs_map_bnode* left = ((i != 0) ? parent->children[i - 1] : NULL);
+        ucs_map_bnode* right =
+            ((i != parent->n) ? parent->children[i + 1] : NULL);
+
+        if((left != NULL) && (left->n > ucs_map_bnode_min_size)) {
+            // Rotate right: separator goes down, last item of the left
+            // sibling goes up.
+            instrument_(map, map->stats.rotation_count++);
+            ucs_map_bnode_move(node, 1, node, 0, node->n);
+            ucs_map_bnode_set_item(
+                node, 0, parent->items[i - 1], parent->prefixes[i - 1]);
+
+            if(!is_leaf_(node)) {
+                node->children[1] = node->children[0];
+                ucs_map_bnode_set_child(node, 0, left->children[left->n]);
+            }
+
+            ucs_map_bnode_set_item(parent, i - 1, left->items[left->n - 1],
+                                   left->prefixes[left->n - 1]);
+
+            left->n--;
+            node->n++;
+            return;
+        }
+
+        if((right != NULL) && (right->n > ucs_map_bnode_min_size)) {
+            // Rotate left: separator goes down, first item of the right
+            // sibling goes up.
+            instrument_(map, map->stats.rotation_count++);
+            ucs_map_bnode_set_item(
+                node, node->n, parent->items[i], parent->prefixes[i]);
+
+            if(!is_leaf_(node)) {
+                ucs_map_bnode_set_child(
+                    node, node->n + 1, right->children[0]);
+            }
+
+            ucs_map_bnode_set_item(
+                parent, i, right->items[0], right->prefixes[0]);
+
+            if(!is_leaf_(right)) {
+                right->children[0] = right->children[1];
+            }
+
+            ucs_map_bnode_move(right, 0, right, 1, right->n - 1);
+
+            right->n--;
+            node->n++;
+            return;
+        }
+
+        instrument_(map, map->stats.rebalance_step_count++);
+        ucs_map_bnode_merge(map, parent, ((left != NULL) ? (i - 1) : i));
+        node = parent;
+    }
+
+    // Shrink the tree if the root became empty.
+    if(node->n == 0) {
+        if(is_leaf_(node)) {
+            map->broot = NULL;
+        } else {
+            map->broot = node->children[0];
+            map->broot->parent = NULL;
+        }
+
+        ucs_map_bnode_free(map, node);
+    }
+}
+
+static bool
+ucs_map_btree_remove_by_iterator(ucs_map map, ucs_map_iterator i) {
+    if(i == NULL) {
+        return false;
+    }
+
+    char* slot = iterator_slot_(i);
+    ucs_map_bnode* node = slot_node_(slot);
+    unsigned j = ucs_map_bnode_item_idx(node, slot);
+
+    if(!is_leaf_(node)) {
+        // Replace the item with its in-order predecessor, which is the last
+        // item of a leaf.
+        ucs_map_bnode* leaf = node->children[j];
+        for(; !is_leaf_(leaf); leaf = leaf->children[leaf->n]) {
+        }
+
+        ucs_map_bnode_set_item(node, j, leaf->items[leaf->n - 1],
+                               leaf->prefixes[leaf->n - 1]);
+
+        node = leaf;
+        j = leaf->n - 1;
+    }
+
+    ucs_map_bnode_move(node, j, node, j + 1, node->n - j - 1);
+    node->n--;
+
+    ucs_map_bnode_fix_underflow(map, node);
+    ucs_map_slot_free(map, slot);
+
+    map->size--;
+    return true;
+}
+
+// Search.
+
+static ucs_map_iterator
+ucs_map_btree_find(ucs_map map, ucs_map_key k) {
+    ucs_map_search_key sk = ucs_map_search_key_make(map, k);
+
+    for(ucs_map_bnode* node = map->broot; node != NULL;) {
+        bool found = false;
+        unsigned i = ucs_map_bnode_search(map, node, &sk, &found);
+
+        if(found) {
+            return ucs_map_slot_iterator(node->items[i]);
+        }
+
+        node = (is_leaf_(node) ? NULL : node->children[i]);
+    }
+
+    return NULL;
+}
+
+static ucs_map_iterator
+ucs_map_btree_lower_bound(ucs_map map, ucs_map_key k) {
+    ucs_map_search_key sk = ucs_map_search_key_make(map, k);
+    char* bound = NULL;
+
+    for(ucs_map_bnode* node = map->broot; node != NULL;) {
+        bool found = false;
+        unsigned i = ucs_map_bnode_search(map, node, &sk, &found);
+
+        if(i != node->n) {
+            bound = node->items[i];
+
+            if(found) {
+                break;
+            }
+        }
+
+        node = (is_leaf_(node) ? NULL : node->children[i]);
+    }
+
+    return ucs_map_slot_iterator(bound);
+}
+
+// Iteration.
+
+static ucs_map_iterator
+ucs_map_btree_lower(ucs_map map) {
+    ucs_map_bnode* node = map->broot;
+    if(node == NULL) {
+        return NULL;
+    }
+
+    for(; !is_leaf_(node); node = node->children[0]) {
+    }
+
+    return ucs_map_slot_iterator(node->items[0]);
+}
+
+static ucs_map_iterator
+ucs_map_btree_upper(ucs_map map) {
+    ucs_map_bnode* node = map->broot;
+    if(node == NULL) {
+        return NULL;
+    }
+
+    for(; !is_leaf_(node); node = node->children[node->n]) {
+    }
+
+    return ucs_map_slot_iterator(node->items[node->n - 1]);
+}
+
+static ucs_map_iterator
+ucs_map_btree_iterator_next(ucs_map_iterator i) {
+    char* slot = iterator_slot_(i);
+    ucs_map_bnode* node = slot_node_(slot);
+    unsigned j = ucs_map_bnode_item_idx(node, slot);
+
+    if(!is_leaf_(node)) {
+        for(node = node->children[j + 1]; !is_leaf_(node);
+            node = node->children[0]) {
+        }
+
+        return ucs_map_slot_iterator(node->items[0]);
+    }
+
+    if((j + 1) != node->n) {
+        return ucs_map_slot_iterator(node->items[j + 1]);
+    }
+
+    for(; node->parent != NULL; node = node->parent) {
+        j = ucs_map_bnode_child_idx(node);
+
+        if(j != node->parent->n) {
+            return ucs_map_slot_iterator(node->parent->items[j]);
+        }
+    }
+
+    return NULL;
+}
+
+static ucs_map_iterator
+ucs_map_btree_iterator_prev(ucs_map_iterator i) {
+    char* slot = iterator_slot_(i);
+    ucs_map_bnode* node = slot_node_(slot);
+    unsigned j = ucs_map_bnode_item_idx(node, slot);
+
+    if(!is_leaf_(node)) {
+        for(node = node->children[j]; !is_leaf_(node);
+            node = node->children[node->n]) {
+        }
+
+        return ucs_map_slot_iterator(node->items[node->n - 1]);
+    }
+
+    if(j != 0) {
+        return ucs_map_slot_iterator(node->items[j - 1]);
+    }
+
+    for(; node->parent != NULL; node = node->parent) {
+        j = ucs_map_bnode_child_idx(node);
+
+        if(j != 0) {
+            return ucs_map_slot_iterator(node->parent->items[j - 1]);
+        }
+    }
+
+    return NULL;
+}
+
+// Batch application.
+
+static bool
+ucs_map_btree_apply_batch(ucs_map map, ucs_map_batch_op* ops, size_t n) {
+    bool result = true;
+
+    for(ucs_map_batch_op* op = ops; op != (ops + n); ++op) {
+        if(op->type == ucs_map_batch_insert) {
+            if((op->i = ucs_map_btree_insert(map, op->k)) == NULL) {
+                result = false;
+            }
+        } else {
+            ucs_map_btree_remove_by_iterator(
+                map, ucs_map_btree_find(map, op->k));
+
+            op->i = NULL;
+        }
+    }
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map creation/destruction interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+static ucs_allocator_upstream
+ucs_map_config_upstream(ucs_map_config cfg) {
+    return (ucs_allocator_upstream){.region_fn = cfg.region_fn,
+                                    .deallocate_fn = cfg.deallocate_fn,
+                                    .context = cfg.region_context};
+}
+
+// Computes the memory layout of map's nodes. Returns false if the
+// configuration is invalid.
+static bool
+ucs_map_node_layout(ucs_map_config cfg, size_t* alignment_ptr,
+                    size_t* node_offset_ptr, size_t* allocation_size_ptr) {
+    if(cfg.element_size == 0) {
+        return false;
+    }
+
+    // B-tree maps do not maintain order statistics, and do not support
+    // concurrent readers or shared allocators.
+    bool const is_btree = ((cfg.flags & ucs_map_flag_btree) != 0);
+    if(is_btree && (((cfg.flags & (ucs_map_flag_order_statistics |
+                                   ucs_map_flag_concurrent)) != 0) ||
+                    (cfg.allocator != NULL))) {
+        return false;
+    }
+
+#define max_(x, y) (((x) > (y)) ? (x) : (y))
+#define is_pot_(x) (((x) & ((x)-1)) == 0)
+
+    size_t alignment = max_(cfg.element_alignment, alignof(ucs_map_node));
+    if(cfg.key_prefix_fn != NULL) {
+        alignment = max_(alignment, alignof(uint64_t));
+    }
+
+    if(!is_pot_(alignment)) {
+        return false;
+    }
+
+#undef is_pot_
+#undef max_
+
+#define pad_(size, aignment)                                        \
+    if(true) {                                                      \
+        size_t d = (size) % (alignment);                            \
+        if((d != 0) && (((size) += (alignment)-d) < (alignment))) { \
+            return false;                                           \
+        }                                                           \
+    }
+
+#define add_(x, y)           \
+    if(((x) += (y)) < (y)) { \
+        return false;        \
+    }
+
+    // Node's memory layout: [key prefix] [padding] [subtree size] node element.
+    // Padding is placed before the node, so that the element can be found
+    // from the node alone. In B-tree maps the node is replaced with a pointer
+    // to the B-tree node which references the element (key prefixes are stored
+    // in B-tree nodes).
+    size_t const node_size =
+        (is_btree ? sizeof(ucs_map_bnode*) : sizeof(ucs_map_node));
+
+    size_t extra_size = 0;
+    if((cfg.key_prefix_fn != NULL) && !is_btree) {
+        extra_size += sizeof(uint64_t);
+    }
+
+    if((cfg.flags & ucs_map_flag_order_statistics) != 0) {
+        extra_size += sizeof(size_t);
+    }
+
+    size_t allocation_size = extra_size + node_size;
+    pad_(allocation_size, alignment);
+
+    size_t node_offset = allocation_size - node_size;
+
+    add_(allocation_size, cfg.element_size);
+    pad_(allocation_size, alignment);
+
+#undef add_
+#undef pad_
+
+    *alignment_ptr = alignment;
+    *node_offset_ptr = node_offset;
+    *allocation_size_ptr = allocation_size;
+
+    return true;
+}
+
+ucs_allocator_config
+ucs_map_allocator_config(ucs_map_config cfg) {
+    size_t alignment = 0, node_offset = 0, allocation_size = 0;
+    if(!ucs_map_node_layout(cfg, &alignment, &node_offset, &allocation_size)) {
+        return (ucs_allocator_config){.element_size = 0};
+    }
+
+    size_t block_size = cfg.block_size;
+    size_t max_block_size = cfg.max_block_size;
+
+    if(block_size == 0) {
+        block_size = ucs_map_default_block_size;
+        max_block_size = ucs_map_default_max_block_size;
+    }
+
+    return (ucs_allocator_config){
+        .block_size = block_size,
+        .max_block_size = max_block_size,
+        .element_alignment = alignment,
+        .element_size = allocation_size,
+        .flags = ucs_allocator_flag_intrusive |
+                 (((cfg.flags & ucs_map_flag_huge_pages) != 0)
+                      ? (unsigned)(ucs_allocator_flag_huge_pages)
+                      : 0u),
+        .region_fn = cfg.region_fn,
+        .deallocate_fn = cfg.deallocate_fn,
+        .region_context = cfg.region_context,
+        .trim_high_watermark = cfg.trim_high_watermark,
+        .trim_low_watermark = cfg.trim_low_watermark};
+}
+
+ucs_map
+ucs_map_create_in_place(ucs_map_config cfg, char* mem) {
+    size_t alignment = 0, node_offset = 0, allocation_size = 0;
+    if(!ucs_map_node_layout(cfg, &alignment, &node_offset, &allocation_size)) {
+        return NULL;
+    }
+
+    ucs_map m = (ucs_map)(mem);
+    if(m != NULL) {
+        *m = (struct ucs_map){.node_offset = node_offset,
+                              .element_alignment = cfg.element_alignment,
+                              .element_size = cfg.element_size,
+                              .flags = cfg.flags,
+                              .key_set_fn = cfg.key_set_fn,
+                              .key_get_fn = cfg.key_get_fn,
+                              .key_cmp_fn = cfg.key_cmp_fn,
+                              .key_prefix_fn = cfg.key_prefix_fn,
+                              .upstream = ucs_map_config_upstream(cfg)};
+
+        ucs_allocator_config alloc_cfg = ucs_map_allocator_config(cfg);
+
+        if(cfg.allocator != NULL) {
+            m->allocator = cfg.allocator;
+        } else {
+            m->allocator = ucs_allocator_create_in_place(
+                alloc_cfg, m->allocator_storage.mem);
+
+            if(m->allocator == NULL) {
+                return NULL;
+            }
+        }
+
+        if(is_btree_(m)) {
+            // Each B-tree node references at least 7 elements.
+            ucs_allocator_config bnode_alloc_cfg = {
+                .block_size = (alloc_cfg.block_size + 7) / 8,
+                .max_block_size = (alloc_cfg.max_block_size + 7) / 8,
+                .element_alignment = alignof(ucs_map_bnode),
+                .element_size = sizeof(ucs_map_bnode),
+                .flags = alloc_cfg.flags,
+                .region_fn = cfg.region_fn,
+                .deallocate_fn = cfg.deallocate_fn,
+                .region_context = cfg.region_context};
+
+            m->bnode_allocator = ucs_allocator_create_in_place(
+                bnode_alloc_cfg, m->bnode_allocator_storage.mem);
+
+            if(m->bnode_allocator == NULL) {
+                ucs_allocator_destroy_in_place(m->allocator);
+                return NULL;
+            }
+        }
+
+        if((cfg.flags & ucs_map_flag_concurrent) != 0) {
+            m->concurrent = ucs_allocator_upstream_alloc(
+                m->upstream, sizeof(ucs_map_concurrent_state),
+                alignof(ucs_map_concurrent_state));
+
+            if(m->concurrent == NULL) {
+                if(!has_shared_allocator_(m)) {
+                    ucs_allocator_destroy_in_place(m->allocator);
+                }
+
+                return NULL;
+            }
+
+            ucs_map_concurrent_state* state = m->concurrent;
+            atomic_init(&state->version, 0);
+            atomic_init(&state->epoch, 0);
+
+            for(size_t i = 0; i != 2; ++i) {
+                for(size_t j = 0; j != ucs_map_reader_stripe_count; ++j) {
+                    atomic_init(&state->readers[i][j].count, 0);
+                }
+
+                state->limbo[i] = (ucs_map_limbo){.mem = NULL};
+            }
+        }
+    }
+
+    return m;
+}
+
+ucs_map
+ucs_map_create(ucs_map_config cfg) {
+    ucs_allocator_upstream upstream = ucs_map_config_upstream(cfg);
+    char* mem = ucs_allocator_upstream_alloc(
+        upstream, ucs_map_object_size, ucs_map_object_alignment);
+
+    if((mem != NULL) && (ucs_map_create_in_place(cfg, mem) == NULL)) {
+        ucs_allocator_upstream_free(upstream, mem, ucs_map_object_size);
+        mem = NULL;
+    }
+
+    return (ucs_map)(mem);
+}
+
+void
+ucs_map_destroy_in_place(ucs_map map) {
+    if(map == NULL) {
+        return;
+    }
+
+    if(has_shared_allocator_(map)) {
+        ucs_map_clear(map);
+    } else {
+        ucs_allocator_destroy_in_place(map->allocator);
+    }
+
+    ucs_allocator_destroy_in_place(map->bnode_allocator);
+
+    if(is_concurrent_(map)) {
+        for(size_t i = 0; i != 2; ++i) {
+            ucs_map_limbo* limbo = &map->concurrent->limbo[i];
+            ucs_allocator_upstream_free(
+                map->upstream, limbo->mem, limbo->capacity * sizeof(void*));
+        }
+
+        ucs_allocator_upstream_free(
+            map->upstream, map->concurrent, sizeof(ucs_map_concurrent_state));
+    }
+}
+
+void
+ucs_map_destroy(ucs_map map) {
+    if(map == NULL) {
+        return;
+    }
+
+    ucs_allocator_upstream upstream = map->upstream;
+    ucs_map_destroy_in_place(map);
+    ucs_allocator_upstream_free(upstream, map, ucs_map_object_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map update interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+void
+ucs_map_clear(ucs_map map) {
+    ucs_map_node* root = map->root;
+
+    if(is_concurrent_(map)) {
+        // Detach the tree, and wait for readers which could still reach it.
+        ucs_map_write_begin(map);
+        set_link_(map->root, NULL);
+        set_link_(map->lower, NULL);
+        set_link_(map->upper, NULL);
+        map->size = 0;
+        ucs_map_write_end(map);
+
+        ucs_map_synchronize(map);
+    }
+
+    if(has_shared_allocator_(map)) {
+        // The allocator holds elements of other maps.
+        ucs_map_tree_free(map, root);
+    } else {
+        ucs_allocator_free_all(map->allocator);
+    }
+
+    map->root = map->lower = map->upper = NULL;
+    map->size = 0;
+
+    if(is_btree_(map)) {
+        ucs_allocator_free_all(map->bnode_allocator);
+        map->broot = NULL;
+    }
+}
+
+size_t
+ucs_map_shrink_to_fit(ucs_map map) {
+    size_t n = ucs_allocator_shrink(map->allocator, 0);
+
+    if(is_btree_(map)) {
+        n += ucs_allocator_shrink(map->bnode_allocator, 0);
+    }
+
+    return n;
+}
+
+ucs_map_memory_statistics
+ucs_map_memory_usage(ucs_map map) {
+    ucs_map_memory_statistics stats = {
+        .elements = ucs_allocator_stats(map->allocator)};
+
+    if(is_btree_(map)) {
+        stats.bnodes = ucs_allocator_stats(map->bnode_allocator);
+    }
+
+    stats.total_size =
+        stats.elements.reserved_size + stats.bnodes.reserved_size;
+
+    if(is_concurrent_(map)) {
+        stats.total_size +=
+            sizeof(ucs_map_concurrent_state) +
+            (map->concurrent->limbo[0].capacity +
+             map->concurrent->limbo[1].capacity) *
+                sizeof(void*);
+    }
+
+    return stats;
+}
+
+bool
+ucs_map_reserve(ucs_map map, size_t n) {
+    n = ((n > map->size) ? (n - map->size) : 0);
+
+    if(is_btree_(map) &&
+       !ucs_allocator_reserve(map->bnode_allocator,
+                              n / ucs_map_bnode_min_size + 1)) {
+        return false;
+    }
+
+    return ucs_allocator_reserve(map->allocator, n);
+}
+
+static ucs_map_iterator
+ucs_map_key_insert(ucs_map map, ucs_map_key k) {
+    if(is_btree_(map)) {
+        return ucs_map_btree_insert(map, k);
+    }
+
+    ucs_map_search_key sk = ucs_map_search_key_make(map, k);
+
+    if(map->root == NULL) {
+        return ucs_map_node_insert(map, NULL, 0, &sk);
+    }
+
+    // Find the closest node.
+    int cmp = 0;
+    ucs_map_node* node = ucs_map_node_locate(map, map->root, &sk, &cmp);
+
+    if(cmp == 0) {
+        return node;
+    }
+
+    return ucs_map_node_insert(map, node, ((cmp > 0) ? 1 : 0), &sk);
+}
+
+static ucs_map_iterator
+ucs_map_key_insert_hint(ucs_map map, ucs_map_iterator hint, ucs_map_key k) {
+    if(is_btree_(map)) {
+        return ucs_map_btree_insert(map, k);
+    }
+
+    ucs_map_search_key sk = ucs_map_search_key_make(map, k);
+
+    if(map->root == NULL) {
+        return ucs_map_node_insert(map, NULL, 0, &sk);
+    }
+
+    ucs_map_node* node = ((hint != NULL) ? hint : map->upper);
+
+    int cmp = key_cmp_(&sk, node);
+    if(cmp == 0) {
+        return node;
+    }
+
+    ptrdiff_t const dir = ((cmp > 0) ? 1 : 0);
+
+    // Appending/prepending to the map requires one comparison.
+    if(node == ((dir == 1) ? map->upper : map->lower)) {
+        return ucs_map_node_insert(map, node, dir, &sk);
+    }
+
+    // Check if the key belongs between the hint and its neighbour.
+    ucs_map_node* neighbour = ((dir == 1) ? ucs_map_iterator_next(node)
+                                          : ucs_map_iterator_prev(node));
+
+    if((cmp = key_cmp_(&sk, neighbour)) == 0) {
+        return neighbour;
+    }
+
+    if((cmp > 0) != (dir == 1)) {
+        // Either the hint has no child in the direction of the key, or its
+        // neighbour (which is the extreme node of that child's subtree) has
+        // no child in the opposite direction.
+        if(node->children[dir] == NULL) {
+            return ucs_map_node_insert(map, node, dir, &sk);
+        }
+
+        return ucs_map_node_insert(map, neighbour, 1 - dir, &sk);
+    }
+
+    // The hint is far from the key: find its position starting from the hint's
+    // neighbour.
+    node = ucs_map_node_locate_from(map, neighbour, &sk, &cmp);
+    if(cmp == 0) {
+        return node;
+    }
+
+    return ucs_map_node_insert(map, node, ((cmp > 0) ? 1 : 0), &sk);
+}
+
+ucs_map_iterator
+ucs_map_insert(ucs_map map, ucs_map_key k) {
+    instrument_(map, map->depth = 0);
+    ucs_map_iterator i = ucs_map_key_insert(map, k);
+    instrument_(map, ucs_map_record_descent(map, &map->stats.insert));
+
+    return i;
+}
+
+ucs_map_iterator
+ucs_map_insert_hint(ucs_map map, ucs_map_iterator hint, ucs_map_key k) {
+    instrument_(map, map->depth = 0);
+    ucs_map_iterator i = ucs_map_key_insert_hint(map, hint, k);
+    instrument_(map, ucs_map_record_descent(map, &map->stats.insert));
+
+    return i;
+}
+
+bool
+ucs_map_build_sorted(ucs_map map, size_t n, ucs_map_key_next_fn next_fn,
+                     void* context) {
+    // Note: after clearing, the allocator hands out its memory in address
+    // order, so the nodes are laid out in memory in key order.
+    ucs_map_clear(map);
+
+    if(is_btree_(map)) {
+        for(size_t i = 0; i != n; ++i) {
+            if(ucs_map_btree_insert(map, next_fn(context)) == NULL) {
+                ucs_map_clear(map);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    ucs_map_key_source source = {.next_fn = next_fn, .context = context};
+    return ucs_map_build_content(map, n, ucs_map_node_source_keys, &source);
+}
+
+bool
+ucs_map_build_sorted_array(ucs_map map, void const* keys, size_t key_stride,
+                           size_t n) {
+    ucs_map_key_array array = {.next = keys, .stride = key_stride};
+    return ucs_map_build_sorted(map, n, ucs_map_key_array_next, &array);
+}
+
+bool
+ucs_map_apply_batch(ucs_map map, ucs_map_batch_op* ops, size_t n) {
+    if(is_btree_(map)) {
+        return ucs_map_btree_apply_batch(map, ops, n);
+    }
+
+    // Rebuilding the tree costs O(size + n), so it is done only when the batch
+    // is at least as large as the map. Concurrent maps are never rebuilt in
+    // place, since readers would have to wait for the whole rebuild.
+    if((n >= map->size) && !is_concurrent_(map)) {
+        return ucs_map_apply_batch_merge(map, ops, n);
+    }
+
+    // Smaller batches split the detached tree, so concurrent maps apply them
+    // one by one.
+    if(!is_concurrent_(map)) {
+        return ucs_map_apply_batch_split(map, ops, n);
+    }
+
+    return ucs_map_apply_batch_incremental(map, ops, n);
+}
+
+static ucs_map_iterator
+ucs_map_key_find(ucs_map map, ucs_map_key k);
+
+bool
+ucs_map_remove(ucs_map map, ucs_map_key k) {
+    instrument_(map, map->depth = 0);
+    ucs_map_iterator i = ucs_map_key_find(map, k);
+    instrument_(map, ucs_map_record_descent(map, &map->stats.remove));
+
+    return ucs_map_remove_by_iterator(map, i);
+}
+
+bool
+ucs_map_remove_by_iterator(ucs_map map, ucs_map_iterator i) {
+    if(is_btree_(map)) {
+        return ucs_map_btree_remove_by_iterator(map, i);
+    }
+
+    ucs_map_node* node = i;
+
+    if(node == NULL) {
+        return false;
+    }
+
+    ucs_map_write_begin(map);
+
+    // Update map's bounds. Note: the first node has no left child and the
+    // last node has no right child, so their neighbours are found in O(1).
+    if(map->lower == node) {
+        set_link_(map->lower, ucs_map_iterator_next(node));
+    }
+
+    if(map->upper == node) {
+        set_link_(map->upper, ucs_map_iterator_prev(node));
+    }
+
+    ucs_map_node* parent = parent_(node);
+    ptrdiff_t child_i = ucs_map_node_child_idx(node, parent);
+    if((node->children[0] == NULL) || (node->children[1] == NULL)) {
+        // Node has at most one child.
+
+        ucs_map_node_count_add(map, parent, -1);
+
+        ucs_map_node* next = // Select non-null child (if any).
+            ((node->children[0] != NULL) ? node->children[0]
+                                         : node->children[1]);
+
+        if(map->root == node) {
+            if(next != NULL) {
+                set_parent_(next, NULL);
+            }
+
+            set_link_(map->root, next);
+        } else {
+            ucs_map_node_link(parent, next, child_i);
+            ucs_map_rebalance(map, parent, child_i, ucs_map_rebalance_remove);
+        }
+    } else {
+        // Node has two children.
+
+        // Find in-order successor.
+        ucs_map_node* next = node->children[1];
+        for(; next->children[0] != NULL; next = next->children[0]) {
+        }
+
+        // Update subtree sizes on the path from in-order successor to the
+        // root. The successor takes the place of the removed node.
+        ucs_map_node_count_add(map, parent_(next), -1);
+        if(has_counts_(map)) {
+            node_count_(next) = node_count_(node);
+        }
+
+        // Update map's root if needed.
+        if(map->root == node) {
+            set_link_(map->root, next);
+        }
+
+        // Update in-order successor's links and rebalance the tree.
+        ucs_map_node_link(next, node->children[0], 0);
+        set_balance_(next, balance_(node));
+
+        ucs_map_node* parent_next = parent_(next);
+        if(parent_next == node) {
+            ucs_map_node_link(parent, next, child_i);
+            ucs_map_rebalance(map, next, 1, ucs_map_rebalance_remove);
+        } else {
+            ptrdiff_t child_i_next = ucs_map_node_child_idx(next, parent_next);
+
+            ucs_map_node_link(parent_next, next->children[1], child_i_next);
+            ucs_map_node_link(parent, next, child_i);
+            ucs_map_node_link(next, node->children[1], 1);
+            ucs_map_rebalance(
+                map, parent_next, child_i_next, ucs_map_rebalance_remove);
+        }
+    }
+
+    map->size--;
+    ucs_map_write_end(map);
+
+    ucs_map_node_free(map, node);
+    return true;
+}
+
+size_t
+ucs_map_remove_range(ucs_map map, ucs_map_key lo, ucs_map_key hi) {
+    if(map->key_cmp_fn(lo, hi) >= 0) {
+        return 0;
+    }
+
+    size_t n = 0;
+
+    if(is_btree_(map) || is_concurrent_(map)) {
+        // Remove the elements one by one.
+        for(ucs_map_iterator i = ucs_map_lower_bound(map, lo); i != NULL;
+            ++n) {
+            ucs_map_key k = map->key_get_fn(ucs_map_iterator_mem(i));
+            if(map->key_cmp_fn(k, hi) >= 0) {
+                break;
+            }
+
+            ucs_map_iterator next = ucs_map_iterator_next(i);
+            ucs_map_remove_by_iterator(map, i);
+            i = next;
+        }
+
+        return n;
+    }
+
+    // Cut the subtree with keys in [lo, hi) out of the detached tree, and join
+    // the rest.
+    ucs_map_search_key sk[2] = {
+        ucs_map_search_key_make(map, lo), ucs_map_search_key_make(map, hi)};
+
+    ucs_map_subtree t = {.root = map->root,
+                         .height = ucs_map_tree_height(map->root)},
+                    l, m, r, empty = {.root = NULL};
+
+    map->root = NULL;
+
+    ucs_map_node* node = ucs_map_tree_split(map, t, &sk[0], &l, &m);
+    if(node != NULL) {
+        m = ucs_map_tree_join(map, empty, node, m);
+    }
+
+    node = ucs_map_tree_split(map, m, &sk[1], &m, &r);
+    if(node != NULL) {
+        r = ucs_map_tree_join(map, empty, node, r);
+    }
+
+    t = ucs_map_tree_join2(map, l, r);
+
+    // Free the removed nodes.
+    if((t.root == NULL) && !has_shared_allocator_(map)) {
+        n = map->size;
+        ucs_allocator_free_all(map->allocator);
+    } else {
+        n = ucs_map_tree_free(map, m.root);
+    }
+
+    map->root = t.root;
+    map->size -= n;
+    ucs_map_bounds_reset(map);
+
+    return n;
+}
+
+ucs_map_iterator
+ucs_map_insert_at(ucs_map map, ucs_map_iterator parent, ptrdiff_t child_i,
+                  ucs_map_key k) {
+    ucs_map_search_key sk = ucs_map_search_key_make(map, k);
+    return ucs_map_node_insert(map, parent, child_i, &sk);
+}
+
+ucs_map_iterator
+ucs_map_root(ucs_map map) {
+    return link_(map->root);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map set operations interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+ucs_map_has_set_op_trees(ucs_map map, ucs_map other) {
+    // Returns true if the set operation can be done on maps' trees, rather
+    // than element by element.
+
+    return !is_btree_(map) && !is_btree_(other) && !is_concurrent_(map) &&
+           !is_concurrent_(other);
+}
+
+static void
+ucs_map_tree_assign(ucs_map map, ucs_map_subtree t, size_t size) {
+    // Replaces the (detached) tree of the map with the given tree.
+
+    map->root = t.root;
+    map->size = size;
+    ucs_map_bounds_reset(map);
+}
+
+static void
+ucs_map_set_op(ucs_map map, ucs_map_subtree b, size_t size,
+               ucs_map_set_op_type type, size_t thread_count) {
+    // Applies the set operation to map's tree and the given tree, which
+    // contain {size} nodes in total (only map's nodes are counted, unless the
+    // operation is a union).
+
+#ifdef UCS_MAP_INSTRUMENTATION
+    // Instrumentation counters are not synchronized.
+    thread_count = 1;
+#endif
+
+    ucs_map_set_task task = {
+        .map = map,
+        .type = type,
+        .thread_count = thread_count,
+        .a = {.root = map->root, .height = ucs_map_tree_height(map->root)},
+        .b = b};
+
+    // The tree is detached, so that rebalancing never changes map's root.
+    map->root = NULL;
+    ucs_map_set_task_run(&task);
+
+    for(ucs_map_node* root = task.garbage_head; root != NULL;) {
+        ucs_map_node* next = parent_(root);
+        size -= ucs_map_tree_free(map, root);
+        root = next;
+    }
+
+    ucs_map_tree_assign(map, task.result, size);
+}
+
+static ucs_map_node*
+ucs_map_tree_first(ucs_map_node* node) {
+    for(; (node != NULL) && (node->children[0] != NULL);
+        node = node->children[0]) {
+    }
+
+    return node;
+}
+
+static bool
+ucs_map_tree_copy(ucs_map map, ucs_map_node* root, ucs_map_subtree* copy) {
+    // Copies the elements of the given tree (which can belong to another map
+    // with the same configuration) to map's memory, and builds a balanced tree
+    // from the copies. Returns false if memory allocation fails.
+    // Precondition: the tree is detached.
+
+    ucs_map_vine_builder vine = {.head = NULL};
+    ucs_map_node* i = ucs_map_tree_first(root);
+
+    for(; i != NULL; i = ucs_map_iterator_next(i)) {
+        ucs_map_node* node = ucs_map_node_alloc(map);
+        if(node == NULL) {
+            break;
+        }
+
+        memcpy(node_mem_(node), node_mem_(i), map->element_size);
+        if(has_prefixes_(map)) {
+            node_prefix_(map, node) = node_prefix_(map, i);
+        }
+
+        ucs_map_vine_append(&vine, node);
+    }
+
+    if(vine.tail != NULL) {
+        vine.tail->children[1] = NULL;
+    }
+
+    if(i != NULL) {
+        ucs_map_tree_free(map, vine.head);
+        return false;
+    }
+
+    ucs_map_build(
+        map, vine.size, ucs_map_node_source_vine, &vine.head, &copy->root);
+
+    copy->height = ucs_map_perfect_tree_height(vine.size);
+    return true;
+}
+
+static bool
+ucs_map_tree_take(ucs_map map, ucs_map other, ucs_map_subtree* t) {
+    // Takes the tree of the other map, and leaves that map empty. The tree is
+    // copied to map's memory, unless the maps share an allocator. Returns false
+    // (leaving both maps unchanged) if memory allocation fails.
+
+    if(map->allocator != other->allocator) {
+        if(!ucs_map_tree_copy(map, other->root, t)) {
+            return false;
+        }
+
+        ucs_map_clear(other);
+        return true;
+    }
+
+    *t = (ucs_map_subtree){.root = other->root,
+                           .height = ucs_map_tree_height(other->root)};
+
+    other->root = other->lower = other->upper = NULL;
+    other->size = 0;
+
+    return true;
+}
+
+static bool
+ucs_map_union_incremental(ucs_map map, ucs_map other) {
+    if(!ucs_map_reserve(map, map->size + other->size)) {
+        return false;
+    }
+
+    for(ucs_map_iterator i = ucs_map_lower(other); i != NULL;
+        i = ucs_map_iterator_next(i)) {
+        char* element = ucs_map_iterator_mem(i);
+        size_t const size = map->size;
+
+        ucs_map_iterator j = ucs_map_insert(map, map->key_get_fn(element));
+        if(j == NULL) {
+            return false;
+        }
+
+        if(map->size != size) {
+            memcpy(ucs_map_iterator_mem(j), element, map->element_size);
+        }
+    }
+
+    ucs_map_clear(other);
+    return true;
+}
+
+bool
+ucs_map_union(ucs_map map, ucs_map other, size_t thread_count) {
+    if(!ucs_map_has_set_op_trees(map, other)) {
+        return ucs_map_union_incremental(map, other);
+    }
+
+    size_t const size = map->size + other->size;
+
+    ucs_map_subtree b = {.root = NULL};
+    if(!ucs_map_tree_take(map, other, &b)) {
+        return false;
+    }
+
+    ucs_map_set_op(map, b, size, ucs_map_set_union, thread_count);
+    return true;
+}
+
+void
+ucs_map_intersection(ucs_map map, ucs_map other, size_t thread_count) {
+    if(!ucs_map_has_set_op_trees(map, other)) {
+        for(ucs_map_iterator i = ucs_map_lower(map); i != NULL;) {
+            ucs_map_iterator next = ucs_map_iterator_next(i);
+            ucs_map_key k = map->key_get_fn(ucs_map_iterator_mem(i));
+
+            if(ucs_map_find(other, k) == NULL) {
+                ucs_map_remove_by_iterator(map, i);
+            }
+
+            i = next;
+        }
+
+        return;
+    }
+
+    ucs_map_subtree b = {.root = other->root,
+                         .height = ucs_map_tree_height(other->root)};
+
+    ucs_map_set_op(map, b, map->size, ucs_map_set_intersection, thread_count);
+}
+
+void
+ucs_map_difference(ucs_map map, ucs_map other, size_t thread_count) {
+    if(!ucs_map_has_set_op_trees(map, other)) {
+        for(ucs_map_iterator i = ucs_map_lower(other); i != NULL;
+            i = ucs_map_iterator_next(i)) {
+            ucs_map_remove(map, other->key_get_fn(ucs_map_iterator_mem(i)));
+        }
+
+        return;
+    }
+
+    ucs_map_subtree b = {.root = other->root,
+                         .height = ucs_map_tree_height(other->root)};
+
+    ucs_map_set_op(map, b, map->size, ucs_map_set_difference, thread_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map splitting and joining interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+static size_t
+ucs_map_tree_size(ucs_map map, ucs_map_node* x, ucs_map_node* y,
+                  size_t size) {
+    // Returns the number of nodes in the tree {x}, given that the trees {x} and
+    // {y} have {size} nodes in total. Without order statistics the trees are
+    // traversed in parallel until the smaller one ends, in O(min(|x|, |y|)).
+
+    if(has_counts_(map)) {
+        return count_(x);
+    }
+
+    ucs_map_node *i = ucs_map_tree_first(x), *j = ucs_map_tree_first(y);
+    size_t n = 0;
+
+    for(; (i != NULL) && (j != NULL); ++n) {
+        i = ucs_map_iterator_next(i);
+        j = ucs_map_iterator_next(j);
+    }
+
+    return ((i == NULL) ? n : (size - n));
+}
+
+static bool
+ucs_map_split_incremental(ucs_map map, ucs_map_key k, ucs_map left,
+                          ucs_map right) {
+    ucs_map maps[2] = {left, right};
+
+    for(size_t i = 0; i != 2; ++i) {
+        if(maps[i] == map) {
+            continue;
+        }
+
+        ucs_map_iterator j =
+            ((i == 0) ? ucs_map_lower(map) : ucs_map_lower_bound(map, k));
+
+        while(j != NULL) {
+            char* element = ucs_map_iterator_mem(j);
+            ucs_map_key element_key = map->key_get_fn(element);
+
+            if((i == 0) && (map->key_cmp_fn(element_key, k) >= 0)) {
+                break;
+            }
+
+            ucs_map_iterator copy =
+                ucs_map_insert_hint(maps[i], NULL, element_key);
+
+            if(copy == NULL) {
+                return false;
+            }
+
+            memcpy(ucs_map_iterator_mem(copy), element, map->element_size);
+
+            ucs_map_iterator next = ucs_map_iterator_next(j);
+            ucs_map_remove_by_iterator(map, j);
+            j = next;
+        }
+    }
+
+    return true;
+}
+
+bool
+ucs_map_split(ucs_map map, ucs_map_key k, ucs_map left, ucs_map right) {
+    ucs_map maps[2] = {left, right};
+
+    if(!ucs_map_has_set_op_trees(map, left) ||
+       !ucs_map_has_set_op_trees(map, right)) {
+        return ucs_map_split_incremental(map, k, left, right);
+    }
+
+    ucs_map_search_key sk = ucs_map_search_key_make(map, k);
+    ucs_map_subtree parts[2], copies[2];
+    size_t sizes[2], size = map->size;
+
+    ucs_map_subtree t = {
+        .root = map->root, .height = ucs_map_tree_height(map->root)};
+
+    // Split the detached tree, and put the element with the given key (if any)
+    // to the right part.
+    map->root = NULL;
+
+    ucs_map_node* node = ucs_map_tree_split(map, t, &sk, &parts[0], &parts[1]);
+    if(node != NULL) {
+        parts[1] = ucs_map_tree_join(
+            map, (ucs_map_subtree){.root = NULL}, node, parts[1]);
+    }
+
+    sizes[0] = ucs_map_tree_size(map, parts[0].root, parts[1].root, size);
+    sizes[1] = size - sizes[0];
+
+    // Copy the parts which go to maps with other allocators.
+    bool copied[2] = {false, false};
+    for(size_t i = 0; i != 2; ++i) {
+        copies[i] = parts[i];
+
+        if((maps[i] == map) || (maps[i]->allocator == map->allocator)) {
+            continue;
+        }
+
+        if(!ucs_map_tree_copy(maps[i], parts[i].root, &copies[i])) {
+            if(copied[0]) {
+                ucs_map_tree_free(maps[0], copies[0].root);
+            }
+
+            ucs_map_tree_assign(
+                map, ucs_map_tree_join2(map, parts[0], parts[1]), size);
+
+            return false;
+        }
+
+        copied[i] = true;
+    }
+
+    ucs_map_tree_assign(map, (ucs_map_subtree){.root = NULL}, 0);
+
+    for(size_t i = 0; i != 2; ++i) {
+        if(copied[i]) {
+            ucs_map_tree_free(map, parts[i].root);
+        }
+
+        ucs_map_tree_assign(maps[i], copies[i], sizes[i]);
+    }
+
+    return true;
+}
+
+bool
+ucs_map_join(ucs_map map, ucs_map other) {
+    if(other->size == 0) {
+        return true;
+    }
+
+    // Find the order of the maps.
+    bool other_first = false;
+    if(map->size != 0) {
+        ucs_map_key_get_fn get = map->key_get_fn;
+
+        ucs_map_key map_lower = get(ucs_map_iterator_mem(ucs_map_lower(map))),
+                    map_upper = get(ucs_map_iterator_mem(ucs_map_upper(map))),
+                    other_lower =
+                        get(ucs_map_iterator_mem(ucs_map_lower(other))),
+                    other_upper =
+                        get(ucs_map_iterator_mem(ucs_map_upper(other)));
+
+        if(map->key_cmp_fn(map_upper, other_lower) < 0) {
+            other_first = false;
+        } else if(map->key_cmp_fn(other_upper, map_lower) < 0) {
+            other_first = true;
+        } else {
+            return false;
+        }
+    }
+
+    if(!ucs_map_has_set_op_trees(map, other)) {
+        return ucs_map_union_incremental(map, other);
+    }
+
+    size_t const size = map->size + other->size;
+
+    ucs_map_subtree a = {.root = map->root,
+                         .height = ucs_map_tree_height(map->root)},
+                    b = {.root = NULL};
+
+    if(!ucs_map_tree_take(map, other, &b)) {
+        return false;
+    }
+
+    map->root = NULL;
+    ucs_map_tree_assign(map,
+                        (other_first ? ucs_map_tree_join2(map, b, a)
+                                     : ucs_map_tree_join2(map, a, b)),
+                        size);
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map search interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+static ucs_map_node*
+ucs_map_avl_find(ucs_map map, ucs_map_search_key const* sk) {
+    ucs_map_node* node = link_(map->root);
+
+    for(size_t n = 0; (node != NULL) && (n != ucs_map_max_height); ++n) {
+        int cmp = key_cmp_(sk, node);
+        if(cmp == 0) {
+            return node;
+        }
+
+        node = child_(node, (cmp > 0) ? 1 : 0);
+    }
+
+    return NULL;
+}
+
+static ucs_map_node*
+ucs_map_avl_lower_bound(ucs_map map, ucs_map_search_key const* sk) {
+    ucs_map_node* node = link_(map->root);
+    ucs_map_node* bound = NULL;
+
+    for(size_t n = 0; (node != NULL) && (n != ucs_map_max_height); ++n) {
+        int cmp = key_cmp_(sk, node);
+        if(cmp > 0) {
+            node = child_(node, 1);
+        } else {
+            bound = node;
+
+            if(cmp == 0) {
+                break;
+            }
+
+            node = child_(node, 0);
+        }
+    }
+
+    return bound;
+}
+
+static ucs_map_iterator
+ucs_map_key_find(ucs_map map, ucs_map_key k) {
+    if(is_btree_(map)) {
+        return ucs_map_btree_find(map, k);
+    }
+
+    ucs_map_search_key sk = ucs_map_search_key_make(map, k);
+    return ucs_map_search(map, ucs_map_avl_find, &sk);
+}
+
+static ucs_map_iterator
+ucs_map_key_lower_bound(ucs_map map, ucs_map_key k) {
+    if(is_btree_(map)) {
+        return ucs_map_btree_lower_bound(map, k);
+    }
+
+    ucs_map_search_key sk = ucs_map_search_key_make(map, k);
+    return ucs_map_search(map, ucs_map_avl_lower_bound, &sk);
+}
+
+ucs_map_iterator
+ucs_map_find(ucs_map map, ucs_map_key k) {
+    instrument_(map, map->depth = 0);
+    ucs_map_iterator i = ucs_map_key_find(map, k);
+    instrument_(map, ucs_map_record_descent(map, &map->stats.find));
+
+    return i;
+}
+
+ucs_map_iterator
+ucs_map_lower_bound(ucs_map map, ucs_map_key k) {
+    instrument_(map, map->depth = 0);
+    ucs_map_iterator i = ucs_map_key_lower_bound(map, k);
+    instrument_(map, ucs_map_record_descent(map, &map->stats.find));
+
+    return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map order statistics interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+size_t
+ucs_map_size(ucs_map map) {
+    return map->size;
+}
+
+ucs_map_iterator
+ucs_map_select(ucs_map map, size_t k) {
+    if(k >= map->size) {
+        return NULL;
+    }
+
+    if(!has_counts_(map)) {
+        ucs_map_iterator i = NULL;
+
+        if(k < (map->size / 2)) {
+            for(i = ucs_map_lower(map); k != 0; --k) {
+                i = ucs_map_iterator_next(i);
+            }
+        } else {
+            for(i = ucs_map_upper(map), k = map->size - k - 1; k != 0; --k) {
+                i = ucs_map_iterator_prev(i);
+            }
+        }
+
+        return i;
+    }
+
+    ucs_map_node* node = map->root;
+
+    while(node != NULL) {
+        size_t count = count_(node->children[0]);
+
+        if(k == count) {
+            break;
+        }
+
+        if(k < count) {
+            node = node->children[0];
+        } else {
+            k -= count + 1;
+            node = node->children[1];
+        }
+    }
+
+    return node;
+}
+
+size_t
+ucs_map_rank(ucs_map map, ucs_map_key k) {
+    size_t rank = 0;
+
+    if(!has_counts_(map)) {
+        for(ucs_map_iterator i = ucs_map_lower(map); i != NULL;
+            i = ucs_map_iterator_next(i), ++rank) {
+            ucs_map_key x = map->key_get_fn(ucs_map_iterator_mem(i));
+
+            instrument_(map, map->stats.comparison_count++);
+            if(map->key_cmp_fn(k, x) <= 0) {
+                break;
+            }
+        }
+
+        return rank;
+    }
+
+    ucs_map_search_key sk = ucs_map_search_key_make(map, k);
+    for(ucs_map_node* node = map->root; node != NULL;) {
+        if(key_cmp_(&sk, node) > 0) {
+            rank += count_(node->children[0]) + 1;
+            node = node->children[1];
+        } else {
+            node = node->children[0];
+        }
+    }
+
+    return rank;
+}
+
+size_t
+ucs_map_iterator_rank(ucs_map map, ucs_map_iterator i) {
+    ucs_map_node* node = i;
+    size_t rank = 0;
+
+    if(node == NULL) {
+        return map->size;
+    }
+
+    if(!has_counts_(map)) {
+        for(node = ucs_map_iterator_prev(node); node != NULL;
+            node = ucs_map_iterator_prev(node), ++rank) {
+        }
+
+        return rank;
+    }
+
+    rank = count_(child_(node, 0));
+    for(ucs_map_node* parent = parent_(node); parent != NULL;
+        node = parent, parent = parent_(node)) {
+        ucs_map_node* sibling = child_(parent, 0);
+
+        if(sibling != node) {
+            rank += count_(sibling) + 1;
+        }
+    }
+
+    return rank;
+}
+
+size_t
+ucs_map_count(ucs_map map, ucs_map_key lo, ucs_map_key hi) {
+    size_t rank_lo = ucs_map_rank(map, lo), rank_hi = ucs_map_rank(map, hi);
+    return ((rank_hi > rank_lo) ? (rank_hi - rank_lo) : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map iteration interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+ucs_map_iterator
+ucs_map_lower(ucs_map map) {
+    if(is_btree_(map)) {
+        return ucs_map_btree_lower(map);
+    }
+
+    return link_(map->lower);
+}
+
+ucs_map_iterator
+ucs_map_upper(ucs_map map) {
+    if(is_btree_(map)) {
+        return ucs_map_btree_upper(map);
+    }
+
+    return link_(map->upper);
+}
+
+ucs_map_iterator
+ucs_map_iterator_next(ucs_map_iterator i) {
+    if(is_btree_iterator_(i)) {
+        return ucs_map_btree_iterator_next(i);
+    }
+
+    ucs_map_node* node = (ucs_map_node*)(i);
+
+    // Note: the loops are bounded by the maximum height of the tree, so that
+    // concurrent readers can not be trapped by a tree which is being modified.
+    if(node != NULL) {
+        size_t n = 0;
+
+        ucs_map_node* next = child_(node, 1);
+
+        if(next != NULL) {
+            do {
+                node = next;
+            } while(((next = child_(node, 0)) != NULL) &&
+                     (++n != ucs_map_max_height));
+        } else {
+            ptrdiff_t child_i = 0;
+
+            do {
+                ucs_map_node* parent = parent_(node);
+                child_i = ucs_map_node_child_idx(node, parent);
+                node = parent;
+            } while((child_i != 0) && (node != NULL) &&
+                     (++n != ucs_map_max_height));
+        }
+    }
+
+    return node;
+}
+
+ucs_map_iterator
+ucs_map_iterator_prev(ucs_map_iterator i) {
+    if(is_btree_iterator_(i)) {
+        return ucs_map_btree_iterator_prev(i);
+    }
+
+    ucs_map_node* node = (ucs_map_node*)(i);
+
+    // Note: the loops are bounded (see ucs_map_iterator_next).
+    if(node != NULL) {
+        size_t n = 0;
+
+        ucs_map_node* next = child_(node, 0);
+
+        if(next != NULL) {
+            do {
+                node = next;
+            } while(((next = child_(node, 1)) != NULL) &&
+                     (++n != ucs_map_max_height));
+        } else {
+            ptrdiff_t child_i = 0;
+
+            do {
+                ucs_map_node* parent = parent_(node);
+                child_i = ucs_map_node_child_idx(node, parent);
+                node = parent;
+            } while((child_i != 1) && (node != NULL) &&
+                     (++n != ucs_map_max_height));
+        }
+    }
+
+    return node;
+}
+
+char*
+ucs_map_iterator_mem(ucs_map_iterator i) {
+    if(is_btree_iterator_(i)) {
+        return slot_mem_(iterator_slot_(i));
+    }
+
+    return node_mem_((ucs_map_node*)(i));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map cursor interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+ucs_map_cursor
+ucs_map_cursor_at(ucs_map map, ucs_map_key k) {
+    return (ucs_map_cursor){.m00_ = ucs_map_lower_bound(map, k)};
+}
+
+ucs_map_cursor
+ucs_map_cursor_from_iterator(ucs_map_iterator i) {
+    return (ucs_map_cursor){.m00_ = i};
+}
+
+ucs_map_iterator
+ucs_map_cursor_iterator(ucs_map_cursor c) {
+    return c.m00_;
+}
+
+static inline void
+ucs_map_cursor_store(ucs_map map, char* buffer, char** elements, size_t k,
+                     char* mem) {
+    if(buffer != NULL) {
+        memcpy(buffer + k * map->element_size, mem, map->element_size);
+    } else {
+        elements[k] = mem;
+    }
+}
+
+static size_t
+ucs_map_cursor_walk(ucs_map map, ucs_map_cursor* c, char* buffer,
+                    char** elements, size_t n) {
+    // Reads up to {n} elements to either {buffer} or {elements}.
+
+    ucs_map_iterator i = c->m00_;
+    size_t k = 0;
+
+    if((i == NULL) || (n == 0)) {
+        return 0;
+    }
+
+    if(is_btree_iterator_(i)) {
+        // B-tree's nodes hold many items, so iteration rarely follows parent
+        // links.
+        for(; (i != NULL) && (k != n); i = ucs_map_iterator_next(i), ++k) {
+            ucs_map_cursor_store(
+                map, buffer, elements, k, ucs_map_iterator_mem(i));
+        }
+
+        c->m00_ = i;
+        return k;
+    }
+
+    // The stack holds the nodes which are read next, in reverse order: the
+    // first node, and its ancestors whose left subtrees contain it. Note: the
+    // loops are bounded (see ucs_map_iterator_next).
+    ucs_map_node* stack[ucs_map_max_height + 1];
+    size_t top = 0;
+
+    ucs_map_node* node = i;
+    for(size_t j = 0; j != ucs_map_max_height; ++j) {
+        ucs_map_node* parent = parent_(node);
+        if(parent == NULL) {
+            break;
+        }
+
+        if(ucs_map_node_child_idx(node, parent) == 0) {
+            stack[top++] = parent;
+        }
+
+        node = parent;
+    }
+
+    for(size_t j = 0; j != (top / 2); ++j) {
+        node = stack[j];
+        stack[j] = stack[top - 1 - j];
+        stack[top - 1 - j] = node;
+    }
+
+    stack[top++] = i;
+
+    while((top != 0) && (k != n)) {
+        node = stack[--top];
+        ucs_map_cursor_store(map, buffer, elements, k++, node_mem_(node));
+
+        // Push the leftmost path of the right subtree, and prefetch the right
+        // subtree of the node which is read next.
+        for(node = child_(node, 1);
+            (node != NULL) && (top != ucs_map_max_height + 1);
+            node = child_(node, 0)) {
+            stack[top++] = node;
+        }
+
+        if(top != 0) {
+            prefetch_(child_(stack[top - 1], 1));
+        }
+    }
+
+    c->m00_ = ((top != 0) ? stack[top - 1] : NULL);
+    return k;
+}
+
+size_t
+ucs_map_cursor_read(ucs_map map, ucs_map_cursor* c, char* buffer, size_t n) {
+    return ucs_map_cursor_walk(map, c, buffer, NULL, n);
+}
+
+size_t
+ucs_map_cursor_read_ptrs(
+    ucs_map map, ucs_map_cursor* c, char** elements, size_t n) {
+    return ucs_map_cursor_walk(map, c, NULL, elements, n);
+}
 
-            ucs_map_node_link(node, inserted_node, child_i);
-            ucs_map_rebalance(map, node, child_i, ucs_map_rebalance_insert);
+////////////////////////////////////////////////////////////////////////////////
+// Map concurrency interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+ucs_map_read_section
+ucs_map_read_begin(ucs_map map) {
+    ucs_map_concurrent_state* state = map->concurrent;
+    size_t const stripe = ucs_map_reader_stripe_idx();
+
+    while(true) {
+        size_t epoch = atomic_load(&state->epoch);
+        atomic_size_t* count = &state->readers[epoch % 2][stripe].count;
 
-            return inserted_node;
+        atomic_fetch_add(count, 1);
+
+        // Writer might have advanced the epoch and checked the counters
+        // before the registration: retry in that case.
+        if(atomic_load(&state->epoch) == epoch) {
+            return (ucs_map_read_section){
+                .m00_ = epoch,
+                .m01_ = stripe,
+                .m02_ = atomic_load_explicit(
+                    &state->version, memory_order_acquire)};
         }
+
+        atomic_fetch_sub(count, 1);
     }
+}
 
-    return NULL;
+void
+ucs_map_read_end(ucs_map map, ucs_map_read_section const* s) {
+    atomic_fetch_sub_explicit(
+        &map->concurrent->readers[s->m00_ % 2][s->m01_].count, 1,
+        memory_order_release);
 }
 
 bool
-ucs_map_remove(ucs_map map, ucs_map_key k) {
-    return ucs_map_remove_by_iterator(map, ucs_map_find(map, k));
+ucs_map_read_validate(ucs_map map, ucs_map_read_section const* s) {
+    atomic_thread_fence(memory_order_acquire);
+
+    return ((s->m02_ % 2) == 0) &&
+           (atomic_load_explicit(&map->concurrent->version,
+                                 memory_order_relaxed) == s->m02_);
 }
 
 bool
-ucs_map_remove_by_iterator(ucs_map map, ucs_map_iterator i) {
-    ucs_map_node* node = i;
+ucs_map_reclaim(ucs_map map) {
+    ucs_map_concurrent_state* state = map->concurrent;
 
-    if(node == NULL) {
+    // Nodes which were retired in the previous epoch can be freed once all
+    // readers which registered in that epoch finish. Readers of the current
+    // epoch could not have reached them.
+    size_t epoch = atomic_load_explicit(&state->epoch, memory_order_relaxed);
+    size_t parity = (epoch + 1) % 2;
+
+    if(!ucs_map_readers_drained(state, parity)) {
         return false;
     }
 
-    ptrdiff_t child_i = child_idx_(node);
-    if((node->children[0] == NULL) || (node->children[1] == NULL)) {
-        // Node has at most one child.
+    ucs_map_limbo* limbo = &state->limbo[parity];
+    for(size_t i = 0; i != limbo->size; ++i) {
+        ucs_allocator_free(map->allocator, limbo->mem[i]);
+    }
 
-        ucs_map_node* next = // Select non-null child (if any).
-            ((node->children[0] != NULL) ? node->children[0]
-                                         : node->children[1]);
+    limbo->size = 0;
+    atomic_store(&state->epoch, epoch + 1);
 
-        if(map->root == node) {
-            if((map->root = next) != NULL) {
-                next->parent = NULL;
-            }
-        } else {
-            ucs_map_node_link(node->parent, next, child_i);
-            ucs_map_rebalance(
-                map, node->parent, child_i, ucs_map_rebalance_remove);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map statistics interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+ucs_map_statistics
+ucs_map_stats(ucs_map map) {
+#ifdef UCS_MAP_INSTRUMENTATION
+    ucs_map_statistics stats = map->stats;
+#else
+    ucs_map_statistics stats = {.height = 0};
+#endif
+
+    // Follow the taller subtrees (all leaves of a B-tree are at the same
+    // depth).
+    if(is_btree_(map)) {
+        for(ucs_map_bnode* node = map->broot; node != NULL; ++stats.height) {
+            node = (is_leaf_(node) ? NULL : node->children[0]);
         }
     } else {
-        // Node has two children.
-
-        // Find in-order successor.
-        ucs_map_node* next = node->children[1];
-        for(; next->children[0] != NULL; next = next->children[0]) {
+        for(ucs_map_node* node = map->root; node != NULL; ++stats.height) {
+            node = node->children[(balance_(node) > 0) ? 1 : 0];
         }
+    }
 
-        // Update map's root if needed.
-        if(map->root == node) {
-            map->root = next;
-        }
+    return stats;
+}
 
-        // Update in-order successor's links and rebalance the tree.
-        ucs_map_node_link(next, node->children[0], 0);
-        next->balance = node->balance;
+void
+ucs_map_stats_reset(ucs_map map) {
+#ifdef UCS_MAP_INSTRUMENTATION
+    map->stats = (ucs_map_statistics){.height = 0};
+#else
+    (void)(map);
+#endif
+}
 
-        if(next->parent == node) {
-            ucs_map_node_link(node->parent, next, child_i);
-            ucs_map_rebalance(map, next, 1, ucs_map_rebalance_remove);
-        } else {
-            ucs_map_node* parent_next = next->parent;
-            ptrdiff_t child_i_next = child_idx_(next);
+////////////////////////////////////////////////////////////////////////////////
+// Frozen map data types.
+////////////////////////////////////////////////////////////////////////////////
 
-            ucs_map_node_link(parent_next, next->children[1], child_i_next);
-            ucs_map_node_link(node->parent, next, child_i);
-            ucs_map_node_link(next, node->children[1], 1);
-            ucs_map_rebalance(
-                map, parent_next, child_i_next, ucs_map_rebalance_remove);
+struct ucs_map_frozen {
+    // Elements (and their keys' prefixes, if the map has a key prefix
+    // function) are stored in Eytzinger order: the children of the element
+    // with index i have indices 2i and 2i + 1. Index 0 is not used.
+    char* elements;
+    uint64_t* prefixes;
+    size_t size, element_size, element_stride, alignment;
+
+    ucs_map_key_get_fn key_get_fn;
+    ucs_map_key_cmp_fn key_cmp_fn;
+    ucs_map_key_prefix_fn key_prefix_fn;
+
+    // Source of frozen map's memory.
+    ucs_allocator_upstream upstream;
+    size_t allocation_size;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Frozen map utility functions.
+////////////////////////////////////////////////////////////////////////////////
+
+static size_t
+ucs_map_trailing_ones(size_t x) {
+#ifdef __GNUC__
+    return ((~x == 0) ? (sizeof(size_t) * 8)
+                      : (size_t)(__builtin_ctzll((unsigned long long)(~x))));
+#else
+    size_t n = 0;
+    for(; (x & 1) != 0; x >>= 1) {
+        ++n;
+    }
+
+    return n;
+#endif
+}
+
+#define frozen_mem_(frozen, i) \
+    ((frozen)->elements + (i) * (frozen)->element_stride)
+
+// Header of frozen map's image. All fields have fixed width, so the header
+// has no padding. Offsets are relative to the beginning of the image, and are
+// multiples of the image's alignment. Prefixes' offset is zero if the image
+// has no prefixes.
+typedef struct ucs_map_frozen_header {
+    char magic[8];
+    uint32_t version, byte_order;
+    uint64_t size, element_size, element_stride, alignment;
+    uint64_t prefixes_offset, elements_offset, image_size;
+} ucs_map_frozen_header;
+
+static char const ucs_map_frozen_magic[8] = "ucsmapf";
+
+enum {
+    ucs_map_frozen_version = 1,
+    ucs_map_frozen_byte_order = 0x01020304
+};
+
+static_assert(sizeof(ucs_map_frozen_header) == 72, "");
+static_assert((size_t)(ucs_map_frozen_image_alignment) ==
+                  (size_t)(ucs_map_cache_line_size),
+              "");
+
+static uint64_t
+ucs_map_frozen_pad(uint64_t size, uint64_t alignment) {
+    return ((size + alignment - 1) / alignment) * alignment;
+}
+
+static ucs_map_frozen_header
+ucs_map_frozen_header_make(uint64_t size, uint64_t element_size,
+                           uint64_t element_stride, uint64_t alignment,
+                           bool has_prefixes) {
+    uint64_t const n = size + 1;
+    ucs_map_frozen_header h = {.version = ucs_map_frozen_version,
+                               .byte_order = ucs_map_frozen_byte_order,
+                               .size = size,
+                               .element_size = element_size,
+                               .element_stride = element_stride,
+                               .alignment = alignment};
+
+    memcpy(h.magic, ucs_map_frozen_magic, sizeof(h.magic));
+
+    h.elements_offset = ucs_map_frozen_pad(sizeof(h), h.alignment);
+    if(has_prefixes) {
+        h.prefixes_offset = h.elements_offset;
+        h.elements_offset = ucs_map_frozen_pad(
+            h.prefixes_offset + n * sizeof(uint64_t), h.alignment);
+    }
+
+    h.image_size = h.elements_offset + n * h.element_stride;
+    return h;
+}
+
+static bool
+ucs_map_frozen_write_zeros(FILE* file, uint64_t n) {
+    static char const zeros[ucs_map_cache_line_size];
+
+    for(; n != 0;) {
+        size_t k = ((n < sizeof(zeros)) ? (size_t)(n) : sizeof(zeros));
+        if(fwrite(zeros, 1, k, file) != k) {
+            return false;
         }
+
+        n -= k;
     }
 
-    ucs_map_node_free(map, node);
     return true;
 }
 
+typedef struct ucs_map_frozen_source {
+    ucs_map_frozen frozen;
+    ucs_map_frozen_iterator i;
+} ucs_map_frozen_source;
+
+static ucs_map_node*
+ucs_map_node_source_frozen(ucs_map map, void* context) {
+    ucs_map_frozen_source* source = context;
+    ucs_map_node* node = ucs_map_node_alloc(map);
+
+    if(node != NULL) {
+        memcpy(node_mem_(node), frozen_mem_(source->frozen, source->i),
+               map->element_size);
+
+        if(has_prefixes_(map)) {
+            node_prefix_(map, node) =
+                map->key_prefix_fn(map->key_get_fn(node_mem_(node)));
+        }
+
+        source->i = ucs_map_frozen_next(source->frozen, source->i);
+    }
+
+    return node;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
-// Map search interface implementation.
+// Frozen map creation/destruction interface implementation.
 ////////////////////////////////////////////////////////////////////////////////
 
-ucs_map_iterator
-ucs_map_find(ucs_map map, ucs_map_key k) {
-    ucs_map_node* node = map->root;
+ucs_map_frozen
+ucs_map_freeze(ucs_map map) {
+#define max_(x, y) (((x) > (y)) ? (x) : (y))
 
-    while(node != NULL) {
-        if(key_eq_(k, node)) {
-            break;
+    size_t const alignment =
+        max_(max_(map->element_alignment, alignof(struct ucs_map_frozen)),
+             ucs_map_cache_line_size);
+
+#undef max_
+
+#define pad_(size, alignment)                                       \
+    if(true) {                                                      \
+        size_t d = (size) % (alignment);                            \
+        if((d != 0) && (((size) += (alignment)-d) < (alignment))) { \
+            return NULL;                                            \
+        }                                                           \
+    }
+
+#define add_(x, y)           \
+    if(((x) += (y)) < (y)) { \
+        return NULL;         \
+    }
+
+#define mul_(x, y)                                    \
+    if(((y) != 0) && ((((x) * (y)) / (y)) != (x))) { \
+        return NULL;                                  \
+    }
+
+    // Memory layout: frozen map's header, prefixes, elements.
+    size_t const n = map->size + 1;
+
+    size_t element_stride = map->element_size;
+    pad_(element_stride, map->element_alignment);
+
+    size_t allocation_size = sizeof(struct ucs_map_frozen);
+    pad_(allocation_size, alignment);
+
+    size_t const prefixes_offset = allocation_size;
+    if(has_prefixes_(map)) {
+        mul_(n, sizeof(uint64_t));
+        add_(allocation_size, n * sizeof(uint64_t));
+        pad_(allocation_size, alignment);
+    }
+
+    size_t const elements_offset = allocation_size;
+    mul_(n, element_stride);
+    add_(allocation_size, n * element_stride);
+    pad_(allocation_size, alignment);
+
+#undef mul_
+#undef add_
+#undef pad_
+
+    char* mem =
+        ucs_allocator_upstream_alloc(map->upstream, allocation_size, alignment);
+    if(mem == NULL) {
+        return NULL;
+    }
+
+    ucs_map_frozen frozen = (ucs_map_frozen)(mem);
+    *frozen = (struct ucs_map_frozen){
+        .elements = mem + elements_offset,
+        .prefixes = (has_prefixes_(map) ? (uint64_t*)(mem + prefixes_offset)
+                                        : NULL),
+        .size = map->size,
+        .element_size = map->element_size,
+        .element_stride = element_stride,
+        .alignment = alignment,
+        .key_get_fn = map->key_get_fn,
+        .key_cmp_fn = map->key_cmp_fn,
+        .key_prefix_fn = map->key_prefix_fn,
+        .upstream = map->upstream,
+        .allocation_size = allocation_size};
+
+    // Copy map's elements in key order to their positions in Eytzinger order.
+    ucs_map_frozen_iterator j = ucs_map_frozen_lower(frozen);
+
+    for(ucs_map_iterator i = ucs_map_lower(map); i != NULL;
+        i = ucs_map_iterator_next(i), j = ucs_map_frozen_next(frozen, j)) {
+        char* element = frozen_mem_(frozen, j);
+        memcpy(element, ucs_map_iterator_mem(i), map->element_size);
+
+        if(frozen->prefixes != NULL) {
+            frozen->prefixes[j] =
+                map->key_prefix_fn(map->key_get_fn(element));
         }
+    }
+
+    return frozen;
+}
 
-        node = node->children[(ptrdiff_t)key_gt_(k, node)];
+void
+ucs_map_frozen_destroy(ucs_map_frozen frozen) {
+    if(frozen != NULL) {
+        ucs_allocator_upstream_free(
+            frozen->upstream, frozen, frozen->allocation_size);
     }
+}
 
-    return node;
+bool
+ucs_map_thaw(ucs_map map, ucs_map_frozen frozen) {
+    if(frozen->element_size != map->element_size) {
+        return false;
+    }
+
+    ucs_map_clear(map);
+
+    ucs_map_frozen_source source = {.frozen = frozen,
+                                    .i = ucs_map_frozen_lower(frozen)};
+
+    if(is_btree_(map)) {
+        for(; source.i != 0;
+            source.i = ucs_map_frozen_next(frozen, source.i)) {
+            char* element = frozen_mem_(frozen, source.i);
+            ucs_map_iterator i =
+                ucs_map_btree_insert(map, map->key_get_fn(element));
+
+            if(i == NULL) {
+                ucs_map_clear(map);
+                return false;
+            }
+
+            memcpy(ucs_map_iterator_mem(i), element, map->element_size);
+        }
+
+        return true;
+    }
+
+    return ucs_map_build_content(
+        map, frozen->size, ucs_map_node_source_frozen, &source);
 }
 
-ucs_map_iterator
-ucs_map_lower_bound(ucs_map map, ucs_map_key k) {
-    ucs_map_node* node = map->root;
-    ucs_map_node* prev = node;
+////////////////////////////////////////////////////////////////////////////////
+// Frozen map search interface implementation.
+////////////////////////////////////////////////////////////////////////////////
 
-    while(node != NULL) {
-        if(key_eq_(k, node)) {
-            return node;
+size_t
+ucs_map_frozen_size(ucs_map_frozen frozen) {
+    return frozen->size;
+}
+
+// Returns 1 if the given key is greater than i-th element of the frozen map
+// (the descent turns right), or 0 otherwise. Key comparison function is called
+// only if the prefixes are equal (or the map has no prefixes).
+static inline size_t
+ucs_map_frozen_turn(ucs_map_frozen frozen, ucs_map_key k, uint64_t prefix,
+                    size_t i) {
+    if(frozen->prefixes != NULL) {
+        uint64_t p = frozen->prefixes[i];
+        if(p != prefix) {
+            return (p < prefix);
+        }
+    }
+
+    return (frozen->key_cmp_fn(
+                k, frozen->key_get_fn(frozen_mem_(frozen, i))) > 0);
+}
+
+ucs_map_frozen_iterator
+ucs_map_frozen_lower_bound(ucs_map_frozen frozen, ucs_map_key k) {
+    // Descends the implicit tree without branches on comparison results: the
+    // index of the next element is 2i for a left turn and 2i + 1 for a right
+    // turn. Descendants several levels below the current element are adjacent
+    // in memory, so all their cache lines are prefetched in advance: prefixes
+    // of 16 descendants (two lines), or elements of up to 16 descendants which
+    // fit in four lines. The arrays have {n} entries, and the last levels,
+    // whose descendants would be past the end, are descended without
+    // prefetching (addresses past the end are never formed).
+
+    size_t i = 1;
+    size_t const n = frozen->size + 1;
+    uint64_t const prefix =
+        ((frozen->prefixes != NULL) ? frozen->key_prefix_fn(k) : 0);
+
+    if(frozen->prefixes != NULL) {
+        for(; (16 * i + 8) < n;
+            i = 2 * i + ucs_map_frozen_turn(frozen, k, prefix, i)) {
+            prefetch_(frozen->prefixes + 16 * i);
+            prefetch_(frozen->prefixes + 16 * i + 8);
+        }
+    } else {
+        size_t d = 16;
+        while((d > 2) && ((d * frozen->element_stride) >
+                          (4 * (size_t)(ucs_map_cache_line_size)))) {
+            d /= 2;
+        }
+
+        for(; (d * i + d) <= n;
+            i = 2 * i + ucs_map_frozen_turn(frozen, k, prefix, i)) {
+            char* mem = frozen_mem_(frozen, d * i);
+            for(size_t offset = 0; offset < (d * frozen->element_stride);
+                offset += ucs_map_cache_line_size) {
+                prefetch_(mem + offset);
+            }
         }
+    }
 
-        prev = node;
-        node = node->children[(ptrdiff_t)key_gt_(k, node)];
+    while(i < n) {
+        i = 2 * i + ucs_map_frozen_turn(frozen, k, prefix, i);
     }
 
-    if(prev != NULL) {
-        return (key_lt_(k, prev) ? prev : ucs_map_iterator_next(prev));
+    // The last left turn was made at the lower bound: cancel all subsequent
+    // right turns and that left turn. Zero means that there was no left turn.
+    return i >> (ucs_map_trailing_ones(i) + 1);
+}
+
+ucs_map_frozen_iterator
+ucs_map_frozen_find(ucs_map_frozen frozen, ucs_map_key k) {
+    ucs_map_frozen_iterator i = ucs_map_frozen_lower_bound(frozen, k);
+
+    if((i != 0) &&
+       (frozen->key_cmp_fn(k, frozen->key_get_fn(frozen_mem_(frozen, i))) !=
+        0)) {
+        i = 0;
     }
 
-    return NULL;
+    return i;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Map iteration interface implementation.
+// Frozen map iteration interface implementation.
 ////////////////////////////////////////////////////////////////////////////////
 
-ucs_map_iterator
-ucs_map_lower(ucs_map map) {
-    ucs_map_node* node = map->root;
+ucs_map_frozen_iterator
+ucs_map_frozen_lower(ucs_map_frozen frozen) {
+    size_t i = 0;
 
-    if(node != NULL) {
-        for(; node->children[0] != NULL; node = node->children[0]) {
+    if(frozen->size != 0) {
+        for(i = 1; (2 * i) <= frozen->size; i *= 2) {
         }
     }
 
-    return node;
+    return i;
 }
 
-ucs_map_iterator
-ucs_map_upper(ucs_map map) {
-    ucs_map_node* node = map->root;
+ucs_map_frozen_iterator
+ucs_map_frozen_upper(ucs_map_frozen frozen) {
+    size_t i = 0;
 
-    if(node != NULL) {
-        for(; node->children[1] != NULL; node = node->children[1]) {
+    if(frozen->size != 0) {
+        for(i = 1; (2 * i + 1) <= frozen->size; i = 2 * i + 1) {
         }
     }
 
-    return node;
+    return i;
 }
 
-ucs_map_iterator
-ucs_map_iterator_next(ucs_map_iterator i) {
-    ucs_map_node* node = (ucs_map_node*)(i);
+ucs_map_frozen_iterator
+ucs_map_frozen_next(ucs_map_frozen frozen, ucs_map_frozen_iterator i) {
+    if(i == 0) {
+        return 0;
+    }
 
-    if(node != NULL) {
-        if(node->children[1] != NULL) {
-            for(node = node->children[1]; node->children[0] != NULL;
-                node = node->children[0]) {
-            }
-        } else {
-            ptrdiff_t child_i = 0;
+    // Leftmost element of the right subtree, or the closest ancestor whose
+    // left subtree contains the element.
+    if((2 * i + 1) <= frozen->size) {
+        for(i = 2 * i + 1; (2 * i) <= frozen->size; i *= 2) {
+        }
 
-            do {
-                child_i = child_idx_(node);
-                node = node->parent;
-            } while((child_i != 0) && (node != NULL));
+        return i;
+    }
+
+    return i >> (ucs_map_trailing_ones(i) + 1);
+}
+
+ucs_map_frozen_iterator
+ucs_map_frozen_prev(ucs_map_frozen frozen, ucs_map_frozen_iterator i) {
+    if(i == 0) {
+        return 0;
+    }
+
+    // Rightmost element of the left subtree, or the closest ancestor whose
+    // right subtree contains the element.
+    if((2 * i) <= frozen->size) {
+        for(i = 2 * i; (2 * i + 1) <= frozen->size; i = 2 * i + 1) {
         }
+
+        return i;
     }
 
-    return node;
+    for(; (i & 1) == 0; i >>= 1) {
+    }
+
+    return i >> 1;
 }
 
-ucs_map_iterator
-ucs_map_iterator_prev(ucs_map_iterator i) {
-    ucs_map_node* node = (ucs_map_node*)(i);
+char const*
+ucs_map_frozen_mem(ucs_map_frozen frozen, ucs_map_frozen_iterator i) {
+    return frozen_mem_(frozen, i);
+}
 
-    if(node != NULL) {
-        if(node->children[0] != NULL) {
-            for(node = node->children[0]; node->children[1] != NULL;
-                node = node->children[1]) {
-            }
-        } else {
-            ptrdiff_t child_i = 0;
+////////////////////////////////////////////////////////////////////////////////
+// Frozen map serialization interface implementation.
+////////////////////////////////////////////////////////////////////////////////
 
-            do {
-                child_i = child_idx_(node);
-                node = node->parent;
-            } while((child_i != 1) && (node != NULL));
+bool
+ucs_map_frozen_save(ucs_map_frozen frozen, FILE* file) {
+    ucs_map_frozen_header const h = ucs_map_frozen_header_make(
+        frozen->size, frozen->element_size, frozen->element_stride,
+        frozen->alignment, (frozen->prefixes != NULL));
+    uint64_t position = sizeof(h);
+
+    if(fwrite(&h, sizeof(h), 1, file) != 1) {
+        return false;
+    }
+
+    // Element with index 0 is not used, and is written as zeros.
+    if(frozen->prefixes != NULL) {
+        if(!ucs_map_frozen_write_zeros(
+               file, h.prefixes_offset - position + sizeof(uint64_t)) ||
+           (fwrite(frozen->prefixes + 1, sizeof(uint64_t), frozen->size,
+                   file) != frozen->size)) {
+            return false;
         }
+
+        position = h.prefixes_offset + (h.size + 1) * sizeof(uint64_t);
     }
 
-    return node;
+    if(!ucs_map_frozen_write_zeros(
+           file, h.elements_offset - position + h.element_stride) ||
+       (fwrite(frozen_mem_(frozen, 1), h.element_stride, frozen->size,
+               file) != frozen->size)) {
+        return false;
+    }
+
+    return (fflush(file) == 0);
 }
 
-char*
-ucs_map_iterator_mem(ucs_map_iterator i) {
-    return ((ucs_map_node*)(i))->mem;
+ucs_map_frozen
+ucs_map_frozen_open(ucs_map_config cfg, void const* image, size_t image_size) {
+    ucs_map_frozen_header h;
+    if((image_size < sizeof(h)) || (cfg.element_size == 0) ||
+       (cfg.element_alignment == 0)) {
+        return NULL;
+    }
+
+    memcpy(&h, image, sizeof(h));
+
+    // Check image's format, and its compatibility with the configuration.
+    uint64_t element_stride =
+        ucs_map_frozen_pad(cfg.element_size, cfg.element_alignment);
+
+    uint64_t alignment = ucs_map_frozen_image_alignment;
+    if(alignment < cfg.element_alignment) {
+        alignment = cfg.element_alignment;
+    }
+
+    if((memcmp(h.magic, ucs_map_frozen_magic, sizeof(h.magic)) != 0) ||
+       (h.version != ucs_map_frozen_version) ||
+       (h.byte_order != ucs_map_frozen_byte_order) ||
+       (h.element_size != cfg.element_size) ||
+       (h.element_stride != element_stride) || (h.alignment != alignment) ||
+       ((h.prefixes_offset != 0) != (cfg.key_prefix_fn != NULL)) ||
+       (((uintptr_t)(image) % alignment) != 0)) {
+        return NULL;
+    }
+
+    // Check that the arrays are within the image: the expected layout is
+    // recomputed from the number of elements, which is bounded by image's
+    // size (so that the computation does not overflow).
+    if((h.size >= (image_size / element_stride)) ||
+       ((h.prefixes_offset != 0) &&
+        (h.size >= (image_size / sizeof(uint64_t))))) {
+        return NULL;
+    }
+
+    ucs_map_frozen_header const expected =
+        ucs_map_frozen_header_make(h.size, h.element_size, element_stride,
+                                   alignment, (h.prefixes_offset != 0));
+
+    if((h.prefixes_offset != expected.prefixes_offset) ||
+       (h.elements_offset != expected.elements_offset) ||
+       (h.image_size != expected.image_size) || (h.image_size > image_size)) {
+        return NULL;
+    }
+
+    // Note: frozen map never modifies its memory.
+    ucs_allocator_upstream upstream = ucs_map_config_upstream(cfg);
+    ucs_map_frozen frozen =
+        ucs_allocator_upstream_alloc(upstream, sizeof(struct ucs_map_frozen),
+                                     alignof(struct ucs_map_frozen));
+    if(frozen != NULL) {
+        char* mem = (char*)(image);
+
+        *frozen = (struct ucs_map_frozen){
+            .elements = mem + h.elements_offset,
+            .prefixes = ((h.prefixes_offset != 0)
+                             ? (uint64_t*)(mem + h.prefixes_offset)
+                             : NULL),
+            .size = (size_t)(h.size),
+            .element_size = cfg.element_size,
+            .element_stride = (size_t)(element_stride),
+            .alignment = (size_t)(alignment),
+            .key_get_fn = cfg.key_get_fn,
+            .key_cmp_fn = cfg.key_cmp_fn,
+            .key_prefix_fn = cfg.key_prefix_fn,
+            .upstream = upstream,
+            .allocation_size = sizeof(struct ucs_map_frozen)};
+    }
+
+    return frozen;
 }
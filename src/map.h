@@ -10,6 +10,8 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Opaque types.
@@ -28,6 +30,89 @@ typedef void* ucs_map_iterator;
 typedef void (*ucs_map_key_set_fn)(ucs_map_key, char* mem);
 typedef ucs_map_key (*ucs_map_key_get_fn)(char* mem);
 typedef int (*ucs_map_key_cmp_fn)(ucs_map_key, ucs_map_key);
+typedef uint64_t (*ucs_map_key_prefix_fn)(ucs_map_key);
+
+typedef ucs_map_key (*ucs_map_key_next_fn)(void* context);
+
+////////////////////////////////////////////////////////////////////////////////
+// Batch operation type.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef enum ucs_map_batch_op_type {
+    ucs_map_batch_insert,
+    ucs_map_batch_remove
+} ucs_map_batch_op_type;
+
+typedef struct ucs_map_batch_op {
+    ucs_map_batch_op_type type;
+    ucs_map_key k;
+
+    // Result of the operation: inserted (or already existing) element for
+    // insertions, NULL for removals and failed insertions.
+    ucs_map_iterator i;
+} ucs_map_batch_op;
+
+////////////////////////////////////////////////////////////////////////////////
+// Map statistics type (see ucs_map_stats).
+////////////////////////////////////////////////////////////////////////////////
+
+enum { ucs_map_depth_histogram_size = 64 };
+
+typedef struct ucs_map_descent_statistics {
+    // Number of descents, and total number of nodes visited by them.
+    size_t count, depth;
+} ucs_map_descent_statistics;
+
+typedef struct ucs_map_statistics {
+    // Number of calls of the key comparison function.
+    size_t comparison_count;
+
+    // Descents of searches (ucs_map_find, ucs_map_lower_bound), insertions
+    // (ucs_map_insert, ucs_map_insert_hint), and removals by key.
+    ucs_map_descent_statistics find, insert, remove;
+
+    // Entry i is the number of descents which visited i nodes. The last entry
+    // also counts deeper descents.
+    size_t depth_histogram[ucs_map_depth_histogram_size];
+
+    // AVL maps: number of single rotations, and number of nodes visited while
+    // restoring balance after insertions and removals. B-tree maps: number of
+    // items moved to a node from its sibling, and number of node splits and
+    // merges.
+    size_t rotation_count, rebalance_step_count;
+
+    // Current number of levels of the tree.
+    size_t height;
+} ucs_map_statistics;
+
+////////////////////////////////////////////////////////////////////////////////
+// Map node type. It is exposed only for type-specialized maps (see
+// UCS_MAP_DEFINE), other code must treat it as opaque. Element's memory
+// immediately follows the node.
+//
+// If UCS_MAP_COMPACT_NODES is defined, then node's balance factor is stored in
+// the low bits of parent's address, which saves one word per node (24 bytes
+// instead of 32 on 64-bit platforms) at the cost of a few bit operations on
+// each access. The library and its users must be compiled with the same
+// setting.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef UCS_MAP_COMPACT_NODES
+
+typedef struct ucs_map_node {
+    alignas(8) uintptr_t parent_balance;
+    struct ucs_map_node* children[2];
+} ucs_map_node;
+
+#else
+
+typedef struct ucs_map_node {
+    struct ucs_map_node* parent;
+    struct ucs_map_node* children[2];
+    signed char balance;
+} ucs_map_node;
+
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 // Map's private structure.
@@ -37,12 +122,27 @@ struct ucs_map_private {
     ucs_allocator_object_storage m00_;
     ucs_allocator m01_;
 
-    void* m02_;
-    size_t m03_;
+    void *m02_, *m03_, *m04_;
+    size_t m05_, m06_, m07_, m08_;
+    unsigned m09_;
+
+    ucs_map_key_set_fn m10_;
+    ucs_map_key_get_fn m11_;
+    ucs_map_key_cmp_fn m12_;
+    ucs_map_key_prefix_fn m13_;
+
+    ucs_allocator_object_storage m14_;
+    ucs_allocator m15_;
+    void* m16_;
+
+    void* m17_;
+
+    ucs_allocator_upstream m18_;
 
-    ucs_map_key_set_fn m04_;
-    ucs_map_key_get_fn m05_;
-    ucs_map_key_cmp_fn m06_;
+#ifdef UCS_MAP_INSTRUMENTATION
+    ucs_map_statistics m19_;
+    size_t m20_;
+#endif
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -54,6 +154,10 @@ enum {
     ucs_map_object_size = sizeof(struct ucs_map_private)
 };
 
+// Default numbers of elements in the first and the largest memory blocks (see
+// {ucs_map_config::block_size}).
+enum { ucs_map_default_block_size = 16, ucs_map_default_max_block_size = 1024 };
+
 ////////////////////////////////////////////////////////////////////////////////
 // Map object storage type.
 ////////////////////////////////////////////////////////////////////////////////
@@ -66,14 +170,88 @@ typedef struct ucs_map_object_storage {
 // Map configuration.
 ////////////////////////////////////////////////////////////////////////////////
 
+// Map flags.
+enum {
+    // Each node stores the size of its subtree. This makes order statistics
+    // interface run in O(log n) at the cost of one size_t per element.
+    ucs_map_flag_order_statistics = 0x01,
+
+    // The map is a B-tree with up to 15 elements per node, instead of an AVL
+    // tree. Elements are still allocated individually, and their addresses do
+    // not change while they are in the map. Keys' prefixes (see
+    // {ucs_map_config::key_prefix_fn}) are stored in B-tree nodes, so lookups
+    // which do not need to call key comparison function touch only a few cache
+    // lines per level. Items with equal prefixes (all items of a node, if the
+    // map has no prefix function) are searched with binary search. Note:
+    // without a prefix function each probe inside a node reads an element,
+    // which is stored out of line, so lookups gain little over an AVL tree.
+    // Cannot be combined with ucs_map_flag_order_statistics.
+    // Note: ucs_map_insert_hint ignores the hint, ucs_map_build_sorted and
+    // ucs_map_apply_batch insert elements one by one.
+    ucs_map_flag_btree = 0x02,
+
+    // The map can be read by any number of threads while a single thread
+    // modifies it (see Map concurrency interface). Cannot be combined with
+    // ucs_map_flag_btree.
+    ucs_map_flag_concurrent = 0x04,
+
+    // Memory blocks are backed by 2 MiB huge pages, where supported (see
+    // ucs_allocator_flag_huge_pages). Best combined with large blocks.
+    ucs_map_flag_huge_pages = 0x08
+};
+
 typedef struct ucs_map_config {
     size_t element_alignment, element_size;
+    unsigned flags;
 
     ucs_map_key_set_fn key_set_fn;
     ucs_map_key_get_fn key_get_fn;
     ucs_map_key_cmp_fn key_cmp_fn;
+
+    // Optional. Returns a fixed-width prefix of the given key, which must
+    // preserve keys' order: for any keys x and y, prefix(x) < prefix(y) must
+    // imply that x < y. Prefixes are stored along with the nodes, and the key
+    // comparison function is called only for nodes whose prefixes are equal to
+    // the prefix of the key being searched for. This saves a cache miss per
+    // comparison when keys are stored out of line (e.g. long strings).
+    ucs_map_key_prefix_fn key_prefix_fn;
+
+    // Optional. If set, then all memory of the map (its nodes, the map object
+    // if it is created with ucs_map_create, and auxiliary structures) is
+    // obtained from {region_fn} instead of the system allocator, and returned
+    // to {deallocate_fn} (see ucs_allocator_config). Insertions fail once
+    // {region_fn} returns NULL.
+    ucs_allocator_region_fn region_fn;
+    ucs_allocator_deallocate_fn deallocate_fn;
+    void* region_context;
+
+    // Optional. Number of elements in the first memory block, and in the
+    // largest one: each next block is twice as large as the previous one. If
+    // {block_size} is zero, then default values are used. If {max_block_size}
+    // is zero, then all blocks have the same size.
+    size_t block_size, max_block_size;
+
+    // Optional. Automatic release of unused node memory (see
+    // ucs_allocator_config and ucs_map_shrink_to_fit). Measured in elements.
+    size_t trim_high_watermark, trim_low_watermark;
+
+    // Optional. If set, then elements are allocated from the given allocator
+    // instead of map's own one (the options above are used only to create the
+    // latter). Maps which share an allocator exchange elements without copying
+    // them (see Map set operations interface). The allocator must outlive the
+    // map, and maps which share it must be used by one thread at a time.
+    // Cannot be combined with ucs_map_flag_btree. Note: clearing and
+    // destroying such maps take O(n).
+    // Requires: the allocator is created with ucs_map_allocator_config(cfg).
+    ucs_allocator allocator;
 } ucs_map_config;
 
+// Returns the configuration of the allocator of elements of a map with the
+// given configuration. Its {element_size} is zero if the configuration is
+// invalid.
+ucs_allocator_config
+ucs_map_allocator_config(ucs_map_config cfg);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Map creation/destruction interface.
 ////////////////////////////////////////////////////////////////////////////////
@@ -99,15 +277,160 @@ ucs_map_destroy(ucs_map map);
 void
 ucs_map_clear(ucs_map map);
 
+// Returns memory blocks which contain no elements to the system. Returns the
+// number of released bytes. Note: in concurrent maps, removed elements which
+// are not yet reclaimed (see ucs_map_reclaim) keep their blocks.
+size_t
+ucs_map_shrink_to_fit(ucs_map map);
+
+// Preallocates memory for {n} elements, so that insertions do not allocate
+// memory until the map contains {n} elements. Returns false if memory
+// allocation fails.
+bool
+ucs_map_reserve(ucs_map map, size_t n);
+
+typedef struct ucs_map_memory_statistics {
+    // Statistics of the allocators of elements and of B-tree nodes (the
+    // latter is zero-initialized for other maps).
+    ucs_allocator_statistics elements, bnodes;
+
+    // Total size of map's memory in bytes: blocks of both allocators, and
+    // auxiliary structures of concurrent maps (not counting the map object).
+    size_t total_size;
+} ucs_map_memory_statistics;
+
+// Runs in O(1). Note: the call must be synchronized with modifications of the
+// map. Statistics of a shared allocator (see ucs_map_config::allocator) also
+// count elements of other maps.
+ucs_map_memory_statistics
+ucs_map_memory_usage(ucs_map map);
+
 ucs_map_iterator
 ucs_map_insert(ucs_map map, ucs_map_key k);
 
+// Same as ucs_map_insert, but uses the given element (or the position past the
+// last element if {hint} is NULL) as a starting point of the search. Inserting
+// right before or right after the hint takes one or two comparisons, which
+// makes appending (hint is NULL or the last element) and inserting nearly
+// sorted sequences (hint is the previously inserted element) amortized O(1).
+// Otherwise the search takes O(log d) steps, where d is the distance between
+// the hint and the key.
+ucs_map_iterator
+ucs_map_insert_hint(ucs_map map, ucs_map_iterator hint, ucs_map_key k);
+
+// Replaces map's content with {n} elements whose keys are obtained by
+// successive calls to {next_fn}. Runs in O(n) without key comparisons, and
+// allocates elements in key order. Returns false (leaving the map empty) if
+// memory allocation fails.
+// Requires: keys are returned in strictly ascending order.
+bool
+ucs_map_build_sorted(ucs_map map, size_t n, ucs_map_key_next_fn next_fn,
+                     void* context);
+
+// Same as ucs_map_build_sorted, but the keys are read from an array: i-th key
+// is located at (char const*)(keys) + i * key_stride.
+bool
+ucs_map_build_sorted_array(ucs_map map, void const* keys, size_t key_stride,
+                           size_t n);
+
+// Applies the given operations in order. If the batch is at least as large as
+// the map, then the batch is merged with map's elements and the tree is rebuilt
+// in O(size + n). Otherwise the tree is split at the keys of the batch, and the
+// parts are joined back in O(n log(size / n + 1)). In both cases no
+// per-operation rebalancing is done. Concurrent maps apply the operations one
+// by one, each search starting from the position of the previous operation.
+// Returns false if some insertions failed due to memory allocation failure.
+// Requires: operations are sorted by key in ascending order. Note: iterator
+// returned for an insertion is invalidated by a later removal of the same key
+// in the same batch.
+bool
+ucs_map_apply_batch(ucs_map map, ucs_map_batch_op* ops, size_t n);
+
 bool
 ucs_map_remove(ucs_map map, ucs_map_key k);
 
 bool
 ucs_map_remove_by_iterator(ucs_map map, ucs_map_iterator i);
 
+// Removes the elements with keys in [lo, hi), and returns their number. The
+// covered subtrees are cut out of the tree with two splits and a join, which
+// rebalance the tree once and take O(log n), and their k nodes are freed in
+// O(k) (in O(1) if the whole map is removed, and the map does not share its
+// allocator). Note: B-tree and concurrent maps remove the elements one by one.
+size_t
+ucs_map_remove_range(ucs_map map, ucs_map_key lo, ucs_map_key hi);
+
+////////////////////////////////////////////////////////////////////////////////
+// Map set operations interface.
+//
+// Note: the operations work on whole trees: map's tree is split at the keys of
+// the other map, and the parts are joined back. An operation on maps with m
+// and n elements (m <= n) runs in O(m log(n/m + 1)), plus O(k) to free k
+// removed elements. Elements of {map} are kept in place (their iterators
+// remain valid). Subtrees which do not depend on each other are processed by
+// up to {thread_count} threads (the calling thread included).
+//
+// If either map is a B-tree or a concurrent map, then the operation is done
+// element by element instead. Instrumented maps (see ucs_map_stats) are
+// processed by a single thread.
+//
+// Requires: both maps are created with the same configuration (except for
+// memory sources), and {map} is not {other}.
+////////////////////////////////////////////////////////////////////////////////
+
+// Moves the elements of {other} whose keys are not in {map} to {map}, and
+// leaves {other} empty. If the maps share an allocator (see
+// ucs_map_config::allocator), then the elements are moved without copying
+// (and keep their addresses), otherwise they are copied to map's memory.
+// Returns false if memory allocation fails: both maps are left unchanged,
+// except that a B-tree map may have received some of the elements.
+bool
+ucs_map_union(ucs_map map, ucs_map other, size_t thread_count);
+
+// Removes the elements of {map} whose keys are not in {other}. {other} is not
+// modified.
+void
+ucs_map_intersection(ucs_map map, ucs_map other, size_t thread_count);
+
+// Removes the elements of {map} whose keys are in {other}. {other} is not
+// modified.
+void
+ucs_map_difference(ucs_map map, ucs_map other, size_t thread_count);
+
+////////////////////////////////////////////////////////////////////////////////
+// Map splitting and joining interface.
+//
+// Note: the operations split and join map's tree in O(log n). Elements which
+// stay in their maps, or move between maps which share an allocator (see
+// ucs_map_config::allocator), keep their addresses (their iterators remain
+// valid); elements which move to a map with another allocator are copied in
+// O(k), where k is the number of such elements. Without order statistics,
+// ucs_map_split also counts the smaller part in O(min(|left|, |right|)).
+//
+// If any of the maps is a B-tree or a concurrent map, then the operation is
+// done element by element instead, and if memory allocation fails, then some
+// of the elements may have been moved.
+//
+// Requires: all maps are created with the same configuration (except for
+// memory sources), and are distinct (except as noted).
+////////////////////////////////////////////////////////////////////////////////
+
+// Moves the elements of {map} whose keys are less than {k} to {left}, and the
+// rest of the elements to {right}. Either {left} or {right} can be {map}
+// itself (then it keeps its part), otherwise {map} is left empty. Returns false
+// if memory allocation fails (the maps are left unchanged in this case).
+// Requires: {left} and {right} are distinct, and are empty unless they are
+// {map}.
+bool
+ucs_map_split(ucs_map map, ucs_map_key k, ucs_map left, ucs_map right);
+
+// Moves the elements of {other} to {map}, and leaves {other} empty. All keys
+// of one map must be less than all keys of the other (in either order). Returns
+// false if the key ranges of the maps overlap, or if memory allocation fails
+// (the maps are left unchanged in these cases).
+bool
+ucs_map_join(ucs_map map, ucs_map other);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Map search interface.
 ////////////////////////////////////////////////////////////////////////////////
@@ -118,6 +441,34 @@ ucs_map_find(ucs_map map, ucs_map_key k);
 ucs_map_iterator
 ucs_map_lower_bound(ucs_map map, ucs_map_key k);
 
+////////////////////////////////////////////////////////////////////////////////
+// Map order statistics interface.
+//
+// Note: ucs_map_size runs in O(1). Other functions run in O(log n) when the map
+// is created with {ucs_map_flag_order_statistics}, and in O(n) otherwise.
+////////////////////////////////////////////////////////////////////////////////
+
+size_t
+ucs_map_size(ucs_map map);
+
+// Returns the element with zero-based index {k} in the sorted sequence of map's
+// elements, or NULL if {k} is out of range.
+ucs_map_iterator
+ucs_map_select(ucs_map map, size_t k);
+
+// Returns the number of elements whose keys are less than {k}.
+size_t
+ucs_map_rank(ucs_map map, ucs_map_key k);
+
+// Returns the index of the given element in the sorted sequence of map's
+// elements. Returns the size of the map if {i} is NULL.
+size_t
+ucs_map_iterator_rank(ucs_map map, ucs_map_iterator i);
+
+// Returns the number of elements whose keys belong to [lo, hi).
+size_t
+ucs_map_count(ucs_map map, ucs_map_key lo, ucs_map_key hi);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Map iteration interface.
 ////////////////////////////////////////////////////////////////////////////////
@@ -137,4 +488,339 @@ ucs_map_iterator_prev(ucs_map_iterator i);
 char*
 ucs_map_iterator_mem(ucs_map_iterator i);
 
+////////////////////////////////////////////////////////////////////////////////
+// Map cursor interface.
+//
+// Cursor reads consecutive elements in batches: each read fills an array with
+// up to {n} elements (or pointers to elements) in ascending key order, and
+// advances the cursor past them, so that the next read resumes where the
+// previous one stopped. Reads walk the tree with an explicit stack and prefetch
+// upcoming nodes, instead of following parent links from every element. A read
+// of k elements runs in O(k + log n).
+//
+// Note: a cursor is invalidated by modifications of the map, like an iterator
+// (it can be recreated from the key which follows the last read element). In
+// concurrent maps the results of reads must be validated (see Map concurrency
+// interface).
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct ucs_map_cursor {
+    void* m00_;
+} ucs_map_cursor;
+
+// Returns a cursor which points to the first element whose key is not less
+// than {k}.
+ucs_map_cursor
+ucs_map_cursor_at(ucs_map map, ucs_map_key k);
+
+// Returns a cursor which points to the element of the given iterator (an
+// exhausted cursor if the iterator is NULL).
+ucs_map_cursor
+ucs_map_cursor_from_iterator(ucs_map_iterator i);
+
+// Returns the iterator of the element which is read next, or NULL if the
+// cursor is exhausted.
+ucs_map_iterator
+ucs_map_cursor_iterator(ucs_map_cursor c);
+
+// Copies up to {n} elements to {buffer} (elements are stored consecutively,
+// {element_size} bytes each), and returns the number of copied elements (less
+// than {n} only if the cursor is exhausted).
+// Requires: {buffer} is aligned to {element_alignment}.
+size_t
+ucs_map_cursor_read(ucs_map map, ucs_map_cursor* c, char* buffer, size_t n);
+
+// Same as ucs_map_cursor_read, but stores pointers to elements' memory.
+size_t
+ucs_map_cursor_read_ptrs(
+    ucs_map map, ucs_map_cursor* c, char** elements, size_t n);
+
+////////////////////////////////////////////////////////////////////////////////
+// Map concurrency interface.
+//
+// Maps created with {ucs_map_flag_concurrent} can be modified by one writer
+// thread while other threads read them without locks. Readers must perform all
+// accesses to the map (including the use of iterators and elements' memory)
+// inside read sections. Removed elements are not freed until all read sections
+// which could have reached them end.
+//
+// ucs_map_find and ucs_map_lower_bound always return results which are
+// consistent with some state of the map. Other read functions (e.g. iteration)
+// can observe the map in the middle of a modification; their results must be
+// checked with ucs_map_read_validate, and the read section must be restarted
+// if the check fails.
+//
+// Note: update functions, ucs_map_reclaim and ucs_map_destroy must only be
+// called by the writer.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct ucs_map_read_section {
+    size_t m00_, m01_, m02_;
+} ucs_map_read_section;
+
+// Requires: the map was created with {ucs_map_flag_concurrent}.
+ucs_map_read_section
+ucs_map_read_begin(ucs_map map);
+
+void
+ucs_map_read_end(ucs_map map, ucs_map_read_section const* s);
+
+// Returns true if the map has not been modified since the beginning of the
+// given read section.
+bool
+ucs_map_read_validate(ucs_map map, ucs_map_read_section const* s);
+
+// Frees removed elements which can no longer be reached by readers. Does not
+// wait for readers. Returns false if some readers which started before the
+// previous reclamation are still running. Removal calls this function
+// periodically, so explicit calls are needed only to release memory sooner.
+bool
+ucs_map_reclaim(ucs_map map);
+
+////////////////////////////////////////////////////////////////////////////////
+// Map statistics interface.
+//
+// If the UCS_MAP_INSTRUMENTATION macro is defined, then maps count key
+// comparisons, nodes visited by each descent from the root, and rebalancing
+// work. Otherwise the counters are not maintained (and are reported as zeros),
+// so that operations have no overhead. The library and its users must be
+// compiled with the same setting.
+//
+// Note: concurrent maps are not instrumented (their readers would race on the
+// counters), and neither are searches done by functions of type-specialized
+// maps (see UCS_MAP_DEFINE).
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns the counters accumulated since the creation of the map (or since the
+// last reset), and the current height of the tree. Runs in O(log n).
+ucs_map_statistics
+ucs_map_stats(ucs_map map);
+
+void
+ucs_map_stats_reset(ucs_map map);
+
+////////////////////////////////////////////////////////////////////////////////
+// Frozen map interface.
+//
+// Frozen map is an immutable copy of a map, which is stored in a single memory
+// block in Eytzinger (breadth-first) order. Searches in a frozen map are done
+// without branches on comparison results, and access memory in a predictable
+// pattern. Frozen map does not depend on the map it was created from.
+////////////////////////////////////////////////////////////////////////////////
+
+struct ucs_map_frozen;
+typedef struct ucs_map_frozen* ucs_map_frozen;
+
+enum { ucs_map_frozen_image_alignment = 64 };
+
+// Iterators are indices of elements. Zero corresponds to the position past the
+// last element.
+typedef size_t ucs_map_frozen_iterator;
+
+// Copies map's elements to a new frozen map. Returns NULL if memory allocation
+// fails. Runs in O(n).
+ucs_map_frozen
+ucs_map_freeze(ucs_map map);
+
+void
+ucs_map_frozen_destroy(ucs_map_frozen frozen);
+
+// Replaces map's content with copies of frozen map's elements. Runs in O(n)
+// without key comparisons (B-tree maps insert elements one by one). Returns
+// false if elements of the maps have different sizes (the map is left
+// unchanged), or if memory allocation fails (the map is left empty).
+bool
+ucs_map_thaw(ucs_map map, ucs_map_frozen frozen);
+
+size_t
+ucs_map_frozen_size(ucs_map_frozen frozen);
+
+ucs_map_frozen_iterator
+ucs_map_frozen_find(ucs_map_frozen frozen, ucs_map_key k);
+
+ucs_map_frozen_iterator
+ucs_map_frozen_lower_bound(ucs_map_frozen frozen, ucs_map_key k);
+
+// Iteration functions visit elements in key order, and run in amortized O(1).
+ucs_map_frozen_iterator
+ucs_map_frozen_lower(ucs_map_frozen frozen);
+
+ucs_map_frozen_iterator
+ucs_map_frozen_upper(ucs_map_frozen frozen);
+
+ucs_map_frozen_iterator
+ucs_map_frozen_next(ucs_map_frozen frozen, ucs_map_frozen_iterator i);
+
+ucs_map_frozen_iterator
+ucs_map_frozen_prev(ucs_map_frozen frozen, ucs_map_frozen_iterator i);
+
+// Requires: {i} is not zero.
+char const*
+ucs_map_frozen_mem(ucs_map_frozen frozen, ucs_map_frozen_iterator i);
+
+////////////////////////////////////////////////////////////////////////////////
+// Frozen map serialization interface.
+//
+// Frozen map's image consists of a versioned header, keys' prefixes (if the
+// map has a key prefix function), and elements, stored in Eytzinger order.
+// Image contains no pointers, so it can be placed at any address (e.g. mapped
+// into memory), and searched in place. Elements are stored as they are: they
+// must not contain pointers, and images can only be opened on platforms with
+// the same byte order (which is checked) and layout of element type.
+////////////////////////////////////////////////////////////////////////////////
+
+// Writes frozen map's image to the given file. Returns false on write error.
+bool
+ucs_map_frozen_save(ucs_map_frozen frozen, FILE* file);
+
+// Returns a frozen map which uses the given image in place, or NULL if the
+// image is malformed, is not compatible with the given configuration, or if
+// memory allocation fails. Runs in O(1).
+// Requires: {image} is aligned to {ucs_map_frozen_image_alignment}, or to the
+// alignment of elements if it is greater (memory mapped files satisfy this
+// requirement), and remains valid until the frozen map is destroyed.
+ucs_map_frozen
+ucs_map_frozen_open(ucs_map_config cfg, void const* image, size_t image_size);
+
+////////////////////////////////////////////////////////////////////////////////
+// Low-level interface for type-specialized maps.
+//
+// Note: this interface can not be used with B-tree maps. In concurrent maps
+// generated search functions can only be used by the writer.
+////////////////////////////////////////////////////////////////////////////////
+
+ucs_map_iterator
+ucs_map_root(ucs_map map);
+
+// Inserts a new element with the given key and links it to the map as a child
+// {child_i} (0 - left, 1 - right) of the {parent}, or as the root if the map is
+// empty, then rebalances the tree.
+// Requires: the position is the one where a search for {k} ended, i.e.
+// {parent->children[child_i]} is NULL and the key does not exist in the map.
+ucs_map_iterator
+ucs_map_insert_at(ucs_map map, ucs_map_iterator parent, ptrdiff_t child_i,
+                  ucs_map_key k);
+
+////////////////////////////////////////////////////////////////////////////////
+// Type-specialized map generator.
+//
+// UCS_MAP_DEFINE(name, elem_t, key_t, key_field, cmp) defines a set of static
+// inline functions which work with a ucs_map storing elements of type {elem_t}
+// with keys of type {key_t} stored in {elem_t::key_field}. Keys are compared
+// using {cmp(key_t, key_t)} (a function or a macro, for example
+// UCS_MAP_SCALAR_CMP), which must return a negative value, zero, or a positive
+// value. Searches are done without calls through function pointers, with one
+// comparison per visited node, rebalancing is done by the generic map code.
+//
+// Defined functions:
+//   ucs_map_config   name_config(void);
+//   ucs_map          name_create_in_place(char* mem);
+//   ucs_map          name_create(void);
+//   elem_t*          name_mem(ucs_map_iterator i);
+//   ucs_map_iterator name_find(ucs_map map, key_t k);
+//   ucs_map_iterator name_lower_bound(ucs_map map, key_t k);
+//   ucs_map_iterator name_insert(ucs_map map, key_t k);
+//   bool             name_remove(ucs_map map, key_t k);
+//
+// Map's config (and thus any map created from it) can be used with the rest of
+// the map interface.
+////////////////////////////////////////////////////////////////////////////////
+
+#define UCS_MAP_SCALAR_CMP(x, y) (((x) > (y)) - ((x) < (y)))
+
+#define UCS_MAP_DEFINE(name, elem_t, key_t, key_field, cmp)                    \
+    static inline void name##_key_set_(ucs_map_key k, char* mem) {             \
+        ((elem_t*)(mem))->key_field = *((key_t const*)(k));                    \
+    }                                                                          \
+                                                                               \
+    static inline ucs_map_key name##_key_get_(char* mem) {                     \
+        return &(((elem_t*)(mem))->key_field);                                 \
+    }                                                                          \
+                                                                               \
+    static inline int name##_key_cmp_(ucs_map_key k0, ucs_map_key k1) {        \
+        return cmp(*((key_t const*)(k0)), *((key_t const*)(k1)));              \
+    }                                                                          \
+                                                                               \
+    static inline ucs_map_config name##_config(void) {                         \
+        return (ucs_map_config){.element_alignment = alignof(elem_t),          \
+                                .element_size = sizeof(elem_t),                \
+                                .key_set_fn = name##_key_set_,                 \
+                                .key_get_fn = name##_key_get_,                 \
+                                .key_cmp_fn = name##_key_cmp_};                \
+    }                                                                          \
+                                                                               \
+    static inline ucs_map name##_create_in_place(char* mem) {                  \
+        return ucs_map_create_in_place(name##_config(), mem);                  \
+    }                                                                          \
+                                                                               \
+    static inline ucs_map name##_create(void) {                                \
+        return ucs_map_create(name##_config());                                \
+    }                                                                          \
+                                                                               \
+    static inline elem_t* name##_mem(ucs_map_iterator i) {                     \
+        return (elem_t*)(((char*)(i)) + sizeof(ucs_map_node));                 \
+    }                                                                          \
+                                                                               \
+    static inline ucs_map_iterator name##_find(ucs_map map, key_t k) {         \
+        ucs_map_node* node = ucs_map_root(map);                                \
+                                                                               \
+        while(node != NULL) {                                                  \
+            int c = cmp(k, name##_mem(node)->key_field);                       \
+            if(c == 0) {                                                       \
+                break;                                                         \
+            }                                                                  \
+                                                                               \
+            node = node->children[(c > 0) ? 1 : 0];                            \
+        }                                                                      \
+                                                                               \
+        return node;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline ucs_map_iterator name##_lower_bound(ucs_map map, key_t k) {  \
+        ucs_map_node* node = ucs_map_root(map);                                \
+        ucs_map_node* bound = NULL;                                            \
+                                                                               \
+        while(node != NULL) {                                                  \
+            int c = cmp(k, name##_mem(node)->key_field);                       \
+            if(c > 0) {                                                        \
+                node = node->children[1];                                      \
+            } else {                                                           \
+                bound = node;                                                  \
+                                                                               \
+                if(c == 0) {                                                   \
+                    break;                                                     \
+                }                                                              \
+                                                                               \
+                node = node->children[0];                                      \
+            }                                                                  \
+        }                                                                      \
+                                                                               \
+        return bound;                                                          \
+    }                                                                          \
+                                                                               \
+    static inline ucs_map_iterator name##_insert(ucs_map map, key_t k) {       \
+        ucs_map_node* node = ucs_map_root(map);                                \
+        ptrdiff_t child_i = 0;                                                 \
+                                                                               \
+        while(node != NULL) {                                                  \
+            int c = cmp(k, name##_mem(node)->key_field);                       \
+            if(c == 0) {                                                       \
+                return node;                                                   \
+            }                                                                  \
+                                                                               \
+            child_i = ((c > 0) ? 1 : 0);                                       \
+            if(node->children[child_i] == NULL) {                              \
+                break;                                                         \
+            }                                                                  \
+                                                                               \
+            node = node->children[child_i];                                    \
+        }                                                                      \
+                                                                               \
+        return ucs_map_insert_at(map, node, child_i, &k);                      \
+    }                                                                          \
+                                                                               \
+    static inline bool name##_remove(ucs_map map, key_t k) {                   \
+        return ucs_map_remove_by_iterator(map, name##_find(map, k));           \
+    }
+
 #endif // H_90988947122C4A99B7ED48C2EC268033
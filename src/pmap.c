@@ -0,0 +1,606 @@
+// Copyright Nezametdinov E. Ildus 2021.
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// https://www.boost.org/LICENSE_1_0.txt)
+//
+#include "pmap.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Helper macros.
+////////////////////////////////////////////////////////////////////////////////
+
+// Element is stored right after the node.
+#define node_mem_(node) (((char*)(node)) + sizeof(ucs_pmap_node))
+
+#define node_key_(pmap, node) ((pmap)->key_get_fn(node_mem_(node)))
+
+#define height_(node) (((node) == NULL) ? 0 : (int)((node)->height))
+
+////////////////////////////////////////////////////////////////////////////////
+// Persistent map data types.
+////////////////////////////////////////////////////////////////////////////////
+
+// Node's reference count is the number of nodes and snapshots which link to
+// it. Node can be modified in place only if it is referenced once, and the
+// reference comes from the current version of the map (i.e. from its root, or
+// from a node which can be modified in place).
+typedef struct ucs_pmap_node {
+    struct ucs_pmap_node* children[2];
+    size_t refcount;
+    unsigned char height;
+} ucs_pmap_node;
+
+struct ucs_pmap_snapshot {
+    ucs_pmap pmap;
+    ucs_pmap_node* root;
+    size_t size;
+};
+
+struct ucs_pmap {
+    ucs_allocator_object_storage allocator_storage;
+    ucs_allocator allocator;
+
+    struct ucs_pmap_snapshot current;
+    size_t node_offset, element_size, allocation_size;
+
+    ucs_map_key_set_fn key_set_fn;
+    ucs_map_key_get_fn key_get_fn;
+    ucs_map_key_cmp_fn key_cmp_fn;
+
+    // Source of all map's memory.
+    ucs_allocator_upstream upstream;
+};
+
+enum {
+    // Maximum height of an AVL tree is less than 1.45 * log2(n + 2).
+    ucs_pmap_max_height = 128
+};
+
+static_assert(alignof(struct ucs_pmap) <= ucs_pmap_object_alignment, "");
+static_assert(sizeof(struct ucs_pmap) <= ucs_pmap_object_size, "");
+
+////////////////////////////////////////////////////////////////////////////////
+// Utility functions.
+////////////////////////////////////////////////////////////////////////////////
+
+// Memory management.
+
+static ucs_pmap_node*
+ucs_pmap_node_alloc(ucs_pmap pmap) {
+    char* mem = ucs_allocator_alloc(pmap->allocator);
+    return ((mem != NULL) ? (ucs_pmap_node*)(mem + pmap->node_offset) : NULL);
+}
+
+static void
+ucs_pmap_node_free(ucs_pmap pmap, ucs_pmap_node* node) {
+    ucs_allocator_free(pmap->allocator, ((char*)(node)) - pmap->node_offset);
+}
+
+static void
+ucs_pmap_node_retain(ucs_pmap_node* node) {
+    if(node != NULL) {
+        node->refcount++;
+    }
+}
+
+static void
+ucs_pmap_node_release(ucs_pmap pmap, ucs_pmap_node* node) {
+    // Frees the nodes which are no longer referenced. Recursion depth is
+    // bounded by the height of the tree.
+
+    while((node != NULL) && (--node->refcount == 0)) {
+        ucs_pmap_node* next = node->children[1];
+
+        ucs_pmap_node_release(pmap, node->children[0]);
+        ucs_pmap_node_free(pmap, node);
+
+        node = next;
+    }
+}
+
+static ucs_pmap_node*
+ucs_pmap_node_own(ucs_pmap pmap, ucs_pmap_node** slot) {
+    // Makes the node in the given slot modifiable in place, copying it if it
+    // is shared with snapshots. Returns NULL if memory allocation fails.
+    // Precondition: the slot belongs to the current version of the map.
+
+    ucs_pmap_node* node = *slot;
+    if(node->refcount == 1) {
+        return node;
+    }
+
+    ucs_pmap_node* copy = ucs_pmap_node_alloc(pmap);
+    if(copy == NULL) {
+        return NULL;
+    }
+
+    memcpy(((char*)(copy)) - pmap->node_offset,
+           ((char*)(node)) - pmap->node_offset, pmap->allocation_size);
+
+    copy->refcount = 1;
+    ucs_pmap_node_retain(copy->children[0]);
+    ucs_pmap_node_retain(copy->children[1]);
+
+    *slot = copy;
+    ucs_pmap_node_release(pmap, node);
+
+    return copy;
+}
+
+// Tree balancing.
+
+static void
+ucs_pmap_node_update_height(ucs_pmap_node* node) {
+    int h0 = height_(node->children[0]), h1 = height_(node->children[1]);
+    node->height = (unsigned char)(1 + ((h0 > h1) ? h0 : h1));
+}
+
+static bool
+ucs_pmap_rotate(ucs_pmap pmap, ucs_pmap_node** slot, ptrdiff_t child_i) {
+    // Replaces the node in the given slot with its child {child_i}. Returns
+    // false (leaving the tree unchanged) if memory allocation fails.
+
+    ucs_pmap_node* node = ucs_pmap_node_own(pmap, slot);
+    ucs_pmap_node* child = NULL;
+
+    if((node == NULL) ||
+       ((child = ucs_pmap_node_own(pmap, &node->children[child_i])) == NULL)) {
+        return false;
+    }
+
+    node->children[child_i] = child->children[1 - child_i];
+    child->children[1 - child_i] = node;
+
+    ucs_pmap_node_update_height(node);
+    ucs_pmap_node_update_height(child);
+
+    *slot = child;
+    return true;
+}
+
+static void
+ucs_pmap_rebalance(ucs_pmap pmap, ucs_pmap_node** path[], size_t n) {
+    // Restores the balance of the nodes in the given slots, starting from the
+    // last one. Stops as soon as the height of a subtree does not change.
+    // Precondition: the nodes in the slots can be modified in place.
+
+    while(n-- != 0) {
+        ucs_pmap_node** slot = path[n];
+        ucs_pmap_node* node = *slot;
+
+        int height = node->height;
+        int d = height_(node->children[1]) - height_(node->children[0]);
+
+        ucs_pmap_node_update_height(node);
+
+        if((d < -1) || (d > 1)) {
+            ptrdiff_t child_i = ((d > 0) ? 1 : 0);
+            ucs_pmap_node* child = node->children[child_i];
+
+            // Inner grandchild is rotated up first.
+            if((height_(child->children[1 - child_i]) <=
+                height_(child->children[child_i])) ||
+               ucs_pmap_rotate(pmap, &node->children[child_i], 1 - child_i)) {
+                ucs_pmap_rotate(pmap, slot, child_i);
+            }
+        }
+
+        if((*slot)->height == height) {
+            break;
+        }
+    }
+}
+
+// Search.
+
+static ucs_pmap_node*
+ucs_pmap_node_bound(ucs_pmap_snapshot s, ucs_map_key k, ptrdiff_t dir) {
+    // Returns the node with the smallest key greater than {k} if {dir} is 1,
+    // or the node with the greatest key less than {k} if {dir} is 0.
+
+    ucs_pmap pmap = s->pmap;
+    ucs_pmap_node *node = s->root, *bound = NULL;
+
+    while(node != NULL) {
+        int cmp = pmap->key_cmp_fn(k, node_key_(pmap, node));
+
+        if((dir == 1) ? (cmp < 0) : (cmp > 0)) {
+            bound = node;
+            node = node->children[1 - dir];
+        } else {
+            node = node->children[dir];
+        }
+    }
+
+    return bound;
+}
+
+static ucs_pmap_node*
+ucs_pmap_node_extreme(ucs_pmap_node* node, ptrdiff_t dir) {
+    if(node != NULL) {
+        for(; node->children[dir] != NULL; node = node->children[dir]) {
+        }
+    }
+
+    return node;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Persistent map creation/destruction interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+static ucs_allocator_upstream
+ucs_pmap_config_upstream(ucs_map_config cfg) {
+    return (ucs_allocator_upstream){.region_fn = cfg.region_fn,
+                                    .deallocate_fn = cfg.deallocate_fn,
+                                    .context = cfg.region_context};
+}
+
+ucs_pmap
+ucs_pmap_create_in_place(ucs_map_config cfg, char* mem) {
+    if((cfg.element_size == 0) || (cfg.allocator != NULL) ||
+       ((cfg.flags & ~(unsigned)(ucs_map_flag_huge_pages)) != 0)) {
+        return NULL;
+    }
+
+    size_t alignment = cfg.element_alignment;
+    if(alignment < alignof(ucs_pmap_node)) {
+        alignment = alignof(ucs_pmap_node);
+    }
+
+    if((alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+
+#define pad_(size)                                                  \
+    if(true) {                                                      \
+        size_t d = (size) % (alignment);                            \
+        if((d != 0) && (((size) += (alignment)-d) < (alignment))) { \
+            return NULL;                                            \
+        }                                                           \
+    }
+
+    // Node's memory layout: [padding] node element.
+    size_t allocation_size = sizeof(ucs_pmap_node);
+    pad_(allocation_size);
+
+    size_t node_offset = allocation_size - sizeof(ucs_pmap_node);
+
+    if((allocation_size += cfg.element_size) < cfg.element_size) {
+        return NULL;
+    }
+
+    pad_(allocation_size);
+
+#undef pad_
+
+    ucs_pmap pmap = (ucs_pmap)(mem);
+    if(pmap != NULL) {
+        *pmap = (struct ucs_pmap){.node_offset = node_offset,
+                                  .element_size = cfg.element_size,
+                                  .allocation_size = allocation_size,
+                                  .key_set_fn = cfg.key_set_fn,
+                                  .key_get_fn = cfg.key_get_fn,
+                                  .key_cmp_fn = cfg.key_cmp_fn,
+                                  .upstream = ucs_pmap_config_upstream(cfg)};
+
+        pmap->current = (struct ucs_pmap_snapshot){.pmap = pmap};
+
+        size_t block_size = cfg.block_size;
+        size_t max_block_size = cfg.max_block_size;
+
+        if(block_size == 0) {
+            block_size = ucs_map_default_block_size;
+            max_block_size = ucs_map_default_max_block_size;
+        }
+
+        unsigned alloc_flags =
+            ucs_allocator_flag_intrusive |
+            ((cfg.flags != 0) ? (unsigned)(ucs_allocator_flag_huge_pages)
+                              : 0u);
+
+        ucs_allocator_config alloc_cfg = {
+            .block_size = block_size,
+            .max_block_size = max_block_size,
+            .element_alignment = alignment,
+            .element_size = allocation_size,
+            .flags = alloc_flags,
+            .region_fn = cfg.region_fn,
+            .deallocate_fn = cfg.deallocate_fn,
+            .region_context = cfg.region_context,
+            .trim_high_watermark = cfg.trim_high_watermark,
+            .trim_low_watermark = cfg.trim_low_watermark};
+
+        pmap->allocator = ucs_allocator_create_in_place(
+            alloc_cfg, pmap->allocator_storage.mem);
+
+        if(pmap->allocator == NULL) {
+            return NULL;
+        }
+    }
+
+    return pmap;
+}
+
+ucs_pmap
+ucs_pmap_create(ucs_map_config cfg) {
+    ucs_allocator_upstream upstream = ucs_pmap_config_upstream(cfg);
+    char* mem = ucs_allocator_upstream_alloc(
+        upstream, ucs_pmap_object_size, ucs_pmap_object_alignment);
+
+    if((mem != NULL) && (ucs_pmap_create_in_place(cfg, mem) == NULL)) {
+        ucs_allocator_upstream_free(upstream, mem, ucs_pmap_object_size);
+        mem = NULL;
+    }
+
+    return (ucs_pmap)(mem);
+}
+
+void
+ucs_pmap_destroy_in_place(ucs_pmap pmap) {
+    if(pmap == NULL) {
+        return;
+    }
+
+    ucs_allocator_destroy_in_place(pmap->allocator);
+}
+
+void
+ucs_pmap_destroy(ucs_pmap pmap) {
+    if(pmap == NULL) {
+        return;
+    }
+
+    ucs_allocator_upstream upstream = pmap->upstream;
+    ucs_pmap_destroy_in_place(pmap);
+    ucs_allocator_upstream_free(upstream, pmap, ucs_pmap_object_size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Persistent map update interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+void
+ucs_pmap_clear(ucs_pmap pmap) {
+    ucs_pmap_node_release(pmap, pmap->current.root);
+
+    pmap->current.root = NULL;
+    pmap->current.size = 0;
+}
+
+ucs_pmap_iterator
+ucs_pmap_insert(ucs_pmap pmap, ucs_map_key k) {
+    ucs_pmap_node** path[ucs_pmap_max_height];
+    ucs_pmap_node** slot = &pmap->current.root;
+    size_t n = 0;
+
+    // Note: copies of shared nodes replace the originals as the search goes,
+    // so the map does not change if memory allocation fails.
+    while(*slot != NULL) {
+        ucs_pmap_node* node = ucs_pmap_node_own(pmap, slot);
+        if(node == NULL) {
+            return NULL;
+        }
+
+        int cmp = pmap->key_cmp_fn(k, node_key_(pmap, node));
+        if(cmp == 0) {
+            return node;
+        }
+
+        assert(n != ucs_pmap_max_height);
+        path[n++] = slot;
+        slot = &node->children[(cmp > 0) ? 1 : 0];
+    }
+
+    ucs_pmap_node* node = ucs_pmap_node_alloc(pmap);
+    if(node == NULL) {
+        return NULL;
+    }
+
+    *node = (ucs_pmap_node){.children = {NULL, NULL}, .refcount = 1,
+                            .height = 1};
+
+    pmap->key_set_fn(k, node_mem_(node));
+
+    *slot = node;
+    pmap->current.size++;
+
+    ucs_pmap_rebalance(pmap, path, n);
+    return node;
+}
+
+bool
+ucs_pmap_remove(ucs_pmap pmap, ucs_map_key k) {
+    if(ucs_pmap_find(&pmap->current, k) == NULL) {
+        return false;
+    }
+
+    ucs_pmap_node** path[ucs_pmap_max_height];
+    ucs_pmap_node** slot = &pmap->current.root;
+    size_t n = 0;
+
+    ucs_pmap_node* node = NULL;
+    while(true) {
+        if((node = ucs_pmap_node_own(pmap, slot)) == NULL) {
+            return false;
+        }
+
+        int cmp = pmap->key_cmp_fn(k, node_key_(pmap, node));
+        if(cmp == 0) {
+            break;
+        }
+
+        assert(n != ucs_pmap_max_height);
+        path[n++] = slot;
+        slot = &node->children[(cmp > 0) ? 1 : 0];
+    }
+
+    if((node->children[0] != NULL) && (node->children[1] != NULL)) {
+        // Node has two children: its element is replaced with the element of
+        // its in-order successor, which is removed instead.
+        path[n++] = slot;
+        slot = &node->children[1];
+
+        ucs_pmap_node* next = NULL;
+        while(true) {
+            if((next = ucs_pmap_node_own(pmap, slot)) == NULL) {
+                return false;
+            }
+
+            if(next->children[0] == NULL) {
+                break;
+            }
+
+            assert(n != ucs_pmap_max_height);
+            path[n++] = slot;
+            slot = &next->children[0];
+        }
+
+        memcpy(node_mem_(node), node_mem_(next), pmap->element_size);
+        node = next;
+    }
+
+    // Node has at most one child, which takes its place.
+    *slot = node->children[(node->children[0] != NULL) ? 0 : 1];
+    ucs_pmap_node_free(pmap, node);
+
+    pmap->current.size--;
+
+    ucs_pmap_rebalance(pmap, path, n);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Snapshot interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+ucs_pmap_snapshot
+ucs_pmap_current(ucs_pmap pmap) {
+    return &pmap->current;
+}
+
+ucs_pmap_snapshot
+ucs_pmap_snapshot_take(ucs_pmap pmap) {
+    ucs_pmap_snapshot s = ucs_allocator_upstream_alloc(
+        pmap->upstream, sizeof(struct ucs_pmap_snapshot),
+        alignof(struct ucs_pmap_snapshot));
+
+    if(s != NULL) {
+        *s = pmap->current;
+        ucs_pmap_node_retain(s->root);
+    }
+
+    return s;
+}
+
+void
+ucs_pmap_snapshot_release(ucs_pmap_snapshot s) {
+    if(s == NULL) {
+        return;
+    }
+
+    ucs_pmap_node_release(s->pmap, s->root);
+    ucs_allocator_upstream_free(
+        s->pmap->upstream, s, sizeof(struct ucs_pmap_snapshot));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Snapshot search interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+size_t
+ucs_pmap_size(ucs_pmap_snapshot s) {
+    return s->size;
+}
+
+ucs_pmap_iterator
+ucs_pmap_find(ucs_pmap_snapshot s, ucs_map_key k) {
+    ucs_pmap pmap = s->pmap;
+    ucs_pmap_node* node = s->root;
+
+    while(node != NULL) {
+        int cmp = pmap->key_cmp_fn(k, node_key_(pmap, node));
+        if(cmp == 0) {
+            break;
+        }
+
+        node = node->children[(cmp > 0) ? 1 : 0];
+    }
+
+    return node;
+}
+
+ucs_pmap_iterator
+ucs_pmap_lower_bound(ucs_pmap_snapshot s, ucs_map_key k) {
+    ucs_pmap pmap = s->pmap;
+    ucs_pmap_node *node = s->root, *bound = NULL;
+
+    while(node != NULL) {
+        int cmp = pmap->key_cmp_fn(k, node_key_(pmap, node));
+        if(cmp > 0) {
+            node = node->children[1];
+        } else {
+            bound = node;
+
+            if(cmp == 0) {
+                break;
+            }
+
+            node = node->children[0];
+        }
+    }
+
+    return bound;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Snapshot iteration interface implementation.
+////////////////////////////////////////////////////////////////////////////////
+
+ucs_pmap_iterator
+ucs_pmap_lower(ucs_pmap_snapshot s) {
+    return ucs_pmap_node_extreme(s->root, 0);
+}
+
+ucs_pmap_iterator
+ucs_pmap_upper(ucs_pmap_snapshot s) {
+    return ucs_pmap_node_extreme(s->root, 1);
+}
+
+ucs_pmap_iterator
+ucs_pmap_iterator_next(ucs_pmap_snapshot s, ucs_pmap_iterator i) {
+    ucs_pmap_node* node = i;
+
+    if(node != NULL) {
+        // The successor is the leftmost node of the right subtree, if any.
+        node = ((node->children[1] != NULL)
+                    ? ucs_pmap_node_extreme(node->children[1], 0)
+                    : ucs_pmap_node_bound(
+                          s, node_key_(s->pmap, node), 1));
+    }
+
+    return node;
+}
+
+ucs_pmap_iterator
+ucs_pmap_iterator_prev(ucs_pmap_snapshot s, ucs_pmap_iterator i) {
+    ucs_pmap_node* node = i;
+
+    if(node != NULL) {
+        node = ((node->children[0] != NULL)
+                    ? ucs_pmap_node_extreme(node->children[0], 1)
+                    : ucs_pmap_node_bound(
+                          s, node_key_(s->pmap, node), 0));
+    }
+
+    return node;
+}
+
+char*
+ucs_pmap_iterator_mem(ucs_pmap_iterator i) {
+    return node_mem_((ucs_pmap_node*)(i));
+}
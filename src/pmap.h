@@ -0,0 +1,182 @@
+// Copyright Nezametdinov E. Ildus 2021.
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// https://www.boost.org/LICENSE_1_0.txt)
+//
+#ifndef H_4D1E0F5B8A6C4E3F9B2A7C51D08E6F39
+#define H_4D1E0F5B8A6C4E3F9B2A7C51D08E6F39
+
+#include "map.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Persistent map.
+//
+// Persistent map is an AVL tree whose past versions can be preserved as
+// snapshots. Taking a snapshot runs in O(1). After that, modifications of the
+// map copy the nodes on the path from the root to the modified node (O(log n)
+// nodes) instead of changing them, and the rest of the tree is shared between
+// the map and its snapshots. Nodes are reference counted, and are freed when
+// neither the map nor any snapshot can reach them. Modifications which are
+// done between snapshots change nodes in place.
+//
+// Snapshots are immutable, and can be read by any number of threads while the
+// map is being modified. Map modifications, and taking and releasing
+// snapshots, must be done by one thread at a time.
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Opaque types.
+////////////////////////////////////////////////////////////////////////////////
+
+struct ucs_pmap;
+typedef struct ucs_pmap* ucs_pmap;
+
+struct ucs_pmap_snapshot;
+typedef struct ucs_pmap_snapshot* ucs_pmap_snapshot;
+
+typedef void* ucs_pmap_iterator;
+
+////////////////////////////////////////////////////////////////////////////////
+// Persistent map's private structure.
+////////////////////////////////////////////////////////////////////////////////
+
+struct ucs_pmap_private {
+    ucs_allocator_object_storage m00_;
+    ucs_allocator m01_;
+
+    struct {
+        void *m00_, *m01_;
+        size_t m02_;
+    } m02_;
+
+    size_t m03_, m04_, m05_;
+
+    ucs_map_key_set_fn m06_;
+    ucs_map_key_get_fn m07_;
+    ucs_map_key_cmp_fn m08_;
+
+    ucs_allocator_upstream m09_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Constants.
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+    ucs_pmap_object_alignment = alignof(struct ucs_pmap_private),
+    ucs_pmap_object_size = sizeof(struct ucs_pmap_private)
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Persistent map object storage type.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct ucs_pmap_object_storage {
+    char alignas(ucs_pmap_object_alignment) mem[ucs_pmap_object_size];
+} ucs_pmap_object_storage;
+
+////////////////////////////////////////////////////////////////////////////////
+// Persistent map creation/destruction interface.
+//
+// Note: persistent maps use map's configuration. Its {flags} may contain only
+// ucs_map_flag_huge_pages, its {allocator} must be NULL, and its
+// {key_prefix_fn} is not used.
+////////////////////////////////////////////////////////////////////////////////
+
+// Requires: if {mem} is not NULL, then it must point to a storage of size
+// {ucs_pmap_object_size} aligned to {ucs_pmap_object_alignment}.
+ucs_pmap
+ucs_pmap_create_in_place(ucs_map_config cfg, char* mem);
+
+ucs_pmap
+ucs_pmap_create(ucs_map_config cfg);
+
+// Requires: all snapshots of the map are released.
+void
+ucs_pmap_destroy_in_place(ucs_pmap pmap);
+
+void
+ucs_pmap_destroy(ucs_pmap pmap);
+
+////////////////////////////////////////////////////////////////////////////////
+// Persistent map update interface.
+//
+// Note: modifications invalidate iterators of the current version of the map
+// (see ucs_pmap_current), iterators of snapshots remain valid.
+////////////////////////////////////////////////////////////////////////////////
+
+void
+ucs_pmap_clear(ucs_pmap pmap);
+
+// Inserts an element with the given key (if it does not exist), and returns
+// the element with this key. The element is not shared with any snapshot, so
+// its memory can be modified until the next snapshot is taken. Returns NULL if
+// memory allocation fails (the map is left unchanged in this case).
+ucs_pmap_iterator
+ucs_pmap_insert(ucs_pmap pmap, ucs_map_key k);
+
+// Returns false if the key is not found, or if memory allocation fails (the map
+// is left unchanged in this case). Note: if memory allocation fails while
+// rebalancing the tree, the element is still removed, but the tree is left less
+// balanced.
+bool
+ucs_pmap_remove(ucs_pmap pmap, ucs_map_key k);
+
+////////////////////////////////////////////////////////////////////////////////
+// Snapshot interface.
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns a snapshot-like handle of the current version of the map. The handle
+// can be passed to the search and iteration functions. It must not be
+// released, and it reflects all subsequent modifications of the map.
+ucs_pmap_snapshot
+ucs_pmap_current(ucs_pmap pmap);
+
+// Preserves the current version of the map. Returns NULL if memory allocation
+// fails.
+ucs_pmap_snapshot
+ucs_pmap_snapshot_take(ucs_pmap pmap);
+
+// Releases the given snapshot, and frees the nodes which are no longer
+// reachable. Runs in O(k), where k is the number of freed nodes.
+void
+ucs_pmap_snapshot_release(ucs_pmap_snapshot s);
+
+////////////////////////////////////////////////////////////////////////////////
+// Snapshot search interface.
+////////////////////////////////////////////////////////////////////////////////
+
+size_t
+ucs_pmap_size(ucs_pmap_snapshot s);
+
+ucs_pmap_iterator
+ucs_pmap_find(ucs_pmap_snapshot s, ucs_map_key k);
+
+ucs_pmap_iterator
+ucs_pmap_lower_bound(ucs_pmap_snapshot s, ucs_map_key k);
+
+////////////////////////////////////////////////////////////////////////////////
+// Snapshot iteration interface.
+//
+// Note: nodes do not store links to their parents (parents differ between
+// versions), so finding the next or the previous element takes O(log n).
+////////////////////////////////////////////////////////////////////////////////
+
+ucs_pmap_iterator
+ucs_pmap_lower(ucs_pmap_snapshot s);
+
+ucs_pmap_iterator
+ucs_pmap_upper(ucs_pmap_snapshot s);
+
+ucs_pmap_iterator
+ucs_pmap_iterator_next(ucs_pmap_snapshot s, ucs_pmap_iterator i);
+
+ucs_pmap_iterator
+ucs_pmap_iterator_prev(ucs_pmap_snapshot s, ucs_pmap_iterator i);
+
+// Note: memory of elements which can be reached from snapshots must not be
+// modified.
+char*
+ucs_pmap_iterator_mem(ucs_pmap_iterator i);
+
+#endif // H_4D1E0F5B8A6C4E3F9B2A7C51D08E6F39
@@ -14,7 +14,11 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <stdatomic.h>
+#include <threads.h>
+
 #include "../src/map.h"
+#include "../src/pmap.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 // Helper macros.
@@ -147,155 +151,3263 @@ map_validate_and_print(ucs_map map, map_key keys[static key_array_size],
         return false;
     }
 
+    if(ucs_map_size(map) != map_size) {
+        printf("error: ucs_map_size returned %zu, expected: %d\n",
+               ucs_map_size(map), map_size);
+        return false;
+    }
+
+    // Validate order statistics.
+    for(unsigned j = 0; j != map_size; ++j) {
+        ucs_map_iterator i = ucs_map_select(map, j);
+
+        if((i == NULL) || (iter_value_(i).k != keys[j])) {
+            printf("error: ucs_map_select failed for index %d\n", j);
+            return false;
+        }
+
+        if((ucs_map_rank(map, &keys[j]) != j) ||
+           (ucs_map_iterator_rank(map, i) != j)) {
+            printf("error: wrong rank of key %d\n", keys[j]);
+            return false;
+        }
+    }
+
+    if(ucs_map_select(map, map_size) != NULL) {
+        printf("error: ucs_map_select returned out-of-range element\n");
+        return false;
+    }
+
     return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Program entry point.
+// Order statistics test.
 ////////////////////////////////////////////////////////////////////////////////
 
-int
-main() {
-    // Allocate storage for a map object on stack. {map_storage.mem} has right
-    // alignment and size to store an object of map type.
+static bool
+map_test_order_statistics(unsigned flags) {
     ucs_map_object_storage map_storage = {};
-
-    // Create a new map in allocated storage. This map will contain objects of
-    // the {map_element} type.
     ucs_map map = ucs_map_create_in_place(
-        // Specify map's element alignment and size. Also specify functions
-        // which set/get/compare map's keys.
         (ucs_map_config){.element_alignment = alignof(map_element),
                          .element_size = sizeof(map_element),
+                         .flags = flags,
                          .key_set_fn = map_key_set,
                          .key_get_fn = map_key_get,
                          .key_cmp_fn = map_key_cmp},
-        // Pass a pointer to the allocated storage for the map.
         map_storage.mem);
 
     if(map == NULL) {
         printf("error: failed to create map\n");
-        return EXIT_FAILURE;
+        return false;
     }
 
-    int result = EXIT_SUCCESS;
-    unsigned map_size_expected = 0;
-    map_key keys[key_array_size] = {};
+    // The map contains keys 0, 3, 6, ..., 297.
+    bool result = true;
+    for(map_key k = 0; k != 300; k += 3) {
+        ucs_map_insert(map, &k);
+    }
 
-    // Insert elements to the map.
-    printf("inserting elements:\n");
-    if(true) {
-        map_key* k = keys;
-        for(unsigned i = 0; i != key_array_size; ++i, ++k) {
-            printf("%4d ", (*k = key_rand() % 8192));
-            ucs_map_insert(map, k);
+    for(map_key lo = 0; (lo < 310) && result; lo += 7) {
+        for(map_key hi = 0; hi < 310; hi += 5) {
+            size_t expected = 0;
+            for(map_key k = lo; k < hi; ++k) {
+                expected += ((k % 3) == 0) && (k < 300);
+            }
+
+            if(ucs_map_count(map, &lo, &hi) != expected) {
+                printf("error: wrong number of keys in [%d, %d)\n", lo, hi);
+
+                result = false;
+                break;
+            }
         }
+    }
 
-        map_size_expected = key_array_sort_and_remove_duplicates(keys);
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Bulk construction test.
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns successive odd numbers, starting from 1.
+static ucs_map_key
+map_key_next_odd(void* context) {
+    map_key* k = context;
+    *k += 2;
+
+    return k;
+}
+
+static bool
+map_test_build_sorted() {
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = ucs_map_create_in_place(
+        (ucs_map_config){.element_alignment = alignof(map_element),
+                         .element_size = sizeof(map_element),
+                         .flags = ucs_map_flag_order_statistics,
+                         .key_set_fn = map_key_set,
+                         .key_get_fn = map_key_get,
+                         .key_cmp_fn = map_key_cmp},
+        map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
     }
 
-    printf("\n\n");
+    bool result = false;
+    map_key keys[key_array_size] = {};
 
-    if(!map_validate_and_print(map, keys, map_size_expected)) {
-        result = EXIT_FAILURE;
+    // Build the map from even keys, then insert odd keys one by one.
+    for(unsigned j = 0; j != (key_array_size / 2); ++j) {
+        keys[j] = 2 * j;
+    }
+
+    if(!ucs_map_build_sorted_array(
+           map, keys, sizeof(map_key), key_array_size / 2)) {
+        printf("error: failed to build map from sorted array\n");
         goto cleanup;
     }
 
-    // Remove half of the map's elements.
-    printf("removing half of the map's elements\n");
-    for(unsigned k = 0; k < (map_size_expected / 2); ++k) {
-        unsigned l = key_rand() % (map_size_expected - k);
+    for(map_key k = 1; k < key_array_size; k += 2) {
+        ucs_map_insert(map, &k);
+    }
 
-        ucs_map_iterator i = ucs_map_lower(map);
-        for(; l != 0; --l, i = ucs_map_iterator_next(i)) {
-        }
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        keys[j] = j;
+    }
 
-        printf("%4d ", iter_value_(i).k);
-        if(!ucs_map_remove(map, &(iter_value_(i).k))) {
-            printf("error: failed to remove element with key %d\n",
-                   iter_value_(i).k);
+    if(!map_validate_and_print(map, keys, key_array_size)) {
+        goto cleanup;
+    }
 
-            result = EXIT_FAILURE;
+    // Rebuild the map from odd keys obtained from a callback, then remove
+    // every other key.
+    map_key k = (map_key)(-1);
+    if(!ucs_map_build_sorted(
+           map, key_array_size / 2, map_key_next_odd, &k)) {
+        printf("error: failed to build map from callback\n");
+        goto cleanup;
+    }
+
+    for(unsigned j = 0; j != (key_array_size / 2); ++j) {
+        map_key key = 2 * j + 1;
+        if(((j % 2) != 0) && !ucs_map_remove(map, &key)) {
+            printf("error: failed to remove element with key %d\n", key);
             goto cleanup;
         }
+
+        keys[j / 2] = 4 * (j / 2) + 1;
     }
 
-    if(true) {
-        ptrdiff_t j = 0;
-        for(ucs_map_iterator i = ucs_map_lower(map); i != NULL;
-            i = ucs_map_iterator_next(i)) {
-            keys[j++] = iter_value_(i).k;
+    result = map_validate_and_print(map, keys, key_array_size / 4);
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Batch application test.
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+map_test_apply_batch() {
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = ucs_map_create_in_place(
+        (ucs_map_config){.element_alignment = alignof(map_element),
+                         .element_size = sizeof(map_element),
+                         .key_set_fn = map_key_set,
+                         .key_get_fn = map_key_get,
+                         .key_cmp_fn = map_key_cmp},
+        map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+
+    static map_key batch_keys[key_array_size];
+    static ucs_map_batch_op batch[key_array_size];
+
+    // The first batch is larger than the map, so it is merged with the tree.
+    // It inserts keys 0, 2, 4, ... The second batch is small, so the tree is
+    // split at its keys. It removes keys divisible by 4 from the first half of
+    // the map and inserts odd keys to the second half. The third batch has
+    // several operations per key: key 1 is inserted, removed and inserted
+    // again, key 3 is inserted and removed.
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        batch_keys[j] = 2 * j;
+        batch[j] = (ucs_map_batch_op){
+            .type = ucs_map_batch_insert, .k = &batch_keys[j]};
+    }
+
+    if(!ucs_map_apply_batch(map, batch, key_array_size)) {
+        printf("error: failed to apply batch\n");
+        goto cleanup;
+    }
+
+    unsigned batch_size = 0;
+    for(map_key k = 0; k != (2 * key_array_size); k += 4) {
+        if(k < key_array_size) {
+            batch_keys[batch_size] = k;
+            batch[batch_size] = (ucs_map_batch_op){
+                .type = ucs_map_batch_remove, .k = &batch_keys[batch_size]};
+        } else {
+            batch_keys[batch_size] = k + 1;
+            batch[batch_size] = (ucs_map_batch_op){
+                .type = ucs_map_batch_insert, .k = &batch_keys[batch_size]};
         }
+
+        ++batch_size;
     }
 
-    printf("\n\n");
+    if(!ucs_map_apply_batch(map, batch, batch_size)) {
+        printf("error: failed to apply batch\n");
+        goto cleanup;
+    }
 
-    // Insert new elements to the map.
-    printf("inserting half of the map's elements again:\n");
-    if(true) {
-        map_key* k = &keys[(ptrdiff_t)(map_size_expected / 2)];
-        for(unsigned i = 0; i < (map_size_expected / 2); ++i, ++k) {
-            printf("%4d ", (*k = key_rand() % 8192));
-            ucs_map_insert(map, k);
+    for(unsigned j = 0; j != batch_size; ++j) {
+        if((batch[j].type == ucs_map_batch_insert) &&
+           ((batch[j].i == NULL) ||
+            (((map_element*)(ucs_map_iterator_mem(batch[j].i)))->k !=
+             batch_keys[j]))) {
+            printf("error: wrong result of batch insertion of key %d\n",
+                   batch_keys[j]);
+            goto cleanup;
         }
+    }
 
-        map_size_expected = key_array_sort_and_remove_duplicates(keys);
+    ucs_map_batch_op_type const types[] = {
+        ucs_map_batch_insert, ucs_map_batch_remove, ucs_map_batch_insert,
+        ucs_map_batch_insert, ucs_map_batch_remove};
+    batch_size = array_size_(types);
+
+    for(unsigned j = 0; j != batch_size; ++j) {
+        batch_keys[j] = ((j < 3) ? 1 : 3);
+        batch[j] = (ucs_map_batch_op){.type = types[j], .k = &batch_keys[j]};
     }
 
-    printf("\n\n");
+    if(!ucs_map_apply_batch(map, batch, batch_size)) {
+        printf("error: failed to apply batch\n");
+        goto cleanup;
+    }
 
-    if(!map_validate_and_print(map, keys, map_size_expected)) {
-        result = EXIT_FAILURE;
+    if((batch[2].i == NULL) || (batch[4].i != NULL)) {
+        printf("error: wrong result of batch operations on the same key\n");
         goto cleanup;
     }
 
-    // Test lower bounds.
-    printf("testing lower bounds:\n");
-    if(true) {
-        map_key bounds[] = {5656, 2227, 6031, 893};
-        map_key expected[] = {5660, 2228, 6031, 896};
+    static map_key keys[2 * key_array_size];
+    unsigned map_size = 0;
 
-        for(size_t j = 0; j < array_size_(bounds); ++j) {
-            map_key k = bounds[j];
-            ucs_map_iterator i = ucs_map_lower_bound(map, &k);
+    for(map_key k = 0; k != (2 * key_array_size); ++k) {
+        bool is_present = (k < key_array_size) ? (((k % 4) == 2) || (k == 1))
+                                                : (((k % 2) == 0) ||
+                                                   ((k % 4) == 1));
+        if(is_present) {
+            keys[map_size++] = k;
+        }
+    }
 
-            if(i == NULL) {
-                printf("error: failed to find lower bound for %d\n", k);
+    result = map_validate_and_print(map, keys, map_size);
 
-                result = EXIT_FAILURE;
-                goto cleanup;
-            } else {
-                if(iter_value_(i).k != expected[j]) {
-                    printf(
-                        "error: wrong lower bound for %d (expected: %d, got: "
-                        "%d)\n",
-                        k, expected[j], iter_value_(i).k);
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
 
-                    result = EXIT_FAILURE;
-                    goto cleanup;
-                }
+////////////////////////////////////////////////////////////////////////////////
+// Hinted insertion test.
+////////////////////////////////////////////////////////////////////////////////
 
-                printf("k : %4d, e : %4d\n", k, iter_value_(i).k);
-            }
+static bool
+map_test_insert_hint() {
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = ucs_map_create_in_place(
+        (ucs_map_config){.element_alignment = alignof(map_element),
+                         .element_size = sizeof(map_element),
+                         .key_set_fn = map_key_set,
+                         .key_get_fn = map_key_get,
+                         .key_cmp_fn = map_key_cmp},
+        map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    map_key keys[key_array_size] = {};
+
+    // Append keys 1024, 1027, 1030, ... (NULL hint is the position past the
+    // last element), then prepend keys 1023, 1020, 1017, ... (hint is the
+    // first element).
+    for(map_key k = 1024; k < key_array_size; k += 3) {
+        ucs_map_insert_hint(map, NULL, &k);
+    }
+
+    for(map_key k = 1023; k < key_array_size; k -= 3) {
+        ucs_map_insert_hint(map, ucs_map_lower(map), &k);
+    }
+
+    // Insert the remaining keys using the previously inserted element as a
+    // hint. Every third key is inserted far from the hint.
+    ucs_map_iterator hint = ucs_map_lower(map);
+    for(map_key k = 0; k < key_array_size; ++k) {
+        map_key key = (((k % 3) == 2) ? (key_array_size - 1 - k) : k);
+
+        ucs_map_iterator i = ucs_map_insert_hint(map, hint, &key);
+        if((i == NULL) || (iter_value_(i).k != key)) {
+            printf("error: failed to insert key %d\n", key);
+            goto cleanup;
         }
 
-        if(true) {
-            map_key k = 8191;
-            ucs_map_iterator i = ucs_map_lower_bound(map, &k);
+        hint = i;
+    }
 
-            if(i != NULL) {
-                printf(
-                    "error: found lower bound for %d when none is expected\n",
-                    k);
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        keys[j] = j;
+    }
 
-                result = EXIT_FAILURE;
-                goto cleanup;
-            } else {
-                printf("k : %4d, e : none\n", k);
-            }
+    result = map_validate_and_print(map, keys, key_array_size);
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// B-tree map test.
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+map_test_btree() {
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = ucs_map_flag_btree |
+                                   ucs_map_flag_order_statistics,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    // B-tree maps do not support order statistics.
+    ucs_map_object_storage map_storage = {};
+    if(ucs_map_create_in_place(cfg, map_storage.mem) != NULL) {
+        printf("error: created B-tree map with order statistics\n");
+        return false;
+    }
+
+    cfg.flags = ucs_map_flag_btree;
+    ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    map_key keys[key_array_size] = {};
+    unsigned map_size_expected = 0;
+
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        keys[j] = key_rand() % 8192;
+
+        ucs_map_iterator i = ucs_map_insert(map, &keys[j]);
+        if((i == NULL) || (iter_value_(i).k != keys[j])) {
+            printf("error: failed to insert key %d\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    map_size_expected = key_array_sort_and_remove_duplicates(keys);
+    if(!map_validate_and_print(map, keys, map_size_expected)) {
+        goto cleanup;
+    }
+
+    // Remove every other key, so that the nodes are merged.
+    for(unsigned j = 0; j < map_size_expected; j += 2) {
+        if(!ucs_map_remove(map, &keys[j])) {
+            printf("error: failed to remove key %d\n", keys[j]);
+            goto cleanup;
         }
     }
 
+    for(unsigned j = 0; j < map_size_expected; ++j) {
+        keys[j / 2] = keys[j | 1];
+    }
+
+    map_size_expected /= 2;
+    if(!map_validate_and_print(map, keys, map_size_expected)) {
+        goto cleanup;
+    }
+
+    // Check search results.
+    for(map_key k = 0, j = 0; k != 8192; ++k) {
+        for(; (j != map_size_expected) && (keys[j] < k); ++j) {
+        }
+
+        ucs_map_iterator i = ucs_map_lower_bound(map, &k);
+        if((j == map_size_expected)
+               ? (i != NULL)
+               : ((i == NULL) || (iter_value_(i).k != keys[j]))) {
+            printf("error: wrong lower bound for key %d\n", k);
+            goto cleanup;
+        }
+
+        bool found = (j != map_size_expected) && (keys[j] == k);
+        if((ucs_map_find(map, &k) != NULL) != found) {
+            printf("error: wrong search result for key %d\n", k);
+            goto cleanup;
+        }
+    }
+
+    result = true;
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Frozen map test.
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns an order-preserving prefix of the given key. Different keys may have
+// the same prefix.
+static uint64_t
+map_key_prefix(ucs_map_key k) {
+    return *((map_key*)(k)) / 4;
+}
+
+static bool
+map_test_frozen(ucs_map_key_prefix_fn key_prefix_fn) {
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = ucs_map_create_in_place(
+        (ucs_map_config){.element_alignment = alignof(map_element),
+                         .element_size = sizeof(map_element),
+                         .key_set_fn = map_key_set,
+                         .key_get_fn = map_key_get,
+                         .key_cmp_fn = map_key_cmp,
+                         .key_prefix_fn = key_prefix_fn},
+        map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    ucs_map_frozen frozen = NULL;
+
+    // Check frozen maps of all sizes up to 300 (so that the last level of the
+    // implicit tree is filled partially and completely).
+    for(map_key n = 0; n != 300; ++n) {
+        if(n != 0) {
+            map_key k = 3 * n;
+            ucs_map_insert(map, &k);
+        }
+
+        if((frozen = ucs_map_freeze(map)) == NULL) {
+            printf("error: failed to freeze map\n");
+            goto cleanup;
+        }
+
+        if(ucs_map_frozen_size(frozen) != ucs_map_size(map)) {
+            printf("error: wrong size of frozen map\n");
+            goto cleanup;
+        }
+
+        // Iterate in both directions.
+        ucs_map_frozen_iterator j = ucs_map_frozen_lower(frozen);
+        for(ucs_map_iterator i = ucs_map_lower(map); i != NULL;
+            i = ucs_map_iterator_next(i), j = ucs_map_frozen_next(frozen, j)) {
+            if((j == 0) ||
+               (memcmp(ucs_map_frozen_mem(frozen, j), ucs_map_iterator_mem(i),
+                       sizeof(map_element)) != 0)) {
+                printf("error: wrong order of elements in frozen map\n");
+                goto cleanup;
+            }
+        }
+
+        if(j != 0) {
+            printf("error: frozen map has extra elements\n");
+            goto cleanup;
+        }
+
+        j = ucs_map_frozen_upper(frozen);
+        for(ucs_map_iterator i = ucs_map_upper(map); i != NULL;
+            i = ucs_map_iterator_prev(i), j = ucs_map_frozen_prev(frozen, j)) {
+            if((j == 0) ||
+               (memcmp(ucs_map_frozen_mem(frozen, j), ucs_map_iterator_mem(i),
+                       sizeof(map_element)) != 0)) {
+                printf("error: wrong order of elements in frozen map\n");
+                goto cleanup;
+            }
+        }
+
+        // Compare search results.
+        for(map_key k = 0; k != (3 * n + 2); ++k) {
+            ucs_map_iterator i = ucs_map_lower_bound(map, &k);
+            j = ucs_map_frozen_lower_bound(frozen, &k);
+
+            if((i == NULL) ? (j != 0)
+                           : ((j == 0) ||
+                              (((map_element*)(ucs_map_frozen_mem(frozen, j)))
+                                   ->k != iter_value_(i).k))) {
+                printf("error: wrong lower bound for key %d\n", k);
+                goto cleanup;
+            }
+
+            if((ucs_map_find(map, &k) != NULL) !=
+               (ucs_map_frozen_find(frozen, &k) != 0)) {
+                printf("error: wrong search result for key %d\n", k);
+                goto cleanup;
+            }
+        }
+
+        ucs_map_frozen_destroy(frozen);
+        frozen = NULL;
+    }
+
+    result = true;
+
+cleanup:
+    ucs_map_frozen_destroy(frozen);
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+static bool
+map_test_frozen_image(unsigned flags, ucs_map_key_prefix_fn key_prefix_fn) {
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp,
+                          .key_prefix_fn = key_prefix_fn};
+
+    ucs_map_object_storage map_storage[2] = {};
+    ucs_map map = ucs_map_create_in_place(cfg, map_storage[0].mem),
+            map_loaded = ucs_map_create_in_place(cfg, map_storage[1].mem);
+
+    if((map == NULL) || (map_loaded == NULL)) {
+        printf("error: failed to create map\n");
+        ucs_map_destroy_in_place(map);
+        return false;
+    }
+
+    bool result = false;
+    ucs_map_frozen frozen = NULL, opened = NULL;
+    FILE* file = NULL;
+    char* image = NULL;
+
+    map_key keys[key_array_size] = {};
+    unsigned const n = 1000;
+
+    for(unsigned j = 0; j != n; ++j) {
+        keys[j] = 3 * j;
+        ucs_map_insert(map, &keys[j]);
+    }
+
+    // Save the image to a file, and read it back to an aligned buffer (as if
+    // it was mapped into memory).
+    if(((frozen = ucs_map_freeze(map)) == NULL) ||
+       ((file = tmpfile()) == NULL) || !ucs_map_frozen_save(frozen, file)) {
+        printf("error: failed to save frozen map\n");
+        goto cleanup;
+    }
+
+    long image_size = ftell(file);
+    size_t const buffer_size =
+        ((size_t)(image_size) / ucs_map_frozen_image_alignment + 2) *
+        ucs_map_frozen_image_alignment;
+
+    if((image_size <= 0) || (fseek(file, 0, SEEK_SET) != 0) ||
+       ((image = aligned_alloc(
+             ucs_map_frozen_image_alignment, buffer_size)) == NULL) ||
+       (fread(image, 1, (size_t)(image_size), file) != (size_t)(image_size))) {
+        printf("error: failed to read frozen map's image\n");
+        goto cleanup;
+    }
+
+    // Check that incompatible and malformed images are rejected.
+    ucs_map_config cfg_wrong = cfg;
+    cfg_wrong.element_size += 1;
+
+    if((ucs_map_frozen_open(cfg_wrong, image, (size_t)(image_size)) != NULL) ||
+       (ucs_map_frozen_open(cfg, image, (size_t)(image_size) - 1) != NULL)) {
+        printf("error: opened incompatible image\n");
+        goto cleanup;
+    }
+
+    memmove(image + 8, image, (size_t)(image_size));
+    opened = ucs_map_frozen_open(cfg, image + 8, (size_t)(image_size));
+    memmove(image, image + 8, (size_t)(image_size));
+
+    if(opened != NULL) {
+        printf("error: opened misaligned image\n");
+        goto cleanup;
+    }
+
+    if((opened = ucs_map_frozen_open(cfg, image, (size_t)(image_size))) ==
+       NULL) {
+        printf("error: failed to open frozen map's image\n");
+        goto cleanup;
+    }
+
+    // Search the image in place.
+    for(map_key k = 0; k != (3 * n + 2); ++k) {
+        ucs_map_frozen_iterator i = ucs_map_frozen_lower_bound(frozen, &k),
+                                j = ucs_map_frozen_lower_bound(opened, &k);
+
+        if((i != j) || ((ucs_map_frozen_find(frozen, &k) != 0) !=
+                        (ucs_map_frozen_find(opened, &k) != 0))) {
+            printf("error: wrong search result for key %d\n", k);
+            goto cleanup;
+        }
+
+        if((j != 0) &&
+           (memcmp(ucs_map_frozen_mem(frozen, i),
+                   ucs_map_frozen_mem(opened, j), sizeof(map_element)) != 0)) {
+            printf("error: wrong element in the image\n");
+            goto cleanup;
+        }
+    }
+
+    // A map with another element size rejects the image, and keeps its
+    // content.
+    ucs_map_object_storage map_wrong_storage = {};
+    ucs_map map_wrong =
+        ucs_map_create_in_place(cfg_wrong, map_wrong_storage.mem);
+
+    bool const is_rejected = (map_wrong != NULL) &&
+                             (ucs_map_insert(map_wrong, &keys[1]) != NULL) &&
+                             !ucs_map_thaw(map_wrong, opened) &&
+                             (ucs_map_size(map_wrong) == 1);
+
+    ucs_map_destroy_in_place(map_wrong);
+    if(!is_rejected) {
+        printf("error: incompatible image was not rejected cleanly\n");
+        goto cleanup;
+    }
+
+    // Load the image into a map.
+    ucs_map_insert(map_loaded, &keys[1]);
+    if(!ucs_map_thaw(map_loaded, opened)) {
+        printf("error: failed to load frozen map\n");
+        goto cleanup;
+    }
+
+    result = map_validate_and_print(map_loaded, keys, n);
+
+cleanup:
+    if(file != NULL) {
+        fclose(file);
+    }
+
+    ucs_map_frozen_destroy(opened);
+    ucs_map_frozen_destroy(frozen);
+    free(image);
+
+    ucs_map_destroy_in_place(map_loaded);
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Key prefix test.
+////////////////////////////////////////////////////////////////////////////////
+
+// Element of a map with string keys.
+typedef struct {
+    char k[24];
+} map_string_element;
+
+static void
+map_string_key_set(ucs_map_key k, char* mem) {
+    map_string_element* x = (map_string_element*)(mem);
+    snprintf(x->k, sizeof(x->k), "%s", (char const*)(k));
+}
+
+static ucs_map_key
+map_string_key_get(char* mem) {
+    return ((map_string_element*)(mem))->k;
+}
+
+static unsigned map_string_key_cmp_count = 0;
+
+static int
+map_string_key_cmp(ucs_map_key k0, ucs_map_key k1) {
+    map_string_key_cmp_count++;
+    return strcmp(k0, k1);
+}
+
+// Returns the first 8 characters of the given string (padded with zeros), in
+// big-endian order.
+static uint64_t
+map_string_key_prefix(ucs_map_key k) {
+    unsigned char const* s = k;
+    uint64_t prefix = 0;
+
+    for(int j = 0; j != 8; ++j) {
+        prefix = (prefix << 8) | *s;
+        s += ((*s != '\0') ? 1 : 0);
+    }
+
+    return prefix;
+}
+
+static bool
+map_test_key_prefixes(unsigned flags) {
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = ucs_map_create_in_place(
+        (ucs_map_config){.element_alignment = alignof(map_string_element),
+                         .element_size = sizeof(map_string_element),
+                         .flags = flags,
+                         .key_set_fn = map_string_key_set,
+                         .key_get_fn = map_string_key_get,
+                         .key_cmp_fn = map_string_key_cmp,
+                         .key_prefix_fn = map_string_key_prefix},
+        map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    // Keys of the form "%04u" have distinct prefixes, keys of the form
+    // "prefix-%04u" share the same prefix.
+    enum { n = 512 };
+    char keys[2 * n][24] = {};
+    bool result = false;
+
+    for(unsigned j = 0; j != n; ++j) {
+        snprintf(keys[j], sizeof(keys[j]), "%04u", j);
+        snprintf(keys[n + j], sizeof(keys[n + j]), "prefix-%04u", j);
+    }
+
+    for(unsigned j = 0; j != (2 * n); ++j) {
+        unsigned l = (j * 1237) % (2 * n);
+        if(ucs_map_insert(map, keys[l]) == NULL) {
+            printf("error: failed to insert key %s\n", keys[l]);
+            goto cleanup;
+        }
+    }
+
+    // Searching for keys with distinct prefixes must not call the comparison
+    // function.
+    map_string_key_cmp_count = 0;
+    for(unsigned j = 0; j != n; ++j) {
+        ucs_map_iterator i = ucs_map_find(map, keys[j]);
+        if((i == NULL) || (strcmp(ucs_map_iterator_mem(i), keys[j]) != 0)) {
+            printf("error: failed to find key %s\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    if(map_string_key_cmp_count != n) {
+        printf("error: wrong number of key comparisons: %u\n",
+               map_string_key_cmp_count);
+        goto cleanup;
+    }
+
+    // Remove every other key, then check the order and search results.
+    for(unsigned j = 0; j < (2 * n); j += 2) {
+        if(!ucs_map_remove(map, keys[j])) {
+            printf("error: failed to remove key %s\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    if(true) {
+        unsigned j = 1;
+        for(ucs_map_iterator i = ucs_map_lower(map); i != NULL;
+            i = ucs_map_iterator_next(i), j += 2) {
+            if((j >= (2 * n)) ||
+               (strcmp(ucs_map_iterator_mem(i), keys[j]) != 0)) {
+                printf("error: wrong order of keys\n");
+                goto cleanup;
+            }
+        }
+
+        if(j != ((2 * n) + 1)) {
+            printf("error: wrong number of keys\n");
+            goto cleanup;
+        }
+    }
+
+    for(unsigned j = 0; j != (2 * n); ++j) {
+        ucs_map_iterator i = ucs_map_lower_bound(map, keys[j]);
+        if((i == NULL) || (strcmp(ucs_map_iterator_mem(i), keys[j | 1]) != 0)) {
+            printf("error: wrong lower bound for key %s\n", keys[j]);
+            goto cleanup;
+        }
+
+        if(ucs_map_rank(map, keys[j]) != (j / 2)) {
+            printf("error: wrong rank of key %s\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    // Rebuild the map from sorted keys.
+    if(!ucs_map_build_sorted_array(map, keys, sizeof(keys[0]), 2 * n)) {
+        printf("error: failed to build the map\n");
+        goto cleanup;
+    }
+
+    result = true;
+    for(unsigned j = 0; j != (2 * n); ++j) {
+        if(ucs_map_find(map, keys[j]) != ucs_map_select(map, j)) {
+            printf("error: failed to find key %s\n", keys[j]);
+
+            result = false;
+            break;
+        }
+    }
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Type-specialized map test.
+////////////////////////////////////////////////////////////////////////////////
+
+// Defines functions typed_map_config, typed_map_find, typed_map_insert, etc.,
+// which work with a map of {map_element} objects keyed by {map_element::k}.
+UCS_MAP_DEFINE(typed_map, map_element, map_key, k, UCS_MAP_SCALAR_CMP)
+
+static bool
+map_test_typed() {
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = typed_map_create_in_place(map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    map_key keys[key_array_size] = {};
+
+    // Insert keys 0, 2, 4, ... in random order, then remove keys divisible by
+    // 4.
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        map_key k = 2 * ((j * 1237) % key_array_size);
+
+        ucs_map_iterator i = typed_map_insert(map, k);
+        if((i == NULL) || (typed_map_mem(i)->k != k)) {
+            printf("error: failed to insert key %d\n", k);
+            goto cleanup;
+        }
+    }
+
+    for(map_key k = 0; k < (2 * key_array_size); k += 4) {
+        if(!typed_map_remove(map, k)) {
+            printf("error: failed to remove key %d\n", k);
+            goto cleanup;
+        }
+    }
+
+    for(map_key k = 0; k < (2 * key_array_size); ++k) {
+        ucs_map_iterator i = typed_map_find(map, k), j = ucs_map_find(map, &k);
+        if((i != j) || ((i != NULL) != ((k % 4) == 2))) {
+            printf("error: wrong search result for key %d\n", k);
+            goto cleanup;
+        }
+
+        i = typed_map_lower_bound(map, k);
+        j = ucs_map_lower_bound(map, &k);
+        if(i != j) {
+            printf("error: wrong lower bound for key %d\n", k);
+            goto cleanup;
+        }
+    }
+
+    for(unsigned j = 0; j != (key_array_size / 2); ++j) {
+        keys[j] = 4 * j + 2;
+    }
+
+    result = map_validate_and_print(map, keys, key_array_size / 2);
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Concurrent map test.
+////////////////////////////////////////////////////////////////////////////////
+
+enum { concurrent_test_reader_count = 4, concurrent_test_round_count = 64 };
+
+typedef struct map_test_reader {
+    ucs_map map;
+    atomic_bool* done;
+
+    // Results.
+    size_t error_count, validated_iteration_count;
+} map_test_reader;
+
+static int
+map_test_reader_run(void* context) {
+    // Even keys are never removed, so they must always be found. Odd keys are
+    // inserted and removed by the writer.
+    map_test_reader* reader = context;
+    ucs_map map = reader->map;
+
+    for(map_key k = 0; !atomic_load(reader->done);
+        k = (k + 2) % (2 * key_array_size)) {
+        ucs_map_read_section s = ucs_map_read_begin(map);
+
+        ucs_map_iterator i = ucs_map_find(map, &k);
+        if((i == NULL) || (iter_value_(i).k != k)) {
+            reader->error_count++;
+        }
+
+        map_key k_odd = k + 1;
+        i = ucs_map_lower_bound(map, &k_odd);
+        if((i == NULL) ? (k_odd != (2 * key_array_size - 1))
+                       : ((iter_value_(i).k != k_odd) &&
+                          (iter_value_(i).k != (k_odd + 1)))) {
+            reader->error_count++;
+        }
+
+        // Iterate over a few elements. The result is checked only if the map
+        // was not modified in the meantime.
+        map_key k_prev = k;
+        bool is_sorted = true;
+
+        for(unsigned j = 0; (i != NULL) && (j != 8);
+            ++j, i = ucs_map_iterator_next(i)) {
+            is_sorted = is_sorted && (iter_value_(i).k > k_prev);
+            k_prev = iter_value_(i).k;
+        }
+
+        // Read a few elements with a cursor.
+        char* elements[8];
+        ucs_map_cursor c = ucs_map_cursor_at(map, &k_odd);
+        size_t n = ucs_map_cursor_read_ptrs(map, &c, elements, 8);
+
+        for(size_t j = 1; j < n; ++j) {
+            is_sorted = is_sorted && (((map_element*)(elements[j - 1]))->k <
+                                      ((map_element*)(elements[j]))->k);
+        }
+
+        if(ucs_map_read_validate(map, &s)) {
+            reader->validated_iteration_count++;
+            reader->error_count += (is_sorted ? 0 : 1);
+        }
+
+        ucs_map_read_end(map, &s);
+    }
+
+    return 0;
+}
+
+static bool
+map_test_concurrent() {
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = ucs_map_flag_btree | ucs_map_flag_concurrent,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    // B-tree maps do not support concurrent readers.
+    ucs_map_object_storage map_storage = {};
+    if(ucs_map_create_in_place(cfg, map_storage.mem) != NULL) {
+        printf("error: created concurrent B-tree map\n");
+        return false;
+    }
+
+    cfg.flags = ucs_map_flag_concurrent | ucs_map_flag_order_statistics;
+    ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    map_key keys[key_array_size] = {};
+
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        keys[j] = 2 * j;
+    }
+
+    if(!ucs_map_build_sorted_array(map, keys, sizeof(map_key), key_array_size)) {
+        printf("error: failed to build map\n");
+        goto cleanup;
+    }
+
+    // Removed elements are retired, and freed by reclamation.
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        if(!ucs_map_remove(map, &keys[j])) {
+            printf("error: failed to remove key %d\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    if(!ucs_map_reclaim(map) || !ucs_map_reclaim(map)) {
+        printf("error: failed to reclaim removed elements\n");
+        goto cleanup;
+    }
+
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        if(ucs_map_insert(map, &keys[j]) == NULL) {
+            printf("error: failed to insert key %d\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    // A running reader prevents reclamation of elements removed after it
+    // started.
+    ucs_map_read_section s = ucs_map_read_begin(map);
+    map_key k = 1;
+
+    if((ucs_map_insert(map, &k) == NULL) || !ucs_map_remove(map, &k)) {
+        printf("error: failed to insert and remove key %d\n", k);
+        ucs_map_read_end(map, &s);
+        goto cleanup;
+    }
+
+    bool is_reclaimed = ucs_map_reclaim(map) && ucs_map_reclaim(map);
+    ucs_map_read_end(map, &s);
+
+    if(is_reclaimed || ucs_map_read_validate(map, &s)) {
+        printf("error: reclaimed elements while a reader was running\n");
+        goto cleanup;
+    }
+
+    // Run readers while inserting and removing odd keys.
+    atomic_bool done = false;
+    map_test_reader readers[concurrent_test_reader_count] = {};
+    thrd_t threads[concurrent_test_reader_count] = {};
+    unsigned thread_count = 0;
+
+    for(; thread_count != concurrent_test_reader_count; ++thread_count) {
+        readers[thread_count] =
+            (map_test_reader){.map = map, .done = &done};
+
+        if(thrd_create(&threads[thread_count], map_test_reader_run,
+                       &readers[thread_count]) != thrd_success) {
+            printf("error: failed to create thread\n");
+            break;
+        }
+    }
+
+    bool is_writer_ok = (thread_count == concurrent_test_reader_count);
+
+    for(unsigned round = 0;
+        is_writer_ok && (round != concurrent_test_round_count); ++round) {
+        for(unsigned j = 0; is_writer_ok && (j != key_array_size); ++j) {
+            map_key k_odd = 2 * ((j * 1237) % key_array_size) + 1;
+            is_writer_ok = (ucs_map_insert(map, &k_odd) != NULL);
+        }
+
+        for(unsigned j = 0; is_writer_ok && (j != key_array_size); ++j) {
+            map_key k_odd = 2 * ((j * 853) % key_array_size) + 1;
+            is_writer_ok = ucs_map_remove(map, &k_odd);
+        }
+    }
+
+    atomic_store(&done, true);
+
+    size_t error_count = 0, validated_iteration_count = 0;
+    for(unsigned j = 0; j != thread_count; ++j) {
+        thrd_join(threads[j], NULL);
+
+        error_count += readers[j].error_count;
+        validated_iteration_count += readers[j].validated_iteration_count;
+    }
+
+    printf("validated iterations: %zu\n", validated_iteration_count);
+
+    if(!is_writer_ok || (error_count != 0)) {
+        printf("error: concurrent test failed, %zu reader errors\n",
+               error_count);
+        goto cleanup;
+    }
+
+    result = map_validate_and_print(map, keys, key_array_size);
+
+    // Clearing waits for readers.
+    ucs_map_clear(map);
+    result = result && (ucs_map_size(map) == 0) && (ucs_map_lower(map) == NULL);
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Persistent map test.
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+    persistent_test_key_range = 1024,
+    persistent_test_snapshot_count = 16,
+    persistent_test_snapshot_period = 256
+};
+
+static bool
+pmap_validate(ucs_pmap_snapshot s,
+              bool const present[static persistent_test_key_range]) {
+    unsigned size = 0;
+    for(map_key k = 0; k != persistent_test_key_range; ++k) {
+        size += (present[k] ? 1 : 0);
+
+        ucs_pmap_iterator i = ucs_pmap_find(s, &k);
+        if((i != NULL) != present[k]) {
+            printf("error: wrong search result for key %d\n", k);
+            return false;
+        }
+
+        i = ucs_pmap_lower_bound(s, &k);
+        if((i != NULL) && ((((map_element*)(ucs_pmap_iterator_mem(i)))->k <
+                            k) != false)) {
+            printf("error: wrong lower bound for key %d\n", k);
+            return false;
+        }
+    }
+
+    if(ucs_pmap_size(s) != size) {
+        printf("error: ucs_pmap_size returned %zu, expected: %d\n",
+               ucs_pmap_size(s), size);
+        return false;
+    }
+
+    // Iterate in both directions.
+    map_key k = 0;
+    unsigned n = 0;
+
+    for(ucs_pmap_iterator i = ucs_pmap_lower(s); i != NULL;
+        i = ucs_pmap_iterator_next(s, i), ++k, ++n) {
+        for(; (k != persistent_test_key_range) && !present[k]; ++k) {
+        }
+
+        if((k == persistent_test_key_range) ||
+           (((map_element*)(ucs_pmap_iterator_mem(i)))->k != k)) {
+            printf("error: wrong element order\n");
+            return false;
+        }
+    }
+
+    for(ucs_pmap_iterator i = ucs_pmap_upper(s); i != NULL;
+        i = ucs_pmap_iterator_prev(s, i)) {
+        n--;
+    }
+
+    if((n != 0) || (k > persistent_test_key_range)) {
+        printf("error: wrong number of elements\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+map_test_persistent() {
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = ucs_map_flag_order_statistics,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    // Persistent maps do not support map flags.
+    ucs_pmap_object_storage pmap_storage = {};
+    if(ucs_pmap_create_in_place(cfg, pmap_storage.mem) != NULL) {
+        printf("error: created persistent map with flags\n");
+        return false;
+    }
+
+    cfg.flags = 0;
+    ucs_pmap pmap = ucs_pmap_create_in_place(cfg, pmap_storage.mem);
+
+    if(pmap == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+
+    static bool present[persistent_test_snapshot_count + 1]
+                       [persistent_test_key_range];
+    memset(present, 0, sizeof(present));
+
+    ucs_pmap_snapshot snapshots[persistent_test_snapshot_count] = {};
+    bool* current = present[persistent_test_snapshot_count];
+
+    // Randomly insert and remove keys, taking snapshots periodically.
+    for(unsigned j = 0; j != persistent_test_snapshot_count; ++j) {
+        for(unsigned op = 0; op != persistent_test_snapshot_period; ++op) {
+            map_key k = key_rand() % persistent_test_key_range;
+
+            if((key_rand() % 3) == 0) {
+                if(ucs_pmap_remove(pmap, &k) != current[k]) {
+                    printf("error: wrong result of removal of key %d\n", k);
+                    goto cleanup;
+                }
+
+                current[k] = false;
+            } else {
+                ucs_pmap_iterator i = ucs_pmap_insert(pmap, &k);
+                if((i == NULL) ||
+                   (((map_element*)(ucs_pmap_iterator_mem(i)))->k != k)) {
+                    printf("error: failed to insert key %d\n", k);
+                    goto cleanup;
+                }
+
+                current[k] = true;
+            }
+        }
+
+        if((snapshots[j] = ucs_pmap_snapshot_take(pmap)) == NULL) {
+            printf("error: failed to take snapshot\n");
+            goto cleanup;
+        }
+
+        memcpy(present[j], current, sizeof(present[j]));
+    }
+
+    // Modify the map after the last snapshot.
+    for(map_key k = 0; k < persistent_test_key_range; k += 3) {
+        if(current[k]) {
+            ucs_pmap_remove(pmap, &k);
+        } else {
+            ucs_pmap_insert(pmap, &k);
+        }
+
+        current[k] = !current[k];
+    }
+
+    // Check all versions, then release every other snapshot and check again.
+    for(unsigned pass = 0; pass != 2; ++pass) {
+        for(unsigned j = 0; j != persistent_test_snapshot_count; ++j) {
+            if((snapshots[j] != NULL) &&
+               !pmap_validate(snapshots[j], present[j])) {
+                printf("error: snapshot %d is corrupted\n", j);
+                goto cleanup;
+            }
+        }
+
+        if(!pmap_validate(ucs_pmap_current(pmap), current)) {
+            goto cleanup;
+        }
+
+        for(unsigned j = 0; j < persistent_test_snapshot_count; j += 2) {
+            ucs_pmap_snapshot_release(snapshots[j]);
+            snapshots[j] = NULL;
+        }
+    }
+
+    // Clearing the map does not affect snapshots.
+    ucs_pmap_clear(pmap);
+    memset(current, 0, persistent_test_key_range * sizeof(bool));
+
+    result = pmap_validate(ucs_pmap_current(pmap), current) &&
+             pmap_validate(snapshots[1], present[1]);
+
+cleanup:
+    for(unsigned j = 0; j != persistent_test_snapshot_count; ++j) {
+        ucs_pmap_snapshot_release(snapshots[j]);
+    }
+
+    ucs_pmap_destroy_in_place(pmap);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Fixed memory region test.
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+map_test_region(unsigned flags) {
+    static char alignas(64) region_mem[16384];
+
+    // Check that an allocator carves exactly the requested number of blocks.
+    ucs_allocator_region region = {
+        .begin = region_mem, .end = region_mem + sizeof(region_mem)};
+
+    ucs_allocator_config alloc_cfg = {
+        .block_size = 16,
+        .element_alignment = alignof(map_element),
+        .element_size = sizeof(map_element),
+        .region_fn = ucs_allocator_region_carve,
+        .region_context = &region};
+
+    size_t block_allocation_size =
+        ucs_allocator_block_allocation_size(alloc_cfg);
+
+    if((block_allocation_size == 0) ||
+       (block_allocation_size > (sizeof(region_mem) / 2))) {
+        printf("error: wrong block allocation size\n");
+        return false;
+    }
+
+    region.end = region_mem + 2 * block_allocation_size;
+
+    ucs_allocator_object_storage allocator_storage = {};
+    ucs_allocator allocator =
+        ucs_allocator_create_in_place(alloc_cfg, allocator_storage.mem);
+
+    if(allocator == NULL) {
+        printf("error: failed to create allocator\n");
+        return false;
+    }
+
+    for(size_t j = 0; j != 2 * alloc_cfg.block_size; ++j) {
+        char* mem = ucs_allocator_alloc(allocator);
+        if((mem < region_mem) || (mem >= region.end)) {
+            printf("error: allocated memory outside of the region\n");
+            ucs_allocator_destroy_in_place(allocator);
+            return false;
+        }
+    }
+
+    if(ucs_allocator_alloc(allocator) != NULL) {
+        printf("error: allocated memory from exhausted region\n");
+        ucs_allocator_destroy_in_place(allocator);
+        return false;
+    }
+
+    ucs_allocator_destroy_in_place(allocator);
+
+    // Fill a map until its region is exhausted.
+    region = (ucs_allocator_region){
+        .begin = region_mem, .end = region_mem + sizeof(region_mem)};
+
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp,
+                          .region_fn = ucs_allocator_region_carve,
+                          .region_context = &region};
+
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    map_key keys[key_array_size] = {};
+    unsigned n = 0;
+
+    for(; n != key_array_size; ++n) {
+        keys[n] = 2 * n;
+        if(ucs_map_insert(map, &keys[n]) == NULL) {
+            break;
+        }
+    }
+
+    if((n == 0) || (n == key_array_size) ||
+       !map_validate_and_print(map, keys, n)) {
+        printf("error: wrong number of elements in exhausted region\n");
+        goto cleanup;
+    }
+
+    // Memory of removed elements is reused.
+    keys[0] = 1;
+    if(!ucs_map_remove(map, &(map_key){0}) ||
+       (ucs_map_insert(map, &keys[0]) == NULL)) {
+        printf("error: failed to reuse memory in exhausted region\n");
+        goto cleanup;
+    }
+
+    // Clearing the map keeps its blocks.
+    ucs_map_clear(map);
+    for(unsigned j = 0; j != n; ++j) {
+        if(ucs_map_insert(map, &keys[j]) == NULL) {
+            printf("error: failed to reuse memory after clearing\n");
+            goto cleanup;
+        }
+    }
+
+    result = true;
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory release test.
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+allocator_test_shrink(unsigned flags) {
+    // Free every slot except for a few in the first blocks, and check that
+    // shrinking keeps live slots intact, and that freed slots remain usable.
+    ucs_allocator_config alloc_cfg = {.block_size = 4,
+                                      .element_alignment = alignof(size_t),
+                                      .element_size = sizeof(size_t),
+                                      .flags = flags};
+
+    ucs_allocator_object_storage allocator_storage = {};
+    ucs_allocator allocator =
+        ucs_allocator_create_in_place(alloc_cfg, allocator_storage.mem);
+
+    if(allocator == NULL) {
+        printf("error: failed to create allocator\n");
+        return false;
+    }
+
+    size_t* slots[64] = {};
+    for(size_t j = 0; j != array_size_(slots); ++j) {
+        if((slots[j] = ucs_allocator_alloc(allocator)) == NULL) {
+            printf("error: failed to allocate memory\n");
+            ucs_allocator_destroy_in_place(allocator);
+            return false;
+        }
+
+        *(slots[j]) = j;
+    }
+
+    for(size_t j = 0; j != array_size_(slots); ++j) {
+        if((j % 5 != 0) || (j >= 16)) {
+            ucs_allocator_free(allocator, slots[j]);
+            slots[j] = NULL;
+        }
+    }
+
+    // 4 slots are live, and 12 blocks are empty.
+    if((ucs_allocator_shrink(allocator, 32) == 0) ||
+       (ucs_allocator_shrink(allocator, 0) == 0) ||
+       (ucs_allocator_shrink(allocator, 0) != 0)) {
+        printf("error: failed to shrink allocator\n");
+        ucs_allocator_destroy_in_place(allocator);
+        return false;
+    }
+
+    for(size_t j = 0; j != array_size_(slots); ++j) {
+        if(slots[j] == NULL) {
+            if((slots[j] = ucs_allocator_alloc(allocator)) == NULL) {
+                printf("error: failed to allocate memory\n");
+                ucs_allocator_destroy_in_place(allocator);
+                return false;
+            }
+
+            *(slots[j]) = j;
+        }
+    }
+
+    for(size_t j = 0; j != array_size_(slots); ++j) {
+        if(*(slots[j]) != j) {
+            printf("error: slot %d is shared\n", (int)(j));
+            ucs_allocator_destroy_in_place(allocator);
+            return false;
+        }
+    }
+
+    // Check that all slots are reused after freeing them at once.
+    ucs_allocator_free_all(allocator);
+    for(size_t j = 0; j != array_size_(slots); ++j) {
+        if((slots[j] = ucs_allocator_alloc(allocator)) == NULL) {
+            printf("error: failed to allocate memory\n");
+            ucs_allocator_destroy_in_place(allocator);
+            return false;
+        }
+
+        *(slots[j]) = j;
+    }
+
+    bool result = (ucs_allocator_shrink(allocator, 0) == 0);
+    for(size_t j = 0; j != array_size_(slots); ++j) {
+        result = result && (*(slots[j]) == j);
+    }
+
+    if(!result) {
+        printf("error: wrong allocation after freeing all slots\n");
+    }
+
+    ucs_allocator_destroy_in_place(allocator);
+    return result;
+}
+
+static bool
+map_test_shrink(unsigned flags) {
+    if(!allocator_test_shrink(0) ||
+       !allocator_test_shrink(ucs_allocator_flag_intrusive)) {
+        return false;
+    }
+
+    // Remove most of the elements from maps with and without automatic
+    // trimming.
+    size_t released[2] = {};
+    for(size_t t = 0; t != 2; ++t) {
+        ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                              .element_size = sizeof(map_element),
+                              .flags = flags,
+                              .key_set_fn = map_key_set,
+                              .key_get_fn = map_key_get,
+                              .key_cmp_fn = map_key_cmp,
+                              .trim_high_watermark = 512 * t,
+                              .trim_low_watermark = 128 * t};
+
+        ucs_map_object_storage map_storage = {};
+        ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+        if(map == NULL) {
+            printf("error: failed to create map\n");
+            return false;
+        }
+
+        map_key keys[key_array_size] = {};
+        for(unsigned j = 0; j != key_array_size; ++j) {
+            keys[j] = j;
+            if(ucs_map_insert(map, &keys[j]) == NULL) {
+                printf("error: failed to insert key %d\n", keys[j]);
+                ucs_map_destroy_in_place(map);
+                return false;
+            }
+        }
+
+        for(unsigned j = key_array_size / 8; j != key_array_size; ++j) {
+            if(!ucs_map_remove(map, &keys[j])) {
+                printf("error: failed to remove key %d\n", keys[j]);
+                ucs_map_destroy_in_place(map);
+                return false;
+            }
+        }
+
+        released[t] = ucs_map_shrink_to_fit(map);
+
+        bool result = map_validate_and_print(map, keys, key_array_size / 8);
+        for(unsigned j = key_array_size / 8; j != key_array_size; ++j) {
+            result = result && (ucs_map_insert(map, &keys[j]) != NULL);
+        }
+
+        result = result && map_validate_and_print(map, keys, key_array_size);
+        ucs_map_destroy_in_place(map);
+
+        if(!result) {
+            printf("error: wrong map contents after shrinking\n");
+            return false;
+        }
+    }
+
+    if((released[0] == 0) || (released[1] >= released[0])) {
+        printf("error: wrong amount of released memory\n");
+        return false;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Block growth and memory reservation test.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    size_t n_calls, sizes[256];
+    void* blocks[256];
+} map_region_log;
+
+// Allocates memory with the system allocator, and logs the allocations. The
+// memory is freed by the test.
+static void*
+map_region_log_alloc(void* context, size_t size, size_t alignment) {
+    map_region_log* log = context;
+    if(log->n_calls == array_size_(log->sizes)) {
+        return NULL;
+    }
+
+    size_t padding = (alignment - size % alignment) % alignment;
+    void* mem = aligned_alloc(alignment, size + padding);
+
+    if(mem != NULL) {
+        log->sizes[log->n_calls] = size;
+        log->blocks[log->n_calls++] = mem;
+    }
+
+    return mem;
+}
+
+static bool
+map_test_reserve(unsigned flags) {
+    map_region_log log = {};
+
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp,
+                          .block_size = 4,
+                          .max_block_size = 64,
+                          .region_fn = map_region_log_alloc,
+                          .region_context = &log};
+
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    map_key keys[key_array_size] = {};
+
+    for(unsigned j = 0; j != 256; ++j) {
+        keys[j] = j;
+        if(ucs_map_insert(map, &keys[j]) == NULL) {
+            printf("error: failed to insert key %d\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    // Blocks grow geometrically up to the limit (B-tree maps interleave
+    // blocks of two allocators).
+    size_t n_calls = log.n_calls;
+    for(size_t j = 1; (flags == 0) && (j != n_calls); ++j) {
+        if((log.sizes[j] < log.sizes[j - 1]) ||
+           (log.sizes[j] > 2 * log.sizes[j - 1])) {
+            printf("error: wrong block growth\n");
+            goto cleanup;
+        }
+    }
+
+    if((flags == 0) && ((n_calls < 5) || (log.sizes[n_calls - 1] !=
+                                          log.sizes[n_calls - 2]))) {
+        printf("error: wrong number of blocks\n");
+        goto cleanup;
+    }
+
+    // After reservation, insertions do not allocate memory.
+    if(!ucs_map_reserve(map, key_array_size) || (log.n_calls == n_calls)) {
+        printf("error: failed to reserve memory\n");
+        goto cleanup;
+    }
+
+    n_calls = log.n_calls;
+    for(unsigned j = 256; j != key_array_size; ++j) {
+        keys[j] = j;
+        if(ucs_map_insert(map, &keys[j]) == NULL) {
+            printf("error: failed to insert key %d\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    if(log.n_calls != n_calls) {
+        printf("error: memory was allocated after reservation\n");
+        goto cleanup;
+    }
+
+    result = map_validate_and_print(map, keys, key_array_size);
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+
+    // Blocks obtained from a region function are not freed by the map.
+    for(size_t j = 0; j != log.n_calls; ++j) {
+        free(log.blocks[j]);
+    }
+
+    return result;
+}
+
+static bool
+map_test_huge_pages(unsigned flags) {
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags | ucs_map_flag_huge_pages,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    map_key keys[key_array_size] = {};
+
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        keys[j] = key_rand() % 8192;
+        if(ucs_map_insert(map, &keys[j]) == NULL) {
+            printf("error: failed to insert key %d\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    unsigned map_size_expected = key_array_sort_and_remove_duplicates(keys);
+    for(unsigned j = 0; j < map_size_expected; j += 2) {
+        ucs_map_remove(map, &keys[j]);
+    }
+
+    for(unsigned j = 0; j < map_size_expected; ++j) {
+        keys[j / 2] = keys[j | 1];
+    }
+
+    ucs_map_shrink_to_fit(map);
+    result = map_validate_and_print(map, keys, map_size_expected / 2);
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Upstream memory functions test.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    size_t n_calls, n_allocations, n_bytes;
+
+    // If not zero, then allocations fail after this number of calls.
+    size_t max_calls;
+} map_upstream_log;
+
+static void*
+map_upstream_log_alloc(void* context, size_t size, size_t alignment) {
+    map_upstream_log* log = context;
+
+    if((log->max_calls != 0) && (log->n_calls == log->max_calls)) {
+        return NULL;
+    }
+
+    size_t padding = (alignment - size % alignment) % alignment;
+    void* mem = aligned_alloc(alignment, size + padding);
+
+    if(mem != NULL) {
+        log->n_calls++;
+        log->n_allocations++;
+        log->n_bytes += size;
+    }
+
+    return mem;
+}
+
+static void
+map_upstream_log_free(void* context, void* mem, size_t size) {
+    map_upstream_log* log = context;
+
+    log->n_allocations--;
+    log->n_bytes -= size;
+    free(mem);
+}
+
+static bool
+map_test_upstream(unsigned flags) {
+    map_upstream_log log = {};
+
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp,
+                          .block_size = 4,
+                          .region_fn = map_upstream_log_alloc,
+                          .deallocate_fn = map_upstream_log_free,
+                          .region_context = &log};
+
+    ucs_map map = ucs_map_create(cfg);
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    map_key keys[key_array_size] = {};
+
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        keys[j] = j;
+        if(ucs_map_insert(map, &keys[j]) == NULL) {
+            printf("error: failed to insert key %d\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    // Removals from concurrent maps fill the limbo lists.
+    for(unsigned j = 0; j < key_array_size; j += 2) {
+        ucs_map_remove(map, &keys[j]);
+    }
+
+    for(unsigned j = 0; j < key_array_size; ++j) {
+        keys[j / 2] = keys[j | 1];
+    }
+
+    ucs_map_shrink_to_fit(map);
+
+    ucs_map_frozen frozen = ucs_map_freeze(map);
+    if(frozen == NULL) {
+        printf("error: failed to freeze map\n");
+        goto cleanup;
+    }
+
+    ucs_map_frozen_destroy(frozen);
+    result = map_validate_and_print(map, keys, key_array_size / 2);
+
+cleanup:
+    ucs_map_destroy(map);
+
+    if(result && ((log.n_calls < 3) || (log.n_allocations != 0) ||
+                  (log.n_bytes != 0))) {
+        printf("error: %zu allocations (%zu bytes) were not freed\n",
+               log.n_allocations, log.n_bytes);
+        result = false;
+    }
+
+    return result;
+}
+
+static bool
+pmap_test_upstream() {
+    map_upstream_log log = {};
+
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp,
+                          .region_fn = map_upstream_log_alloc,
+                          .deallocate_fn = map_upstream_log_free,
+                          .region_context = &log};
+
+    ucs_pmap pmap = ucs_pmap_create(cfg);
+    if(pmap == NULL) {
+        printf("error: failed to create persistent map\n");
+        return false;
+    }
+
+    bool result = false;
+    ucs_pmap_snapshot s = NULL;
+
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        map_key k = j;
+        if(ucs_pmap_insert(pmap, &k) == NULL) {
+            printf("error: failed to insert key %d\n", k);
+            goto cleanup;
+        }
+
+        // Snapshots make modifications copy nodes.
+        if((j % 64) == 0) {
+            ucs_pmap_snapshot_release(s);
+            if((s = ucs_pmap_snapshot_take(pmap)) == NULL) {
+                printf("error: failed to take snapshot\n");
+                goto cleanup;
+            }
+        }
+    }
+
+    result = (ucs_pmap_size(ucs_pmap_current(pmap)) == key_array_size);
+    if(!result) {
+        printf("error: wrong size of persistent map\n");
+    }
+
+cleanup:
+    ucs_pmap_snapshot_release(s);
+    ucs_pmap_destroy(pmap);
+
+    if(result && ((log.n_allocations != 0) || (log.n_bytes != 0))) {
+        printf("error: %zu allocations (%zu bytes) were not freed\n",
+               log.n_allocations, log.n_bytes);
+        result = false;
+    }
+
+    return result;
+}
+
+static bool
+map_test_build_failure() {
+    // Building a map runs out of memory midway. The elements which were
+    // already allocated must be returned to the shared allocator.
+
+    map_upstream_log log = {};
+
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp,
+                          .block_size = 16,
+                          .max_block_size = 16,
+                          .region_fn = map_upstream_log_alloc,
+                          .deallocate_fn = map_upstream_log_free,
+                          .region_context = &log};
+
+    cfg.allocator = ucs_allocator_create(ucs_map_allocator_config(cfg));
+    if(cfg.allocator == NULL) {
+        printf("error: failed to create allocator\n");
+        return false;
+    }
+
+    ucs_map_object_storage map_storage[2] = {};
+    ucs_map map = ucs_map_create_in_place(cfg, map_storage[0].mem);
+    ucs_map other = ucs_map_create_in_place(cfg, map_storage[1].mem);
+
+    bool result = false;
+    static map_key keys[key_array_size];
+
+    if((map == NULL) || (other == NULL)) {
+        printf("error: failed to create map\n");
+        goto cleanup;
+    }
+
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        keys[j] = j;
+    }
+
+    // Elements of another map stay in the allocator.
+    if(!ucs_map_build_sorted_array(other, keys, sizeof(keys[0]), 20)) {
+        printf("error: failed to build map\n");
+        goto cleanup;
+    }
+
+    size_t const live_slot_count =
+        ucs_allocator_stats(cfg.allocator).live_slot_count;
+
+    log.max_calls = log.n_calls + 8;
+    if(ucs_map_build_sorted_array(map, keys, sizeof(keys[0]), key_array_size)) {
+        printf("error: map was built beyond the memory limit\n");
+        goto cleanup;
+    }
+
+    if((ucs_map_size(map) != 0) ||
+       (ucs_allocator_stats(cfg.allocator).live_slot_count !=
+        live_slot_count)) {
+        printf("error: failed build leaked %zu elements\n",
+               ucs_allocator_stats(cfg.allocator).live_slot_count -
+                   live_slot_count);
+        goto cleanup;
+    }
+
+    result = map_validate_and_print(other, keys, 20);
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    ucs_map_destroy_in_place(other);
+    ucs_allocator_destroy(cfg.allocator);
+
+    if(result && ((log.n_allocations != 0) || (log.n_bytes != 0))) {
+        printf("error: %zu allocations (%zu bytes) were not freed\n",
+               log.n_allocations, log.n_bytes);
+        result = false;
+    }
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Thread-safe allocator test.
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+    allocator_test_thread_count = 4,
+    allocator_test_slot_count = 4096,
+    allocator_test_round_count = 16
+};
+
+typedef struct allocator_test_worker {
+    ucs_allocator allocator;
+    size_t id;
+
+    // Slots which are allocated by this worker, and slots which are allocated
+    // by another worker, and are freed by this one.
+    size_t* slots[allocator_test_slot_count];
+    size_t** foreign_slots;
+
+    size_t error_count;
+} allocator_test_worker;
+
+static int
+allocator_test_worker_allocate(void* context) {
+    allocator_test_worker* worker = context;
+
+    for(size_t j = 0; j != allocator_test_slot_count; ++j) {
+        size_t* slot = ucs_allocator_alloc(worker->allocator);
+        worker->slots[j] = slot;
+
+        if(slot == NULL) {
+            worker->error_count++;
+            continue;
+        }
+
+        slot[0] = slot[1] = worker->id * allocator_test_slot_count + j;
+    }
+
+    return 0;
+}
+
+static int
+allocator_test_worker_churn(void* context) {
+    allocator_test_worker* worker = context;
+
+    // Free the slots of another worker, then allocate and free slots of
+    // random lifetimes.
+    for(size_t j = 0; j != allocator_test_slot_count; ++j) {
+        ucs_allocator_free(worker->allocator, worker->foreign_slots[j]);
+    }
+
+    for(size_t round = 0; round != allocator_test_round_count; ++round) {
+        allocator_test_worker_allocate(worker);
+
+        for(size_t j = 0; j != allocator_test_slot_count; ++j) {
+            size_t* slot = worker->slots[j];
+            size_t expected = worker->id * allocator_test_slot_count + j;
+
+            if((slot != NULL) && ((slot[0] != expected) ||
+                                  (slot[1] != expected))) {
+                worker->error_count++;
+            }
+
+            if((j * 7 + round) % 3 != 0) {
+                ucs_allocator_free(worker->allocator, slot);
+                worker->slots[j] = NULL;
+            }
+        }
+
+        if(worker->id == 0) {
+            ucs_allocator_shrink(worker->allocator, 0);
+        }
+
+        for(size_t j = 0; j != allocator_test_slot_count; ++j) {
+            ucs_allocator_free(worker->allocator, worker->slots[j]);
+        }
+    }
+
+    return 0;
+}
+
+static int
+allocator_test_ptr_cmp(void const* x, void const* y) {
+    uintptr_t a = (uintptr_t)(*((size_t* const*)(x)));
+    uintptr_t b = (uintptr_t)(*((size_t* const*)(y)));
+
+    return (a > b) - (a < b);
+}
+
+static bool
+allocator_test_run_workers(allocator_test_worker* workers, thrd_start_t fn) {
+    thrd_t threads[allocator_test_thread_count] = {};
+    size_t thread_count = 0;
+
+    for(; thread_count != allocator_test_thread_count; ++thread_count) {
+        if(thrd_create(&threads[thread_count], fn, &workers[thread_count]) !=
+           thrd_success) {
+            printf("error: failed to create thread\n");
+            break;
+        }
+    }
+
+    size_t error_count = 0;
+    for(size_t j = 0; j != thread_count; ++j) {
+        thrd_join(threads[j], NULL);
+        error_count += workers[j].error_count;
+    }
+
+    if(error_count != 0) {
+        printf("error: %zu errors in allocator threads\n", error_count);
+    }
+
+    return (thread_count == allocator_test_thread_count) &&
+           (error_count == 0);
+}
+
+static bool
+allocator_test_thread_safe() {
+    ucs_allocator_config alloc_cfg = {
+        .block_size = 64,
+        .max_block_size = 4096,
+        .element_alignment = alignof(size_t),
+        .element_size = sizeof(size_t),
+        .flags = ucs_allocator_flag_intrusive | ucs_allocator_flag_thread_safe,
+        .trim_high_watermark = 1024,
+        .trim_low_watermark = 256};
+
+    // Magazines are linked through the first two words of slots.
+    ucs_allocator_object_storage allocator_storage = {};
+    if(ucs_allocator_create_in_place(alloc_cfg, allocator_storage.mem) !=
+       NULL) {
+        printf("error: created thread-safe allocator with small slots\n");
+        return false;
+    }
+
+    alloc_cfg.element_size = 2 * sizeof(size_t);
+    ucs_allocator allocator = ucs_allocator_create(alloc_cfg);
+
+    if(allocator == NULL) {
+        printf("error: failed to create allocator\n");
+        return false;
+    }
+
+    bool result = false;
+
+    size_t const n = allocator_test_thread_count * allocator_test_slot_count;
+    size_t** all_slots = malloc(n * sizeof(size_t*));
+    allocator_test_worker* workers =
+        calloc(allocator_test_thread_count, sizeof(allocator_test_worker));
+
+    if((all_slots == NULL) || (workers == NULL)) {
+        printf("error: failed to allocate memory\n");
+        goto cleanup;
+    }
+
+    for(size_t j = 0; j != allocator_test_thread_count; ++j) {
+        workers[j] =
+            (allocator_test_worker){.allocator = allocator, .id = j};
+    }
+
+    // Slots which are allocated concurrently must be distinct.
+    if(!allocator_test_run_workers(workers, allocator_test_worker_allocate)) {
+        goto cleanup;
+    }
+
+    for(size_t j = 0; j != allocator_test_thread_count; ++j) {
+        memcpy(all_slots + j * allocator_test_slot_count, workers[j].slots,
+               sizeof(workers[j].slots));
+    }
+
+    qsort(all_slots, n, sizeof(size_t*), allocator_test_ptr_cmp);
+    for(size_t j = 1; j != n; ++j) {
+        if(all_slots[j - 1] == all_slots[j]) {
+            printf("error: slot is allocated twice\n");
+            goto cleanup;
+        }
+    }
+
+    // Each worker frees the slots of another one (all of them are checked
+    // first, since churn overwrites the slots).
+    for(size_t j = 0; j != allocator_test_thread_count; ++j) {
+        for(size_t i = 0; i != allocator_test_slot_count; ++i) {
+            size_t expected = j * allocator_test_slot_count + i;
+            if(workers[j].slots[i][0] != expected) {
+                printf("error: slot is shared\n");
+                goto cleanup;
+            }
+        }
+    }
+
+    size_t** foreign_slots = malloc(n * sizeof(size_t*));
+    if(foreign_slots == NULL) {
+        printf("error: failed to allocate memory\n");
+        goto cleanup;
+    }
+
+    for(size_t j = 0; j != allocator_test_thread_count; ++j) {
+        memcpy(foreign_slots + j * allocator_test_slot_count, workers[j].slots,
+               sizeof(workers[j].slots));
+    }
+
+    for(size_t j = 0; j != allocator_test_thread_count; ++j) {
+        workers[j].foreign_slots =
+            foreign_slots + ((j + 1) % allocator_test_thread_count) *
+                                allocator_test_slot_count;
+    }
+
+    result = allocator_test_run_workers(workers, allocator_test_worker_churn);
+    free(foreign_slots);
+
+    // Slots in the caches of exited threads are returned to their blocks.
+    ucs_allocator_shrink(allocator, 0);
+    ucs_allocator_statistics stats = ucs_allocator_stats(allocator);
+
+    if(result && ((stats.live_slot_count != 0) || (stats.block_count != 0))) {
+        printf("error: slots are kept by exited threads\n");
+        result = false;
+    }
+
+cleanup:
+    free(workers);
+    free(all_slots);
+    ucs_allocator_destroy(allocator);
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory statistics test.
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+allocator_test_stats(unsigned flags) {
+    ucs_allocator_config alloc_cfg = {.block_size = 16,
+                                      .element_alignment = alignof(size_t),
+                                      .element_size = 2 * sizeof(size_t),
+                                      .flags = flags};
+
+    ucs_allocator allocator = ucs_allocator_create(alloc_cfg);
+    if(allocator == NULL) {
+        printf("error: failed to create allocator\n");
+        return false;
+    }
+
+    bool result = false;
+    void* slots[100] = {};
+
+    for(size_t j = 0; j != array_size_(slots); ++j) {
+        if((slots[j] = ucs_allocator_alloc(allocator)) == NULL) {
+            printf("error: failed to allocate memory\n");
+            goto cleanup;
+        }
+    }
+
+    for(size_t j = 0; j != 40; ++j) {
+        ucs_allocator_free(allocator, slots[j]);
+    }
+
+    ucs_allocator_statistics stats = ucs_allocator_stats(allocator);
+    size_t capacity = stats.live_slot_count + stats.free_slot_count;
+
+    if((stats.live_slot_count != 60) || (stats.alloc_count != 100) ||
+       (stats.free_count != 40) || (stats.peak_live_slot_count < 100) ||
+       (stats.block_count * 16 != capacity) || (capacity < 112) ||
+       (stats.reserved_size < capacity * alloc_cfg.element_size)) {
+        printf("error: wrong allocator statistics\n");
+        goto cleanup;
+    }
+
+    // Released blocks are not counted, and the high-water mark is kept (all
+    // blocks have the same size, so a single block remains).
+    ucs_allocator_free_all(allocator);
+    ucs_allocator_shrink(allocator, 16);
+
+    stats = ucs_allocator_stats(allocator);
+    if((stats.live_slot_count != 0) || (stats.free_count != 100) ||
+       (stats.peak_live_slot_count < 100) || (stats.block_count != 1) ||
+       (stats.free_slot_count != 16)) {
+        printf("error: wrong allocator statistics after shrinking\n");
+        goto cleanup;
+    }
+
+    result = true;
+
+cleanup:
+    ucs_allocator_destroy(allocator);
+    return result;
+}
+
+static bool
+map_test_memory_usage(unsigned flags) {
+    if(!allocator_test_stats(0) ||
+       !allocator_test_stats(ucs_allocator_flag_intrusive) ||
+       !allocator_test_stats(ucs_allocator_flag_intrusive |
+                             ucs_allocator_flag_thread_safe)) {
+        return false;
+    }
+
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    map_key keys[key_array_size] = {};
+
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        keys[j] = j;
+        if(ucs_map_insert(map, &keys[j]) == NULL) {
+            printf("error: failed to insert key %d\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    for(unsigned j = 0; j != key_array_size / 2; ++j) {
+        ucs_map_remove(map, &keys[j]);
+    }
+
+    ucs_map_memory_statistics stats = ucs_map_memory_usage(map);
+    bool is_btree = ((flags & ucs_map_flag_btree) != 0);
+
+    printf("memory usage: %zu bytes in %zu + %zu blocks\n", stats.total_size,
+           stats.elements.block_count, stats.bnodes.block_count);
+
+    if((stats.elements.live_slot_count != key_array_size / 2) ||
+       (stats.elements.peak_live_slot_count != key_array_size) ||
+       (stats.elements.free_count != key_array_size / 2) ||
+       (stats.total_size < stats.elements.reserved_size +
+                               stats.bnodes.reserved_size) ||
+       (is_btree != (stats.bnodes.live_slot_count != 0))) {
+        printf("error: wrong map memory statistics\n");
+        goto cleanup;
+    }
+
+    result = true;
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map statistics test.
+////////////////////////////////////////////////////////////////////////////////
+
+static bool
+map_test_stats(unsigned flags) {
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    ucs_map_object_storage map_storage = {};
+    ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return false;
+    }
+
+    bool result = false;
+    map_key keys[key_array_size] = {};
+
+    // Ascending insertions make AVL trees rotate, and B-trees split nodes.
+    // Removals make B-tree nodes borrow items from their siblings.
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        keys[j] = j;
+        if(ucs_map_insert(map, &keys[j]) == NULL) {
+            printf("error: failed to insert key %d\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    for(unsigned j = 0; j != key_array_size; ++j) {
+        if(ucs_map_find(map, &keys[j]) == NULL) {
+            printf("error: failed to find key %d\n", keys[j]);
+            goto cleanup;
+        }
+    }
+
+    // Note: removals can reduce the height.
+    size_t const find_height = ucs_map_stats(map).height;
+
+    for(unsigned j = 0; j != key_array_size; j += 2) {
+        ucs_map_remove(map, &keys[j]);
+    }
+
+    // Height of an AVL tree with 1024 elements is in range [11, 14], and
+    // B-tree nodes contain from 8 to 16 children.
+    ucs_map_statistics stats = ucs_map_stats(map);
+    bool is_btree = ((flags & ucs_map_flag_btree) != 0);
+
+    printf("height: %zu, comparisons: %zu, rotations: %zu, rebalance steps: "
+           "%zu\n",
+           stats.height, stats.comparison_count, stats.rotation_count,
+           stats.rebalance_step_count);
+
+    if((stats.height > find_height) ||
+       (is_btree ? ((stats.height < 3) || (stats.height > 4))
+                 : ((stats.height < 11) || (stats.height > 14)))) {
+        printf("error: wrong height of the tree\n");
+        goto cleanup;
+    }
+
+#ifdef UCS_MAP_INSTRUMENTATION
+    size_t descent_count = 0;
+    for(size_t j = 0; j != ucs_map_depth_histogram_size; ++j) {
+        descent_count += stats.depth_histogram[j];
+    }
+
+    if((stats.insert.count != key_array_size) ||
+       (stats.find.count != key_array_size) ||
+       (stats.remove.count != key_array_size / 2) ||
+       (descent_count != 2 * key_array_size + key_array_size / 2) ||
+       (stats.find.depth > stats.find.count * find_height) ||
+       (stats.find.depth < stats.find.count) ||
+       (stats.comparison_count < stats.find.count) ||
+       (stats.rebalance_step_count == 0) || (stats.rotation_count == 0)) {
+        printf("error: wrong map statistics\n");
+        goto cleanup;
+    }
+#else
+    if((stats.comparison_count != 0) || (stats.find.count != 0) ||
+       (stats.rotation_count != 0)) {
+        printf("error: map statistics are maintained\n");
+        goto cleanup;
+    }
+#endif
+
+    ucs_map_stats_reset(map);
+    stats = ucs_map_stats(map);
+
+    if((stats.comparison_count != 0) || (stats.insert.count != 0) ||
+       (stats.depth_histogram[0] != 0) || (stats.height == 0)) {
+        printf("error: failed to reset map statistics\n");
+        goto cleanup;
+    }
+
+    result = true;
+
+cleanup:
+    ucs_map_destroy_in_place(map);
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Set operations test.
+////////////////////////////////////////////////////////////////////////////////
+
+enum { set_test_key_range = 8192 };
+
+static bool
+map_test_set_validate(ucs_map map, unsigned flags,
+                      bool const expected[static set_test_key_range]) {
+    // Check the elements in both directions.
+    size_t n = 0;
+    map_key k = 0;
+
+    for(ucs_map_iterator i = ucs_map_lower(map); i != NULL;
+        i = ucs_map_iterator_next(i), ++n, ++k) {
+        for(; (k != set_test_key_range) && !expected[k]; ++k) {
+        }
+
+        if(iter_value_(i).k != k) {
+            printf("error: unexpected key %d\n", iter_value_(i).k);
+            return false;
+        }
+    }
+
+    for(; (k != set_test_key_range) && !expected[k]; ++k) {
+    }
+
+    if((k != set_test_key_range) || (ucs_map_size(map) != n)) {
+        printf("error: missing keys\n");
+        return false;
+    }
+
+    size_t m = 0;
+    for(ucs_map_iterator i = ucs_map_upper(map); i != NULL;
+        i = ucs_map_iterator_prev(i), ++m) {
+    }
+
+    if(m != n) {
+        printf("error: failed to iterate in reverse order\n");
+        return false;
+    }
+
+    if((flags & ucs_map_flag_order_statistics) != 0) {
+        for(size_t j = 0; j != n; ++j) {
+            ucs_map_iterator i = ucs_map_select(map, j);
+            if((i == NULL) || (ucs_map_iterator_rank(map, i) != j)) {
+                printf("error: wrong order statistics\n");
+                return false;
+            }
+        }
+    }
+
+    if((flags & ucs_map_flag_btree) == 0) {
+        // An AVL tree of height h contains at least F(h + 2) - 1 nodes, where
+        // F is the Fibonacci sequence.
+        size_t a = 1, b = 1;
+        for(size_t h = ucs_map_stats(map).height; h != 0; --h) {
+            b = a + b;
+            a = b - a;
+        }
+
+        if(n < (b - 1)) {
+            printf("error: the tree is not balanced\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+map_test_set_operations(unsigned flags, bool share_allocator,
+                        size_t thread_count) {
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    if(share_allocator) {
+        cfg.allocator = ucs_allocator_create(ucs_map_allocator_config(cfg));
+
+        if(cfg.allocator == NULL) {
+            printf("error: failed to create allocator\n");
+            return false;
+        }
+    }
+
+    // Sizes of the maps: empty maps, large maps, and small maps combined with
+    // large ones.
+    size_t const sizes[][2] = {
+        {0, 100}, {100, 0}, {3000, 2500}, {4000, 20}, {20, 4000}};
+
+    bool result = true;
+
+    for(size_t j = 0; result && (j != 3 * array_size_(sizes)); ++j) {
+        ucs_map_object_storage map_storage[2] = {};
+        ucs_map map = ucs_map_create_in_place(cfg, map_storage[0].mem);
+        ucs_map other = ucs_map_create_in_place(cfg, map_storage[1].mem);
+
+        if((map == NULL) || (other == NULL)) {
+            printf("error: failed to create map\n");
+            ucs_map_destroy_in_place(map);
+            result = false;
+            break;
+        }
+
+        bool keys[2][set_test_key_range] = {};
+        bool expected[set_test_key_range] = {};
+        ucs_map maps[2] = {map, other};
+
+        for(size_t l = 0; l != 2; ++l) {
+            for(size_t n = 0; n != sizes[j / 3][l]; ++n) {
+                map_key k = key_rand() % set_test_key_range;
+                ucs_map_insert(maps[l], &k);
+                keys[l][k] = true;
+            }
+        }
+
+        // Remember an element which is in both maps.
+        map_key common_key = 0;
+        ucs_map_iterator common = NULL;
+
+        for(map_key k = 0; (common == NULL) && (k != set_test_key_range);
+            ++k) {
+            if(keys[0][k] && keys[1][k]) {
+                common_key = k;
+                common = ucs_map_find(map, &common_key);
+            }
+        }
+
+        for(map_key k = 0; k != set_test_key_range; ++k) {
+            switch(j % 3) {
+                case 0:
+                    expected[k] = keys[0][k] || keys[1][k];
+                    break;
+                case 1:
+                    expected[k] = keys[0][k] && keys[1][k];
+                    break;
+                case 2:
+                    expected[k] = keys[0][k] && !keys[1][k];
+                    break;
+            }
+        }
+
+        switch(j % 3) {
+            case 0:
+                if(!ucs_map_union(map, other, thread_count)) {
+                    printf("error: failed to unite maps\n");
+                    result = false;
+                }
+
+                memset(keys[1], 0, sizeof(keys[1]));
+                break;
+            case 1:
+                ucs_map_intersection(map, other, thread_count);
+                break;
+            case 2:
+                ucs_map_difference(map, other, thread_count);
+                common = NULL;
+                break;
+        }
+
+        result = result && map_test_set_validate(map, flags, expected) &&
+                 map_test_set_validate(other, flags, keys[1]);
+
+        // Elements of the map stay in place.
+        if(result && (common != NULL) &&
+           (ucs_map_find(map, &common_key) != common)) {
+            printf("error: element with key %d was moved\n", common_key);
+            result = false;
+        }
+
+        // Removed elements are freed (concurrent maps free them later).
+        size_t live = ucs_map_size(map) +
+                      (share_allocator ? ucs_map_size(other) : 0);
+
+        if(result && ((flags & ucs_map_flag_concurrent) == 0) &&
+           (ucs_map_memory_usage(map).elements.live_slot_count != live)) {
+            printf("error: wrong number of allocated elements\n");
+            result = false;
+        }
+
+        // The tree remains consistent.
+        for(map_key k = 0; result && (k != set_test_key_range); ++k) {
+            if(ucs_map_remove(map, &k) != expected[k]) {
+                printf("error: failed to remove key %d\n", k);
+                result = false;
+            }
+        }
+
+        ucs_map_destroy_in_place(map);
+        ucs_map_destroy_in_place(other);
+    }
+
+    if(share_allocator) {
+        ucs_allocator_statistics stats = ucs_allocator_stats(cfg.allocator);
+
+        if(result && (stats.live_slot_count != 0)) {
+            printf("error: maps did not free their elements\n");
+            result = false;
+        }
+
+        ucs_allocator_destroy(cfg.allocator);
+    }
+
+    return result;
+}
+
+static bool
+map_test_split_join(unsigned flags, bool share_allocator) {
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    if(share_allocator) {
+        cfg.allocator = ucs_allocator_create(ucs_map_allocator_config(cfg));
+
+        if(cfg.allocator == NULL) {
+            printf("error: failed to create allocator\n");
+            return false;
+        }
+    }
+
+    size_t const sizes[] = {0, 1, 100, 3000};
+    map_key const split_keys[] = {0, 100, 4096, set_test_key_range};
+
+    bool result = true;
+
+    // Each map is split with each key in three ways: to the map and another
+    // one, to another one and the map, and to two other maps.
+    for(size_t j = 0;
+        result && (j != 3 * array_size_(sizes) * array_size_(split_keys));
+        ++j) {
+        ucs_map_object_storage map_storage[3] = {};
+        ucs_map maps[3];
+
+        for(size_t l = 0; l != 3; ++l) {
+            maps[l] = ucs_map_create_in_place(cfg, map_storage[l].mem);
+        }
+
+        if((maps[0] == NULL) || (maps[1] == NULL) || (maps[2] == NULL)) {
+            printf("error: failed to create map\n");
+
+            for(size_t l = 0; l != 3; ++l) {
+                ucs_map_destroy_in_place(maps[l]);
+            }
+
+            result = false;
+            break;
+        }
+
+        ucs_map map = maps[0];
+        map_key const split_key = split_keys[(j / 3) % array_size_(split_keys)];
+
+        bool keys[set_test_key_range] = {};
+        bool parts[2][set_test_key_range] = {};
+
+        for(size_t n = 0; n != sizes[j / (3 * array_size_(split_keys))]; ++n) {
+            map_key k = key_rand() % set_test_key_range;
+            ucs_map_insert(map, &k);
+            keys[k] = true;
+            parts[(k < split_key) ? 0 : 1][k] = true;
+        }
+
+        // Remember the last element of the map.
+        ucs_map_iterator last = ucs_map_upper(map);
+        map_key last_key =
+            ((last != NULL) ? ((map_element*)(ucs_map_iterator_mem(last)))->k
+                            : 0);
+
+        ucs_map left = ((j % 3 == 0) ? map : maps[1]),
+                right = ((j % 3 == 1) ? map : maps[2]);
+
+        if(!ucs_map_split(map, &split_key, left, right)) {
+            printf("error: failed to split map\n");
+            result = false;
+        }
+
+        result = result && map_test_set_validate(left, flags, parts[0]) &&
+                 map_test_set_validate(right, flags, parts[1]);
+
+        if(result && (map != left) && (map != right) &&
+           (ucs_map_size(map) != 0)) {
+            printf("error: the map is not empty\n");
+            result = false;
+        }
+
+        // Elements keep their addresses unless they are copied.
+        ucs_map owner = ((last_key < split_key) ? left : right);
+        bool const in_place =
+            (share_allocator || (owner == map)) &&
+            ((flags & (ucs_map_flag_btree | ucs_map_flag_concurrent)) == 0);
+
+        if(result && (last != NULL) && in_place &&
+           (ucs_map_find(owner, &last_key) != last)) {
+            printf("error: element with key %d was moved\n", last_key);
+            result = false;
+        }
+
+        // Maps with overlapping keys are not joined.
+        if(result && (ucs_map_size(left) != 0) && (ucs_map_size(right) != 0)) {
+            ucs_map_iterator i = ucs_map_upper(right);
+            map_key k = iter_value_(i).k;
+            ucs_map_insert(left, &k);
+            parts[0][k] = true;
+
+            if(ucs_map_join(right, left)) {
+                printf("error: joined overlapping maps\n");
+                result = false;
+            }
+
+            result = result && map_test_set_validate(left, flags, parts[0]) &&
+                     map_test_set_validate(right, flags, parts[1]);
+
+            ucs_map_remove(left, &k);
+            parts[0][k] = false;
+        }
+
+        // Join the parts back, in either order.
+        ucs_map target = ((j % 2 == 0) ? left : right),
+                source = ((j % 2 == 0) ? right : left);
+
+        if(result && !ucs_map_join(target, source)) {
+            printf("error: failed to join maps\n");
+            result = false;
+        }
+
+        result = result && map_test_set_validate(target, flags, keys) &&
+                 (ucs_map_size(source) == 0);
+
+        // The tree remains consistent.
+        for(map_key k = 0; result && (k != set_test_key_range); ++k) {
+            if(ucs_map_remove(target, &k) != keys[k]) {
+                printf("error: failed to remove key %d\n", k);
+                result = false;
+            }
+        }
+
+        for(size_t l = 0; l != 3; ++l) {
+            ucs_map_destroy_in_place(maps[l]);
+        }
+    }
+
+    if(share_allocator) {
+        ucs_allocator_statistics stats = ucs_allocator_stats(cfg.allocator);
+
+        if(result && (stats.live_slot_count != 0)) {
+            printf("error: maps did not free their elements\n");
+            result = false;
+        }
+
+        ucs_allocator_destroy(cfg.allocator);
+    }
+
+    return result;
+}
+
+static bool
+map_test_remove_range(unsigned flags) {
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    size_t const sizes[] = {0, 1, 100, 3000};
+
+    // Ranges: empty and reversed ranges, small and large ranges, and the whole
+    // key range.
+    map_key const ranges[][2] = {{0, 0},
+                                 {200, 100},
+                                 {100, 200},
+                                 {0, 1000},
+                                 {1, 7000},
+                                 {4096, set_test_key_range},
+                                 {0, set_test_key_range}};
+
+    bool result = true;
+
+    for(size_t j = 0;
+        result && (j != array_size_(sizes) * array_size_(ranges)); ++j) {
+        ucs_map_object_storage map_storage = {};
+        ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+        if(map == NULL) {
+            printf("error: failed to create map\n");
+            result = false;
+            break;
+        }
+
+        map_key const* range = ranges[j % array_size_(ranges)];
+        bool expected[set_test_key_range] = {};
+        size_t removed = 0;
+
+        for(size_t n = 0; n != sizes[j / array_size_(ranges)]; ++n) {
+            map_key k = key_rand() % set_test_key_range;
+            ucs_map_insert(map, &k);
+            expected[k] = true;
+        }
+
+        for(map_key k = range[0]; k < range[1]; ++k) {
+            removed += (expected[k] ? 1 : 0);
+            expected[k] = false;
+        }
+
+        if(ucs_map_remove_range(map, &range[0], &range[1]) != removed) {
+            printf("error: wrong number of removed elements\n");
+            result = false;
+        }
+
+        result = result && map_test_set_validate(map, flags, expected);
+
+        // Removed elements are freed (concurrent maps free them later).
+        if(result && ((flags & ucs_map_flag_concurrent) == 0) &&
+           (ucs_map_memory_usage(map).elements.live_slot_count !=
+            ucs_map_size(map))) {
+            printf("error: wrong number of allocated elements\n");
+            result = false;
+        }
+
+        // The tree remains consistent.
+        for(map_key k = 0; result && (k != set_test_key_range); ++k) {
+            if(ucs_map_remove(map, &k) != expected[k]) {
+                printf("error: failed to remove key %d\n", k);
+                result = false;
+            }
+        }
+
+        ucs_map_destroy_in_place(map);
+    }
+
+    return result;
+}
+
+static bool
+map_test_cursor(unsigned flags) {
+    ucs_map_config cfg = {.element_alignment = alignof(map_element),
+                          .element_size = sizeof(map_element),
+                          .flags = flags,
+                          .key_set_fn = map_key_set,
+                          .key_get_fn = map_key_get,
+                          .key_cmp_fn = map_key_cmp};
+
+    size_t const sizes[] = {0, 1, 3000};
+    size_t const batch_sizes[] = {1, 7, 64, 5000};
+    map_key const start_keys[] = {0, 100, 4096, set_test_key_range};
+
+    enum {
+        n_combinations = array_size_(batch_sizes) * array_size_(start_keys)
+    };
+
+    static map_element buffer[5000];
+    static char* elements[5000];
+
+    bool result = true;
+
+    for(size_t j = 0; result && (j != array_size_(sizes) * n_combinations);
+        ++j) {
+        ucs_map_object_storage map_storage = {};
+        ucs_map map = ucs_map_create_in_place(cfg, map_storage.mem);
+
+        if(map == NULL) {
+            printf("error: failed to create map\n");
+            result = false;
+            break;
+        }
+
+        for(size_t n = 0; n != sizes[j / n_combinations]; ++n) {
+            map_key k = key_rand() % set_test_key_range;
+            ucs_map_insert(map, &k);
+        }
+
+        size_t const batch_size = batch_sizes[j % array_size_(batch_sizes)];
+        size_t const start_i = j / array_size_(batch_sizes);
+        map_key start_key = start_keys[start_i % array_size_(start_keys)];
+
+        // Read the elements in batches (alternately copying the elements and
+        // storing pointers), and compare them with the iteration.
+        ucs_map_iterator i = ucs_map_lower_bound(map, &start_key);
+        ucs_map_cursor c = ucs_map_cursor_at(map, &start_key);
+
+        for(bool copy = true; result && (i != NULL); copy = !copy) {
+            if(ucs_map_cursor_iterator(c) != i) {
+                printf("error: wrong cursor position\n");
+                result = false;
+                break;
+            }
+
+            size_t n = (copy ? ucs_map_cursor_read(map, &c, (char*)(buffer),
+                                                   batch_size)
+                             : ucs_map_cursor_read_ptrs(map, &c, elements,
+                                                        batch_size));
+
+            for(size_t l = 0; result && (l != batch_size);
+                ++l, i = ucs_map_iterator_next(i)) {
+                if((i == NULL) != (l >= n)) {
+                    printf("error: wrong number of read elements\n");
+                    result = false;
+                } else if(i == NULL) {
+                    break;
+                }
+
+                map_element* e = (map_element*)(ucs_map_iterator_mem(i));
+
+                if(copy ? (memcmp(&buffer[l], e, sizeof(*e)) != 0)
+                        : (elements[l] != (char*)(e))) {
+                    printf("error: wrong element %d\n", e->k);
+                    result = false;
+                }
+            }
+        }
+
+        if(result &&
+           ((ucs_map_cursor_iterator(c) != NULL) ||
+            (ucs_map_cursor_read(map, &c, (char*)(buffer), 1) != 0))) {
+            printf("error: cursor is not exhausted\n");
+            result = false;
+        }
+
+        ucs_map_destroy_in_place(map);
+    }
+
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Program entry point.
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main() {
+    // Allocate storage for a map object on stack. {map_storage.mem} has right
+    // alignment and size to store an object of map type.
+    ucs_map_object_storage map_storage = {};
+
+    // Create a new map in allocated storage. This map will contain objects of
+    // the {map_element} type.
+    ucs_map map = ucs_map_create_in_place(
+        // Specify map's element alignment and size. Also specify functions
+        // which set/get/compare map's keys.
+        (ucs_map_config){.element_alignment = alignof(map_element),
+                         .element_size = sizeof(map_element),
+                         // Maintain subtree sizes, so that the k-th element
+                         // can be found in O(log n).
+                         .flags = ucs_map_flag_order_statistics,
+                         .key_set_fn = map_key_set,
+                         .key_get_fn = map_key_get,
+                         .key_cmp_fn = map_key_cmp},
+        // Pass a pointer to the allocated storage for the map.
+        map_storage.mem);
+
+    if(map == NULL) {
+        printf("error: failed to create map\n");
+        return EXIT_FAILURE;
+    }
+
+    int result = EXIT_SUCCESS;
+    unsigned map_size_expected = 0;
+    map_key keys[key_array_size] = {};
+
+    // Insert elements to the map.
+    printf("inserting elements:\n");
+    if(true) {
+        map_key* k = keys;
+        for(unsigned i = 0; i != key_array_size; ++i, ++k) {
+            printf("%4d ", (*k = key_rand() % 8192));
+            ucs_map_insert(map, k);
+        }
+
+        map_size_expected = key_array_sort_and_remove_duplicates(keys);
+    }
+
+    printf("\n\n");
+
+    if(!map_validate_and_print(map, keys, map_size_expected)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Remove half of the map's elements.
+    printf("removing half of the map's elements\n");
+    for(unsigned k = 0; k < (map_size_expected / 2); ++k) {
+        unsigned l = key_rand() % (map_size_expected - k);
+        ucs_map_iterator i = ucs_map_select(map, l);
+
+        printf("%4d ", iter_value_(i).k);
+        if(!ucs_map_remove(map, &(iter_value_(i).k))) {
+            printf("error: failed to remove element with key %d\n",
+                   iter_value_(i).k);
+
+            result = EXIT_FAILURE;
+            goto cleanup;
+        }
+    }
+
+    if(true) {
+        ptrdiff_t j = 0;
+        for(ucs_map_iterator i = ucs_map_lower(map); i != NULL;
+            i = ucs_map_iterator_next(i)) {
+            keys[j++] = iter_value_(i).k;
+        }
+    }
+
+    printf("\n\n");
+
+    // Insert new elements to the map.
+    printf("inserting half of the map's elements again:\n");
+    if(true) {
+        map_key* k = &keys[(ptrdiff_t)(map_size_expected / 2)];
+        for(unsigned i = 0; i < (map_size_expected / 2); ++i, ++k) {
+            printf("%4d ", (*k = key_rand() % 8192));
+            ucs_map_insert(map, k);
+        }
+
+        map_size_expected = key_array_sort_and_remove_duplicates(keys);
+    }
+
+    printf("\n\n");
+
+    if(!map_validate_and_print(map, keys, map_size_expected)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test lower bounds.
+    printf("testing lower bounds:\n");
+    if(true) {
+        map_key bounds[] = {5656, 2227, 6031, 893};
+        map_key expected[] = {5660, 2228, 6031, 896};
+
+        for(size_t j = 0; j < array_size_(bounds); ++j) {
+            map_key k = bounds[j];
+            ucs_map_iterator i = ucs_map_lower_bound(map, &k);
+
+            if(i == NULL) {
+                printf("error: failed to find lower bound for %d\n", k);
+
+                result = EXIT_FAILURE;
+                goto cleanup;
+            } else {
+                if(iter_value_(i).k != expected[j]) {
+                    printf(
+                        "error: wrong lower bound for %d (expected: %d, got: "
+                        "%d)\n",
+                        k, expected[j], iter_value_(i).k);
+
+                    result = EXIT_FAILURE;
+                    goto cleanup;
+                }
+
+                printf("k : %4d, e : %4d\n", k, iter_value_(i).k);
+            }
+        }
+
+        if(true) {
+            map_key k = 8191;
+            ucs_map_iterator i = ucs_map_lower_bound(map, &k);
+
+            if(i != NULL) {
+                printf(
+                    "error: found lower bound for %d when none is expected\n",
+                    k);
+
+                result = EXIT_FAILURE;
+                goto cleanup;
+            } else {
+                printf("k : %4d, e : none\n", k);
+            }
+        }
+    }
+
+    // Test order statistics.
+    printf("\ntesting order statistics\n");
+    if(!map_test_order_statistics(ucs_map_flag_order_statistics) ||
+       !map_test_order_statistics(0)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test bulk construction.
+    printf("\ntesting bulk construction\n");
+    if(!map_test_build_sorted()) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test batch application.
+    printf("\ntesting batch application\n");
+    if(!map_test_apply_batch()) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test hinted insertion.
+    printf("\ntesting hinted insertion\n");
+    if(!map_test_insert_hint()) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test B-tree map.
+    printf("\ntesting B-tree map\n");
+    if(!map_test_btree() || !map_test_order_statistics(ucs_map_flag_btree)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test frozen map.
+    printf("\ntesting frozen map\n");
+    if(!map_test_frozen(NULL) || !map_test_frozen(map_key_prefix) ||
+       !map_test_frozen_image(0, NULL) ||
+       !map_test_frozen_image(ucs_map_flag_order_statistics, map_key_prefix) ||
+       !map_test_frozen_image(ucs_map_flag_btree, map_key_prefix)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test key prefixes.
+    printf("\ntesting key prefixes\n");
+    if(!map_test_key_prefixes(ucs_map_flag_order_statistics) ||
+       !map_test_key_prefixes(ucs_map_flag_btree)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test type-specialized map.
+    printf("\ntesting type-specialized map\n");
+    if(!map_test_typed()) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test concurrent map.
+    printf("\ntesting concurrent map\n");
+    if(!map_test_concurrent()) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test persistent map.
+    printf("\ntesting persistent map\n");
+    if(!map_test_persistent()) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test maps in fixed memory regions.
+    printf("\ntesting fixed memory region\n");
+    if(!map_test_region(0) || !map_test_region(ucs_map_flag_btree)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test memory release.
+    printf("\ntesting memory release\n");
+    if(!map_test_shrink(0) || !map_test_shrink(ucs_map_flag_btree)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test block growth, memory reservation and huge pages.
+    printf("\ntesting memory reservation\n");
+    if(!map_test_reserve(0) || !map_test_reserve(ucs_map_flag_btree) ||
+       !map_test_huge_pages(0) || !map_test_huge_pages(ucs_map_flag_btree)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test upstream memory functions.
+    printf("\ntesting upstream memory functions\n");
+    if(!map_test_upstream(0) || !map_test_upstream(ucs_map_flag_btree) ||
+       !map_test_upstream(ucs_map_flag_concurrent) || !pmap_test_upstream() ||
+       !map_test_build_failure()) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test thread-safe allocator.
+    printf("\ntesting thread-safe allocator\n");
+    if(!allocator_test_thread_safe()) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test memory statistics.
+    printf("\ntesting memory statistics\n");
+    if(!map_test_memory_usage(0) ||
+       !map_test_memory_usage(ucs_map_flag_btree)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test map statistics.
+    printf("\ntesting map statistics\n");
+    if(!map_test_stats(0) || !map_test_stats(ucs_map_flag_btree)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Test set operations.
+    printf("\ntesting set operations\n");
+    if(!map_test_set_operations(ucs_map_flag_order_statistics, false, 1) ||
+       !map_test_set_operations(0, true, 1) ||
+       !map_test_set_operations(ucs_map_flag_order_statistics, true, 4) ||
+       !map_test_set_operations(ucs_map_flag_btree, false, 4) ||
+       !map_test_set_operations(ucs_map_flag_concurrent, true, 1)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    printf("\ntesting split and join\n");
+    if(!map_test_split_join(ucs_map_flag_order_statistics, false) ||
+       !map_test_split_join(0, false) || !map_test_split_join(0, true) ||
+       !map_test_split_join(ucs_map_flag_order_statistics, true) ||
+       !map_test_split_join(ucs_map_flag_btree, false) ||
+       !map_test_split_join(ucs_map_flag_concurrent, true)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    printf("\ntesting range removal\n");
+    if(!map_test_remove_range(0) ||
+       !map_test_remove_range(ucs_map_flag_order_statistics) ||
+       !map_test_remove_range(ucs_map_flag_btree) ||
+       !map_test_remove_range(ucs_map_flag_concurrent)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    printf("\ntesting cursors\n");
+    if(!map_test_cursor(0) || !map_test_cursor(ucs_map_flag_btree) ||
+       !map_test_cursor(ucs_map_flag_concurrent)) {
+        result = EXIT_FAILURE;
+        goto cleanup;
+    }
+
     printf("\nsuccess\n");
 
 cleanup: